@@ -1,5 +1,6 @@
 #include "common.h"
 
+#include <algorithm>
 #include <cstring>
 #include <type_traits>
 
@@ -22,6 +23,30 @@ uint64_t CalculateIthHash(const uint8_t* data, size_t size, size_t i, size_t mod
     return CalculateIthHash(h128.first, h128.second, i, mod);
 }
 
+std::strong_ordering CompareKeys(KeyView lhs, KeyView rhs) {
+    size_t common_size = std::min(lhs.size(), rhs.size());
+    int cmp = common_size ? std::memcmp(lhs.data(), rhs.data(), common_size) : 0;
+    return cmp != 0 ? cmp <=> 0 : lhs.size() <=> rhs.size();
+}
+
+bool IsVersionVisible(SequenceNumber sequence, SequenceNumber newer_sequence,
+                      std::span<const SequenceNumber> snapshots) {
+    if (newer_sequence == kMaxSequenceNumber) {
+        return true;
+    }
+    auto it = std::lower_bound(snapshots.begin(), snapshots.end(), sequence);
+    return it != snapshots.end() && *it < newer_sequence;
+}
+
+VersionRetention RetainVersion(SequenceNumber sequence, SequenceNumber newer_sequence, bool is_tombstone,
+                               bool delete_tombstones, std::span<const SequenceNumber> snapshots) {
+    // No snapshot sees past a version that the oldest one sees, so a tombstone like that hides nothing.
+    bool seen_by_all = snapshots.empty() || sequence <= snapshots.front();
+    return {.keep = IsVersionVisible(sequence, newer_sequence, snapshots) &&
+                    !(is_tombstone && delete_tombstones && seen_by_all),
+            .stop = seen_by_all};
+}
+
 std::vector<uint8_t> ToBytes(const std::string& s) {
     return std::vector<uint8_t>(s.begin(), s.end());
 }
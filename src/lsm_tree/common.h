@@ -1,39 +1,99 @@
 #pragma once
 
+#include <compare>
 #include <cstddef>
 #include <cstdint>
 #include <filesystem>
+#include <limits>
 #include <map>
 #include <memory>
 #include <optional>
 #include <set>
+#include <span>
 #include <vector>
 
 namespace MyLSMTree {
 
 using Offset = size_t;
 
+// Sstables of the legacy format index every record and end with the first five fields of MetaBlock.
+constexpr uint64_t kSSTableFormatLegacy = 0;
+// Records are grouped into data blocks and the index holds the offset and the first key of every block.
+constexpr uint64_t kSSTableFormatBlockBased = 1;
+// Adds the filter type to MetaBlock.
+constexpr uint64_t kSSTableFormatFilterType = 2;
+// Every record carries the sequence number of its write. The versions of a key are stored from the newest to the
+// oldest and never span data blocks.
+constexpr uint64_t kSSTableFormatSequenceNumbers = 3;
+constexpr uint64_t kSSTableFormatLatest = kSSTableFormatSequenceNumbers;
+// Ends every sstable written in a versioned format.
+constexpr uint64_t kSSTableMagic = 0x31425453534d534cULL;
+
+enum class FilterType : uint64_t {
+    // Probes are spread over the whole bit array.
+    kStandard = 0,
+    // All probes of a key fall into one 64-byte block.
+    kBlocked = 1,
+};
+
+// Every format version appends its fields right before format_version, so an older MetaBlock is a prefix of the
+// current one followed by format_version and magic. Fields unknown to a version keep their zero defaults.
 struct MetaBlock {
-    Offset filter_offset;
-    size_t filter_bits_count;
-    size_t filter_hash_func_count;
-    Offset index_offset;
-    size_t kv_count;
+    Offset filter_offset = 0;
+    size_t filter_bits_count = 0;
+    size_t filter_hash_func_count = 0;
+    Offset index_offset = 0;
+    size_t kv_count = 0;
+    size_t block_count = 0;
+    FilterType filter_type = FilterType::kStandard;
+    uint64_t format_version = kSSTableFormatLatest;
+    uint64_t magic = kSSTableMagic;
 };
 
+constexpr size_t kLegacyMetaBlockSize = offsetof(MetaBlock, block_count);
+
+// Size of the fields preceding format_version in a MetaBlock of the given version.
+constexpr size_t GetMetaBlockFieldsSize(uint64_t format_version) {
+    switch (format_version) {
+        case kSSTableFormatLegacy:
+            return kLegacyMetaBlockSize;
+        case kSSTableFormatBlockBased:
+            return offsetof(MetaBlock, filter_type);
+        default:
+            return offsetof(MetaBlock, format_version);
+    }
+}
+
 using Key = std::vector<uint8_t>;
 using KeyPtr = std::unique_ptr<Key>;
+using KeyView = std::span<const uint8_t>;
 using Value = std::vector<uint8_t>;
+using ValueView = std::span<const uint8_t>;
 using Values = std::vector<Value>;
 using RangeLookupResult = std::map<Key, Value>;
 using LookupResult = std::optional<Value>;
 using Path = std::filesystem::path;
+// Orders the writes of the tree. A read at a sequence number sees the writes up to it and none of the later ones.
+using SequenceNumber = uint64_t;
+
+constexpr SequenceNumber kMaxSequenceNumber = std::numeric_limits<SequenceNumber>::max();
 
 struct KVSizes {
     uint32_t key_size;
     uint32_t value_size;
 };
 
+// Starts every record of an sstable from kSSTableFormatSequenceNumbers on. Records of the older formats start with
+// bare KVSizes and are read with sequence number 0.
+struct RecordHeader {
+    KVSizes sizes;
+    SequenceNumber sequence;
+};
+
+constexpr size_t GetRecordHeaderSize(uint64_t format_version) {
+    return format_version < kSSTableFormatSequenceNumbers ? sizeof(KVSizes) : sizeof(RecordHeader);
+}
+
 struct KeyRange {
     std::optional<Key> lower;
     std::optional<Key> upper;
@@ -50,6 +110,27 @@ std::pair<uint64_t, uint64_t> CalculateHash(const uint8_t* data, size_t size);
 uint64_t CalculateIthHash(uint64_t low64, uint64_t high64, size_t i, size_t mod);
 uint64_t CalculateIthHash(const uint8_t* data, size_t size, size_t i, size_t mod);
 
+std::strong_ordering CompareKeys(KeyView lhs, KeyView rhs);
+
+// Whether a version of a key has to survive a flush or a compaction. The versions are checked from the newest to the
+// oldest, newer_sequence is the sequence number of the previous one, or kMaxSequenceNumber for the newest, which is
+// always kept. An older version is kept if some snapshot sees it: the snapshot is not older than the version but older
+// than the next one. snapshots must be sorted.
+bool IsVersionVisible(SequenceNumber sequence, SequenceNumber newer_sequence,
+                      std::span<const SequenceNumber> snapshots);
+
+struct VersionRetention {
+    // The version is written.
+    bool keep;
+    // No snapshot sees the older versions of the key, so they can be skipped.
+    bool stop;
+};
+
+// What a flush or a compaction does with a version of a key, the versions go as for IsVersionVisible. Tombstones are
+// dropped where delete_tombstones allows it and every snapshot sees past them.
+VersionRetention RetainVersion(SequenceNumber sequence, SequenceNumber newer_sequence, bool is_tombstone,
+                               bool delete_tombstones, std::span<const SequenceNumber> snapshots);
+
 std::vector<uint8_t> ToBytes(const std::string& s);
 
 }  // namespace MyLSMTree
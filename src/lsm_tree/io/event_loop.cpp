@@ -0,0 +1,299 @@
+#include "event_loop.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace MyLSMTree::IO {
+
+namespace {
+
+int IOUringSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IOUringEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int IOUringRegister(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+// Linux 5.5 sets up a ring but fails every IORING_OP_READ and IORING_OP_WRITE with -EINVAL. The ops came in 5.6
+// together with IORING_REGISTER_PROBE, so a kernel that can't be probed can't run them either.
+bool SupportsRequestOperations(int ring_fd) {
+    constexpr unsigned kProbeOpCount = 256;
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + kProbeOpCount * sizeof(io_uring_probe_op));
+    auto* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+    if (IOUringRegister(ring_fd, IORING_REGISTER_PROBE, probe, kProbeOpCount) != 0) {
+        return false;
+    }
+    for (unsigned operation : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC}) {
+        if (operation > probe->last_op || !(probe->ops[operation].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The rings are shared with the kernel, which reads the tails we publish and publishes its own.
+unsigned LoadAcquire(unsigned* value) {
+    return std::atomic_ref<unsigned>(*value).load(std::memory_order_acquire);
+}
+
+void StoreRelease(unsigned* value, unsigned new_value) {
+    std::atomic_ref<unsigned>(*value).store(new_value, std::memory_order_release);
+}
+
+template <typename T>
+T* GetRingField(void* ring, uint32_t offset) {
+    return reinterpret_cast<T*>(static_cast<uint8_t*>(ring) + offset);
+}
+
+}  // namespace
+
+EventLoop::EventLoop(size_t queue_depth, size_t fallback_thread_count, bool use_io_uring) {
+    if (!queue_depth || !fallback_thread_count) {
+        throw std::runtime_error("EventLoop must have queue_depth > 0 and fallback_thread_count > 0.");
+    }
+    if (use_io_uring && SetUpRing(queue_depth)) {
+        return;
+    }
+    workers_.reserve(fallback_thread_count);
+    for (size_t i = 0; i < fallback_thread_count; ++i) {
+        workers_.emplace_back(&EventLoop::RunWorker, this);
+    }
+}
+
+EventLoop::~EventLoop() noexcept {
+    if (ring_fd_ >= 0) {
+        munmap(sqes_, sqes_size_);
+        if (cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        munmap(sq_ring_, sq_ring_size_);
+        close(ring_fd_);
+    }
+    {
+        const std::lock_guard guard(mtx_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+bool EventLoop::UsesIOUring() const {
+    return ring_fd_ >= 0;
+}
+
+EventLoop::RequestAwaiter EventLoop::Read(int fd, uint8_t* data, size_t size, Offset offset) {
+    return MakeRequest(Operation::kRead, fd, data, size, offset);
+}
+
+EventLoop::RequestAwaiter EventLoop::Write(int fd, const uint8_t* data, size_t size, Offset offset) {
+    return MakeRequest(Operation::kWrite, fd, const_cast<uint8_t*>(data), size, offset);
+}
+
+EventLoop::RequestAwaiter EventLoop::Sync(int fd) {
+    return MakeRequest(Operation::kSync, fd, nullptr, 0, 0);
+}
+
+void EventLoop::SubmitPending() {
+    if (unsubmitted_) {
+        EnterRing(0);
+    }
+}
+
+EventLoop::RequestAwaiter EventLoop::MakeRequest(Operation operation, int fd, uint8_t* data, size_t size,
+                                                 Offset offset) {
+    return RequestAwaiter(*this, Request{.operation = operation,
+                                         .fd = fd,
+                                         .data = data,
+                                         .size = std::min(size, kMaxRequestSize),
+                                         .offset = offset,
+                                         .result = 0,
+                                         .handle = nullptr});
+}
+
+bool EventLoop::SetUpRing(size_t queue_depth) {
+    io_uring_params params{};
+    int ring_fd = IOUringSetup(static_cast<unsigned>(std::min<size_t>(queue_depth, 1 << 12)), &params);
+    // Without the ops the requests go to the thread pool instead.
+    if (ring_fd < 0 || !(params.features & IORING_FEAT_NODROP) || !SupportsRequestOperations(ring_fd)) {
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+        return false;
+    }
+    size_t sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+    size_t sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                         IORING_OFF_SQ_RING);
+    void* cq_ring = single_mmap || sq_ring == MAP_FAILED
+                        ? sq_ring
+                        : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                               IORING_OFF_CQ_RING);
+    void* sqes = cq_ring == MAP_FAILED ? MAP_FAILED
+                                       : mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                              ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        close(ring_fd);
+        return false;
+    }
+
+    ring_fd_ = ring_fd;
+    sq_ring_ = sq_ring;
+    sq_ring_size_ = sq_ring_size;
+    cq_ring_ = cq_ring;
+    cq_ring_size_ = cq_ring_size;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+    sqes_size_ = sqes_size;
+    sq_tail_ = GetRingField<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask_ = GetRingField<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_array_ = GetRingField<unsigned>(sq_ring, params.sq_off.array);
+    cq_head_ = GetRingField<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail_ = GetRingField<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask_ = GetRingField<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes_ = GetRingField<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+    // The completion ring is at least as large, so it never overflows either.
+    ring_capacity_ = params.sq_entries;
+    return true;
+}
+
+void EventLoop::Submit(Request& request) {
+    ++in_flight_;
+    if (ring_fd_ < 0) {
+        {
+            const std::lock_guard guard(mtx_);
+            work_queue_.emplace_back(&request);
+        }
+        work_cv_.notify_one();
+        return;
+    }
+    if (ring_in_flight_ == ring_capacity_) {
+        overflow_.emplace_back(&request);
+        return;
+    }
+    PushToRing(request);
+}
+
+void EventLoop::PushToRing(Request& request) {
+    // Only this thread writes the submission ring, and it never holds more than ring_capacity_ requests.
+    unsigned tail = *sq_tail_;
+    unsigned index = tail & *sq_mask_;
+    io_uring_sqe& sqe = sqes_[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = request.fd;
+    if (request.operation == Operation::kSync) {
+        sqe.opcode = IORING_OP_FSYNC;
+    } else {
+        sqe.opcode = request.operation == Operation::kRead ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe.addr = reinterpret_cast<uint64_t>(request.data);
+        sqe.len = static_cast<uint32_t>(request.size);
+        sqe.off = request.offset;
+    }
+    sqe.user_data = reinterpret_cast<uint64_t>(&request);
+    sq_array_[index] = index;
+    StoreRelease(sq_tail_, tail + 1);
+    ++ring_in_flight_;
+    ++unsubmitted_;
+}
+
+void EventLoop::ProcessCompletions() {
+    std::vector<Request*> completed;
+    if (ring_fd_ >= 0) {
+        ProcessRingCompletions(completed);
+    } else {
+        ProcessPoolCompletions(completed);
+    }
+    in_flight_ -= completed.size();
+    // The resumed coroutines may submit more requests, they are sent to the kernel with the next wait.
+    for (Request* request : completed) {
+        request->handle.resume();
+    }
+}
+
+void EventLoop::EnterRing(unsigned min_complete) {
+    while (true) {
+        int submitted = IOUringEnter(ring_fd_, unsubmitted_, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0) {
+            unsubmitted_ -= submitted;
+            return;
+        }
+        if (errno != EINTR && errno != EAGAIN) {
+            throw std::runtime_error(std::string("Can't submit I/O to io_uring: ") + std::strerror(errno));
+        }
+    }
+}
+
+void EventLoop::ProcessRingCompletions(std::vector<Request*>& completed) {
+    EnterRing(1);
+    unsigned head = *cq_head_;
+    unsigned tail = LoadAcquire(cq_tail_);
+    for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+        auto* request = reinterpret_cast<Request*>(cqe.user_data);
+        request->result = cqe.res;
+        completed.emplace_back(request);
+    }
+    StoreRelease(cq_head_, head);
+    ring_in_flight_ -= completed.size();
+    while (!overflow_.empty() && ring_in_flight_ < ring_capacity_) {
+        PushToRing(*overflow_.front());
+        overflow_.pop_front();
+    }
+}
+
+void EventLoop::ProcessPoolCompletions(std::vector<Request*>& completed) {
+    std::unique_lock lock(mtx_);
+    done_cv_.wait(lock, [this] { return !done_.empty(); });
+    completed.swap(done_);
+}
+
+void EventLoop::RunWorker() {
+    std::unique_lock lock(mtx_);
+    while (true) {
+        work_cv_.wait(lock, [this] { return stop_ || !work_queue_.empty(); });
+        if (work_queue_.empty()) {
+            return;
+        }
+        Request* request = work_queue_.front();
+        work_queue_.pop_front();
+        lock.unlock();
+        ssize_t r;
+        do {
+            if (request->operation == Operation::kRead) {
+                r = pread(request->fd, request->data, request->size, request->offset);
+            } else if (request->operation == Operation::kWrite) {
+                r = pwrite(request->fd, request->data, request->size, request->offset);
+            } else {
+                r = fsync(request->fd);
+            }
+        } while (r < 0 && errno == EINTR);
+        request->result = r < 0 ? -errno : r;
+        lock.lock();
+        done_.emplace_back(request);
+        done_cv_.notify_one();
+    }
+}
+
+}  // namespace MyLSMTree::IO
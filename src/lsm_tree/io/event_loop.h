@@ -0,0 +1,156 @@
+#pragma once
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "task.h"
+#include "../common.h"
+
+struct io_uring_cqe;
+struct io_uring_sqe;
+
+namespace MyLSMTree::IO {
+
+// Runs coroutines on the thread that calls Run and serves their reads, writes and syncs asynchronously: through
+// io_uring if the kernel allows it, otherwise through a pool of threads that make the blocking calls. The requests
+// that the coroutines issue between two waits are submitted with one system call, or earlier with SubmitPending.
+// Coroutines are resumed only by Run, on its thread, so they need no synchronization between each other. A loop is
+// used by one thread at a time, and it must be idle when destroyed.
+class EventLoop {
+    enum class Operation : uint8_t {
+        kRead,
+        kWrite,
+        kSync,
+    };
+
+    struct Request {
+        Operation operation;
+        int fd;
+        uint8_t* data;
+        size_t size;
+        Offset offset;
+        // Bytes transferred, or the negated errno.
+        int64_t result;
+        std::coroutine_handle<> handle;
+    };
+
+public:
+    class RequestAwaiter {
+        friend class EventLoop;
+
+    public:
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            request_.handle = handle;
+            loop_->Submit(request_);
+        }
+
+        // Bytes transferred, fewer than requested at the end of the file, or the negated errno. 0 for a sync.
+        int64_t await_resume() const noexcept {
+            return request_.result;
+        }
+
+    private:
+        RequestAwaiter(EventLoop& loop, const Request& request) : loop_(&loop), request_(request) {
+        }
+
+    private:
+        EventLoop* loop_;
+        Request request_;
+    };
+
+    static constexpr size_t kDefaultQueueDepth = 256;
+    static constexpr size_t kDefaultFallbackThreadCount = 4;
+    // Longer reads and writes are cut, the kernel takes at most 4GB in one request.
+    static constexpr size_t kMaxRequestSize = 1 << 30;
+
+    // At most queue_depth requests are in the kernel at once, the rest wait in the loop. With use_io_uring set to
+    // false or without io_uring the requests are served by fallback_thread_count threads.
+    explicit EventLoop(size_t queue_depth = kDefaultQueueDepth,
+                       size_t fallback_thread_count = kDefaultFallbackThreadCount, bool use_io_uring = true);
+    EventLoop(const EventLoop&) = delete;
+    ~EventLoop() noexcept;
+
+    bool UsesIOUring() const;
+    RequestAwaiter Read(int fd, uint8_t* data, size_t size, Offset offset);
+    RequestAwaiter Write(int fd, const uint8_t* data, size_t size, Offset offset);
+    // Flushes the data and the metadata of the file to the disk, like fsync.
+    RequestAwaiter Sync(int fd);
+    // Hands the requests issued since the last wait to the kernel without waiting for any, so they are served while
+    // the running coroutine goes on computing.
+    void SubmitPending();
+    // Runs the task and the I/O it waits for until the task is over.
+    template <typename T>
+    T Run(Task<T> task);
+
+private:
+    bool SetUpRing(size_t queue_depth);
+    RequestAwaiter MakeRequest(Operation operation, int fd, uint8_t* data, size_t size, Offset offset);
+    // Submits the unsubmitted requests, and waits for at least min_complete requests to complete.
+    void EnterRing(unsigned min_complete);
+    void Submit(Request& request);
+    void PushToRing(Request& request);
+    // Waits for some requests to complete and resumes their coroutines.
+    void ProcessCompletions();
+    void ProcessRingCompletions(std::vector<Request*>& completed);
+    void ProcessPoolCompletions(std::vector<Request*>& completed);
+    void RunWorker();
+
+private:
+    // Submitted requests that are not completed yet.
+    size_t in_flight_ = 0;
+
+    int ring_fd_ = -1;
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned ring_capacity_ = 0;
+    // Requests in the ring, of which the last unsubmitted_ are not passed to the kernel yet.
+    unsigned ring_in_flight_ = 0;
+    unsigned unsubmitted_ = 0;
+    // Requests waiting for room in the ring.
+    std::deque<Request*> overflow_;
+
+    // Guards the queues of the fallback threads.
+    std::mutex mtx_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::deque<Request*> work_queue_;
+    std::vector<Request*> done_;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+template <typename T>
+T EventLoop::Run(Task<T> task) {
+    task.Start();
+    while (!task.IsDone()) {
+        if (!in_flight_) {
+            throw std::runtime_error("EventLoop can't run a task that waits for anything but its I/O.");
+        }
+        ProcessCompletions();
+    }
+    return task.TakeResult();
+}
+
+}  // namespace MyLSMTree::IO
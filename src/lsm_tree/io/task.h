@@ -0,0 +1,315 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace MyLSMTree::IO {
+
+template <typename T>
+class Task;
+
+namespace Detail {
+
+struct TaskPromiseBase {
+    struct FinalAwaiter {
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) const noexcept {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() const noexcept {
+        }
+    };
+
+    std::suspend_always initial_suspend() const noexcept {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept {
+        return {};
+    }
+
+    void unhandled_exception() noexcept {
+        error = std::current_exception();
+    }
+
+    // Resumed once the task is over.
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+    Task<T> get_return_object() noexcept;
+
+    void return_value(T result) {
+        value.emplace(std::move(result));
+    }
+
+    T TakeResult() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object() noexcept;
+
+    void return_void() const noexcept {
+    }
+
+    void TakeResult() const {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+}  // namespace Detail
+
+// Coroutine that starts once it is awaited or started, and resumes the coroutine awaiting it right when it is over.
+// Exceptions are passed on to whoever takes the result.
+template <typename T>
+class Task {
+    friend struct Detail::TaskPromise<T>;
+
+public:
+    using promise_type = Detail::TaskPromise<T>;
+
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+
+    ~Task() noexcept {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) const noexcept {
+        handle_.promise().continuation = awaiting;
+        return handle_;
+    }
+
+    T await_resume() const {
+        return handle_.promise().TakeResult();
+    }
+
+    // Runs the task up to its first suspension, nobody is resumed when it is over.
+    void Start() const {
+        handle_.resume();
+    }
+
+    bool IsDone() const {
+        return handle_.done();
+    }
+
+    T TakeResult() const {
+        return handle_.promise().TakeResult();
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace Detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Coroutine that starts right away and frees itself when it is over.
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() const noexcept {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() const noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() const noexcept {
+            return {};
+        }
+
+        void return_void() const noexcept {
+        }
+
+        void unhandled_exception() const noexcept {
+            std::terminate();
+        }
+    };
+};
+
+struct Countdown {
+    size_t remaining;
+    std::coroutine_handle<> awaiting;
+};
+
+// Awaits a task without taking its result.
+template <typename T>
+struct DoneAwaiter {
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) const noexcept {
+        return task.await_suspend(handle);
+    }
+
+    void await_resume() const noexcept {
+    }
+
+    const Task<T>& task;
+};
+
+// The awaiting coroutine is resumed by the task that finishes last.
+template <typename T>
+DetachedTask CountDownWhenDone(const Task<T>& task, Countdown& countdown) {
+    co_await DoneAwaiter<T>{task};
+    if (!--countdown.remaining) {
+        countdown.awaiting.resume();
+    }
+}
+
+template <typename T>
+struct WhenAllAwaiter {
+    bool await_ready() const noexcept {
+        return tasks.empty();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle) {
+        // The extra count keeps the tasks that finish right away from resuming the coroutine before it is suspended.
+        countdown = {.remaining = tasks.size() + 1, .awaiting = handle};
+        for (const auto& task : tasks) {
+            CountDownWhenDone(task, countdown);
+        }
+        return --countdown.remaining > 0;
+    }
+
+    void await_resume() const noexcept {
+    }
+
+    const std::vector<Task<T>>& tasks;
+    Countdown countdown{};
+};
+
+template <typename T>
+struct SpawnedState {
+    explicit SpawnedState(Task<T> task) : task(std::move(task)) {
+    }
+
+    Task<T> task;
+    bool done = false;
+    std::coroutine_handle<> awaiting;
+};
+
+template <typename T>
+struct FutureAwaiter {
+    bool await_ready() const noexcept {
+        return state->done;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) const noexcept {
+        state->awaiting = handle;
+    }
+
+    T await_resume() const {
+        return state->task.TakeResult();
+    }
+
+    SpawnedState<T>* state;
+};
+
+template <typename T>
+DetachedTask RunSpawned(SpawnedState<T>& state) {
+    co_await DoneAwaiter<T>{state.task};
+    state.done = true;
+    // The awaiting coroutine may free the state, so it is not touched after this.
+    if (state.awaiting) {
+        state.awaiting.resume();
+    }
+}
+
+}  // namespace Detail
+
+// Task that runs in the background from the moment it is spawned, while the coroutine that spawned it goes on.
+// Awaiting it waits until it is over and takes its result. It must be over before it is destroyed.
+template <typename T>
+class Future {
+    template <typename U>
+    friend Future<U> Spawn(Task<U> task);
+
+public:
+    Detail::FutureAwaiter<T> operator co_await() const noexcept {
+        return {state_.get()};
+    }
+
+private:
+    explicit Future(std::unique_ptr<Detail::SpawnedState<T>> state) : state_(std::move(state)) {
+    }
+
+private:
+    std::unique_ptr<Detail::SpawnedState<T>> state_;
+};
+
+// Runs the task up to its first suspension and returns.
+template <typename T>
+Future<T> Spawn(Task<T> task) {
+    auto state = std::make_unique<Detail::SpawnedState<T>>(std::move(task));
+    Detail::RunSpawned(*state);
+    return Future<T>(std::move(state));
+}
+
+// Runs the tasks together and gives their results in the same order. The first exception of the tasks is passed on
+// once all of them are over.
+template <typename T>
+auto WhenAll(std::vector<Task<T>> tasks) -> Task<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>> {
+    co_await Detail::WhenAllAwaiter<T>{tasks};
+    if constexpr (std::is_void_v<T>) {
+        for (const auto& task : tasks) {
+            task.TakeResult();
+        }
+    } else {
+        std::vector<T> res;
+        res.reserve(tasks.size());
+        for (const auto& task : tasks) {
+            res.emplace_back(task.TakeResult());
+        }
+        co_return res;
+    }
+}
+
+}  // namespace MyLSMTree::IO
@@ -1,18 +1,49 @@
 #include "lsm_tree.h"
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstring>
 #include <queue>
+#include <utility>
 
 #include "sstable/sstable_reader.h"
+#include "sstable/sstable_writer.h"
 
 namespace MyLSMTree {
 
 namespace {
 
+constexpr size_t kMaxWriteGroupSizeInBytes = 1 << 20;
+
 struct TreeParams {
+    LSMTreeOptions options;
+    size_t memtable_kv_count;
+    size_t level_count;
+    size_t next_sstable_id;
+    size_t min_log_number;
+    size_t log_number;
+    // Not below the sequence number of any record in the sstables and memtables of the persisted state.
+    SequenceNumber last_sequence;
+};
+
+// tree_data starts with this header. Baseline trees have none, their tree_data starts with BaselineTreeParams.
+constexpr uint64_t kTreeDataMagic = 0x6572544d534c794d;  // "MyLSMTre"
+constexpr uint32_t kTreeDataVersion = 1;
+
+struct TreeDataHeader {
+    uint64_t magic;
+    uint32_t version;
+    // TreeParams embeds the options, so its layout changes with them.
+    uint32_t params_size;
+};
+
+// Followed by the sstable count of every level and the dumped memtable. The first field can't match the magic.
+struct BaselineTreeParams {
     size_t sstable_scaling_factor;
     size_t memtable_kv_count_limit;
     size_t memtable_kv_count;
@@ -24,6 +55,8 @@ struct TreeParams {
     size_t level_count;
 };
 
+constexpr size_t kMaxBaselineLevelCount = 64;
+
 struct BloomParams {
     size_t bits_count;
     size_t hash_func_count;
@@ -33,129 +66,318 @@ void ThrowCantOpenTree(const Path& tree_data) {
     throw std::runtime_error(std::string("Can't open tree at ") + tree_data.c_str() + ": " + std::strerror(errno));
 }
 
+void ThrowUnknownTreeFormat(const Path& tree_data) {
+    throw std::runtime_error(std::string("Can't open tree at ") + tree_data.c_str() + ": unknown or corrupted format");
+}
+
+void ReadTreeData(int fd, void* data, size_t size, const Path& tree_data) {
+    if (size != 0 && read(fd, data, size) != static_cast<ssize_t>(size)) {
+        ThrowUnknownTreeFormat(tree_data);
+    }
+}
+
+void ReadTreeDataKV(int fd, const KVSizes& sizes, Key& key, Value& value, const Path& tree_data) {
+    // Garbage sizes would otherwise allocate gigabytes before the short read is noticed.
+    struct stat stat;
+    if (fstat(fd, &stat) != 0 ||
+        static_cast<uint64_t>(sizes.key_size) + sizes.value_size > static_cast<uint64_t>(stat.st_size)) {
+        ThrowUnknownTreeFormat(tree_data);
+    }
+    key.resize(sizes.key_size);
+    value.resize(sizes.value_size);
+    ReadTreeData(fd, key.data(), key.size() * sizeof(key[0]), tree_data);
+    ReadTreeData(fd, value.data(), value.size() * sizeof(value[0]), tree_data);
+}
+
+void ThrowCantPersistTree(const Path& tree_data) {
+    throw std::runtime_error(std::string("Can't persist tree at ") + tree_data.c_str() + ": " +
+                             std::strerror(errno));
+}
+
+void ThrowCantCreateSSTable(const Path& path) {
+    throw std::runtime_error(std::string("Can't create/write sstable with name ") + path.c_str() + ": " +
+                             std::strerror(errno));
+}
+
+void ThrowCantCreateLog(const Path& path) {
+    throw std::runtime_error(std::string("Can't create log with name ") + path.c_str() + ": " + std::strerror(errno));
+}
+
+int CreateSSTableFile(const Path& path) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ThrowCantCreateSSTable(path);
+    }
+    return fd;
+}
+
+// Makes the names of the files in the directory of path durable, a synced file may be lost without its name.
+bool SyncDirectory(const Path& path) {
+    Path directory = path.parent_path();
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return synced;
+}
+
 BloomParams ComputeBloomParams(size_t key_count, double false_positive_rate) {
     if (key_count == 0) {
         return {0, 0};
     }
 
     constexpr double ln2 = 0.6931471805599453;
-    double bits_count = -static_cast<double>(key_count) * std::logl(false_positive_rate) / (ln2 * ln2);
+    double bits_count = -static_cast<double>(key_count) * std::log(false_positive_rate) / (ln2 * ln2);
     double hash_func_count = (bits_count / key_count) * ln2;
 
     return {static_cast<size_t>(std::ceil(bits_count)),
             static_cast<size_t>(std::max(1.0, std::round(hash_func_count)))};
 }
 
-Memtable::BloomFilter MakeOptimalFilter(size_t key_count, double false_positive_rate) {
+Memtable::BloomFilter MakeOptimalFilter(size_t key_count, double false_positive_rate, FilterType type) {
     auto params = ComputeBloomParams(key_count, false_positive_rate);
-    return {params.bits_count, params.hash_func_count};
+    return {params.bits_count, params.hash_func_count, type};
+}
+
+// Orders the cursors of a merge for a max-heap: the least key on top, then its newest version. Cursors go from the
+// newest run to the oldest, so of equal sequence numbers, like the 0 of legacy sstables, the newer run's goes first.
+bool MergeOrderGreater(const std::deque<SSTable::SSTableReadersManager::SSTableReader::PrefetchingKVIterator>& cursors,
+                       size_t lhs, size_t rhs) {
+    auto cmp = CompareKeys(cursors[lhs].GetKey(), cursors[rhs].GetKey());
+    if (cmp != 0) {
+        return cmp > 0;
+    }
+    SequenceNumber lhs_sequence = cursors[lhs].GetSequenceNumber();
+    SequenceNumber rhs_sequence = cursors[rhs].GetSequenceNumber();
+    return lhs_sequence < rhs_sequence || (lhs_sequence == rhs_sequence && lhs > rhs);
+}
+
+void ThrowInvalidOptions(const char* what) {
+    throw std::runtime_error(std::string("Invalid LSMTree options: ") + what);
+}
+
+void ValidateOptions(const LSMTreeOptions& options) {
+    if (options.sstable_scaling_factor < 2) {
+        ThrowInvalidOptions("sstable_scaling_factor must be at least 2.");
+    }
+    if (options.compaction_thread_count == 0) {
+        ThrowInvalidOptions("compaction_thread_count must be positive.");
+    }
+    if (options.compaction_readahead_depth == 0) {
+        ThrowInvalidOptions("compaction_readahead_depth must be positive.");
+    }
+    if (options.level0_stop_trigger <= options.sstable_scaling_factor) {
+        ThrowInvalidOptions("level0_stop_trigger must exceed sstable_scaling_factor.");
+    }
 }
 
 }  // namespace
 
-LSMTree::LSMTree(const Path& tree_data) {
+LSMTree::LSMTree(const Path& tree_data) : tree_data_(tree_data) {
     int fd = open(tree_data.c_str(), O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         ThrowCantOpenTree(tree_data);
     }
-    TreeParams params;
-    ssize_t r = read(fd, &params, sizeof(params));
-    if (r != sizeof(params)) {
-        ThrowCantOpenTree(tree_data);
+    std::vector<Path> obsolete_files;
+    try {
+        TreeDataHeader header;
+        ReadTreeData(fd, &header, sizeof(header), tree_data_);
+        if (header.magic != kTreeDataMagic) {
+            lseek(fd, 0, SEEK_SET);
+            obsolete_files = LoadBaselineTreeState(fd);
+        } else if (header.version == kTreeDataVersion && header.params_size == sizeof(TreeParams)) {
+            obsolete_files = LoadTreeState(fd);
+        } else {
+            ThrowUnknownTreeFormat(tree_data_);
+        }
+        // Whatever was read has to be at the end of tree_data.
+        uint8_t byte;
+        if (read(fd, &byte, sizeof(byte)) != 0) {
+            ThrowUnknownTreeFormat(tree_data_);
+        }
+    } catch (...) {
+        close(fd);
+        throw;
     }
+    close(fd);
 
-    memtable_ =
-        std::make_unique<Memtable>(MakeOptimalFilter(params.memtable_kv_count_limit, params.filter_false_positive_rate),
-                                   params.memtable_kv_count_limit, params.kv_buffer_slice_size);
-    readers_manager_ = std::make_unique<SSTable::SSTableReadersManager>(params.fd_cache_size);
-    tree_data_ = tree_data;
-    sstable_scaling_factor_ = params.sstable_scaling_factor;
-    filter_false_positive_rate_ = params.filter_false_positive_rate;
-    memtable_kv_count_limit_ = params.memtable_kv_count_limit;
-
-    levels_.resize(params.level_count);
-    read(fd, levels_.data(), levels_.size() * sizeof(levels_[0]));
-
-    Key key;
-    Value value;
-    for (size_t i = 0; i < params.memtable_kv_count; ++i) {
-        KVSizes sizes;
-        read(fd, &sizes, sizeof(sizes));
-        key.resize(sizes.key_size);
-        value.resize(sizes.value_size);
-        read(fd, key.data(), key.size() * sizeof(key[0]));
-        read(fd, value.data(), value.size() * sizeof(value[0]));
-        memtable_->Insert(key, value);
+    wal_->Commit();
+    wal_->Sync();
+    PersistTreeState(false);
+    for (const auto& path : obsolete_files) {
+        unlink(path.c_str());
     }
+    InstallVersion();
+    StartBackgroundThreads();
+}
 
-    close(fd);
+LSMTree::LSMTree(const LSMTreeOptions& options, const Path& tree_data)
+    : options_(options),
+      readers_manager_(std::make_unique<SSTable::SSTableReadersManager>(
+          options.fd_cache_size, options.table_cache_size, options.scan_readahead_size, options.block_cache_size,
+          options.mmap_sstable_reads)),
+      tree_data_(tree_data) {
+    ValidateOptions(options_);
+    memtable_ = MakeMemtable();
+    wal_ = OpenLog(log_number_);
+    PersistTreeState(false);
+    InstallVersion();
+    StartBackgroundThreads();
 }
 
 LSMTree::LSMTree(size_t fd_cache_size, size_t sstable_scaling_factor, size_t memtable_kv_count_limit,
                  size_t kv_buffer_slice_size, double filter_false_positive_rate, const Path& tree_data)
-    : memtable_(std::make_unique<Memtable>(MakeOptimalFilter(memtable_kv_count_limit, filter_false_positive_rate),
-                                           memtable_kv_count_limit, kv_buffer_slice_size)),
-      readers_manager_(std::make_unique<SSTable::SSTableReadersManager>(fd_cache_size)),
-      tree_data_(tree_data),
-      sstable_scaling_factor_(sstable_scaling_factor),
-      memtable_kv_count_limit_(memtable_kv_count_limit),
-      filter_false_positive_rate_(filter_false_positive_rate) {
+    : LSMTree(LSMTreeOptions{.fd_cache_size = fd_cache_size,
+                             .sstable_scaling_factor = sstable_scaling_factor,
+                             .memtable_kv_count_limit = memtable_kv_count_limit,
+                             .kv_buffer_slice_size = kv_buffer_slice_size,
+                             .filter_false_positive_rate = filter_false_positive_rate,
+                             .level0_slowdown_trigger = 2 * sstable_scaling_factor,
+                             .level0_stop_trigger = 3 * sstable_scaling_factor},
+              tree_data) {
 }
 
 LSMTree::~LSMTree() noexcept {
-    TreeParams params{.sstable_scaling_factor = sstable_scaling_factor_,
-                      .memtable_kv_count_limit = memtable_kv_count_limit_,
-                      .memtable_kv_count = memtable_->GetKVCount(),
-                      .filter_false_positive_rate = filter_false_positive_rate_,
-                      .bits_count = memtable_->GetFilterBitsCount(),
-                      .hash_func_count = memtable_->GetFilterHashFuncCount(),
-                      .kv_buffer_slice_size = memtable_->GetKVBufferSliceSize(),
-                      .fd_cache_size = readers_manager_->CacheSize(),
-                      .level_count = levels_.size()};
-    int fd = open(tree_data_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
-    if (fd < 0) {
+    {
+        const LockGuard guard(mtx_);
+        stopping_ = true;
+    }
+    background_work_cv_.notify_all();
+    compaction_work_cv_.notify_all();
+    subcompaction_work_cv_.notify_all();
+    flush_thread_.join();
+    for (auto& thread : compaction_threads_) {
+        thread.join();
+    }
+    for (auto& thread : subcompaction_threads_) {
+        thread.join();
+    }
+
+    try {
+        PersistTreeState(true);
+    } catch (...) {
         return;
     }
-    write(fd, &params, sizeof(params));
-    write(fd, levels_.data(), levels_.size() * sizeof(levels_[0]));
-    memtable_->DumpKVInFd(fd);
-    fsync(fd);
-    close(fd);
+    // The memtables are in tree_data now, so their logs are no longer needed.
+    wal_ = nullptr;
+    for (size_t number = min_log_number_; number <= log_number_; ++number) {
+        unlink(GetLogPath(number).c_str());
+    }
 }
 
 void LSMTree::Insert(const Key& key, const Value& value) {
-    const LockGuard lock(mtx_);
-
-    memtable_->Insert(key, value);
-    TryCompacting();
+    Write(key, value);
 }
 
 void LSMTree::Erase(const Key& key) {
+    Write(key, Value{});
+}
+
+LookupResult LSMTree::Find(const Key& key) const {
+    // The version is taken first: it holds every record up to the sequence number read after it, or at least the
+    // memtable they are being written to.
+    auto version = GetCurrentVersion();
+    return Find(*version, key, last_sequence_.load(std::memory_order_acquire));
+}
+
+RangeLookupResult LSMTree::FindRange(const KeyRange& range) const {
+    return FindRange(NewIterator(range));
+}
+
+Snapshot LSMTree::GetSnapshot() {
+    // Taken under the lock, so every flush or compaction either sees the snapshot or has only older records to write.
     const LockGuard guard(mtx_);
+    Snapshot snapshot{.sequence = last_sequence_.load(std::memory_order_relaxed)};
+    snapshots_.insert(snapshot.sequence);
+    return snapshot;
+}
 
-    memtable_->Erase(key);
-    TryCompacting();
+void LSMTree::ReleaseSnapshot(const Snapshot& snapshot) {
+    const LockGuard guard(mtx_);
+    auto it = snapshots_.find(snapshot.sequence);
+    if (it == snapshots_.end()) {
+        throw std::runtime_error("Snapshot is not taken from the tree or already released.");
+    }
+    snapshots_.erase(it);
 }
 
-LookupResult LSMTree::Find(const Key& key) const {
+LookupResult LSMTree::Find(const Key& key, const Snapshot& snapshot) const {
+    auto version = GetCurrentVersion();
+    return Find(*version, key, snapshot.sequence);
+}
+
+RangeLookupResult LSMTree::FindRange(const KeyRange& range, const Snapshot& snapshot) const {
+    return FindRange(NewIterator(range, snapshot));
+}
+
+std::vector<LookupResult> LSMTree::MultiGet(std::span<const Key> keys) const {
+    auto version = GetCurrentVersion();
+    return MultiGet(*version, keys, last_sequence_.load(std::memory_order_acquire));
+}
+
+std::vector<LookupResult> LSMTree::MultiGet(std::span<const Key> keys, const Snapshot& snapshot) const {
+    auto version = GetCurrentVersion();
+    return MultiGet(*version, keys, snapshot.sequence);
+}
+
+IO::Task<LookupResult> LSMTree::FindAsync(IO::EventLoop& loop, const Key& key) const {
+    auto version = GetCurrentVersion();
+    return FindAsync(loop, std::move(version), key, last_sequence_.load(std::memory_order_acquire));
+}
+
+IO::Task<LookupResult> LSMTree::FindAsync(IO::EventLoop& loop, const Key& key, const Snapshot& snapshot) const {
+    return FindAsync(loop, GetCurrentVersion(), key, snapshot.sequence);
+}
+
+IO::Task<RangeLookupResult> LSMTree::FindRangeAsync(IO::EventLoop& loop, const KeyRange& range) const {
+    auto version = GetCurrentVersion();
+    return FindRangeAsync(loop, std::move(version), range, last_sequence_.load(std::memory_order_acquire));
+}
+
+IO::Task<RangeLookupResult> LSMTree::FindRangeAsync(IO::EventLoop& loop, const KeyRange& range,
+                                                    const Snapshot& snapshot) const {
+    return FindRangeAsync(loop, GetCurrentVersion(), range, snapshot.sequence);
+}
+
+LSMTree::Iterator LSMTree::NewIterator(const KeyRange& range) const {
+    auto version = GetCurrentVersion();
+    return Iterator(*this, std::move(version), range, last_sequence_.load(std::memory_order_acquire));
+}
+
+LSMTree::Iterator LSMTree::NewIterator(const KeyRange& range, const Snapshot& snapshot) const {
+    return Iterator(*this, GetCurrentVersion(), range, snapshot.sequence);
+}
+
+SSTable::BlockCacheStatistics LSMTree::GetBlockCacheStatistics() const {
+    return readers_manager_->GetBlockCacheStatistics();
+}
+
+BackgroundWorkStatistics LSMTree::GetBackgroundWorkStatistics() const {
     const LockGuard guard(mtx_);
+    return background_work_statistics_;
+}
 
-    if (auto res = memtable_->Find(key); res) {
+LookupResult LSMTree::Find(const Version& version, const Key& key, SequenceNumber snapshot) const {
+    if (auto res = FindInMemtables(version, key, snapshot); res) {
         return res->empty() ? std::nullopt : res;
     }
-    if (levels_.empty()) {
+    if (version.levels.empty()) {
         return std::nullopt;
     }
 
     auto [hash_low, hash_high] = CalculateHash(key.data(), key.size());
     Key buffer;
-    for (size_t i = 0; i < levels_.size(); ++i) {
-        for (size_t j = levels_[i] - 1; ~j; --j) {
-            auto reader = readers_manager_->CreateReader(GetSSTablePath(i, j));
+    for (const auto& level : version.levels) {
+        for (size_t j = level.size() - 1; ~j; --j) {
+            auto reader = readers_manager_->CreateReader(level[j]->path);
             if (!reader.TestHashes(hash_low, hash_high)) {
                 continue;
             }
-            auto [value, buffer_ret] = reader.Find(key, std::move(buffer));
+            auto [value, buffer_ret] = reader.Find(key, snapshot, std::move(buffer));
             if (value) {
                 return value->empty() ? std::nullopt : value;
             }
@@ -166,163 +388,1270 @@ LookupResult LSMTree::Find(const Key& key) const {
     return std::nullopt;
 }
 
-RangeLookupResult LSMTree::FindRange(const KeyRange& range) const {
-    const LockGuard guard(mtx_);
+LookupResult LSMTree::FindInMemtables(const Version& version, const Key& key, SequenceNumber snapshot) {
+    if (auto res = version.memtable->Find(key, snapshot); res) {
+        return res;
+    }
+    return version.immutable_memtable ? version.immutable_memtable->Find(key, snapshot) : std::nullopt;
+}
 
+IO::Task<LookupResult> LSMTree::FindAsync(IO::EventLoop& loop, std::shared_ptr<const Version> version, Key key,
+                                          SequenceNumber snapshot) const {
+    if (auto res = FindInMemtables(*version, key, snapshot); res) {
+        co_return res->empty() ? std::nullopt : res;
+    }
+    auto [hash_low, hash_high] = CalculateHash(key.data(), key.size());
+    for (const auto& level : version->levels) {
+        for (size_t j = level.size() - 1; ~j; --j) {
+            auto reader = readers_manager_->CreateReader(level[j]->path);
+            if (!reader.TestHashes(hash_low, hash_high)) {
+                continue;
+            }
+            if (auto value = co_await reader.FindAsync(loop, key, snapshot); value) {
+                co_return value->empty() ? std::nullopt : value;
+            }
+        }
+    }
+    co_return std::nullopt;
+}
+
+IO::Task<RangeLookupResult> LSMTree::FindRangeAsync(IO::EventLoop& loop, std::shared_ptr<const Version> version,
+                                                    KeyRange range, SequenceNumber snapshot) const {
+    // The sstables are merged like the inputs of a compaction: every one is read in chunks of the scan readahead
+    // size, the next chunk while the previous one is merged. Readers go from the newest run to the oldest, the records
+    // come out by key and then from the newest version, and the first version that the snapshot sees is taken. The
+    // memtables are newer than any sstable and go over the result.
+    std::vector<SSTableReader> readers;
+    for (const auto& level : version->levels) {
+        for (size_t j = level.size() - 1; ~j; --j) {
+            readers.emplace_back(readers_manager_->CreateReader(level[j]->path));
+        }
+    }
+    std::deque<PrefetchingKVIterator> key_buffer;
+    for (const auto& reader : readers) {
+        key_buffer.emplace_back(reader.Begin(loop, 1, range, false));
+    }
     RangeLookupResult res;
-    Key buffer;
-    for (size_t i = levels_.size() - 1; ~i; --i) {
-        for (size_t j = 0; j < levels_[i]; ++j) {
-            auto reader = readers_manager_->CreateReader(GetSSTablePath(i, j));
-            auto [res_ret, buffer_ret] = reader.FindRange(range, std::move(res), std::move(buffer));
-            res = std::move(res_ret);
-            buffer = std::move(buffer_ret);
+    std::exception_ptr error;
+    try {
+        auto comparator = [&key_buffer](size_t lhs, size_t rhs) { return MergeOrderGreater(key_buffer, lhs, rhs); };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(comparator)> heap(comparator);
+        for (size_t i = 0; i < readers.size(); ++i) {
+            if (key_buffer[i].NeedsLoad()) {
+                co_await key_buffer[i].Load();
+            }
+            if (!key_buffer[i].IsEnd()) {
+                heap.emplace(i);
+            }
+        }
+        Key taken_key;
+        bool has_taken_key = false;
+        while (!heap.empty()) {
+            size_t index = heap.top();
+            heap.pop();
+            auto& it = key_buffer[index];
+            KeyView key = it.GetKey();
+            if (it.GetSequenceNumber() <= snapshot && (!has_taken_key || CompareKeys(key, taken_key) != 0)) {
+                taken_key.assign(key.begin(), key.end());
+                has_taken_key = true;
+                if (it.GetValueSize() != 0) {
+                    ValueView value = it.GetValue();
+                    res.emplace_hint(res.end(), taken_key, Value(value.begin(), value.end()));
+                }
+            }
+
+            ++it;
+            if (it.NeedsLoad()) {
+                co_await it.Load();
+            }
+            if (!it.IsEnd()) {
+                heap.push(index);
+            }
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // The buffers of the reads in flight go away with the task.
+    for (auto& it : key_buffer) {
+        co_await it.Drain();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (version->immutable_memtable) {
+        res = version->immutable_memtable->FindRange(range, snapshot, std::move(res));
+    }
+    co_return version->memtable->FindRange(range, snapshot, std::move(res));
+}
+
+std::vector<LookupResult> LSMTree::MultiGet(const Version& version, std::span<const Key> keys,
+                                           SequenceNumber snapshot) const {
+    std::vector<const Key*> key_pointers(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        key_pointers[i] = &keys[i];
+    }
+    // Tombstones are kept as empty values until the end, so the keys they resolve are not looked up further.
+    std::vector<LookupResult> res = version.memtable->MultiFind(key_pointers, snapshot);
+    if (version.immutable_memtable) {
+        std::vector<size_t> indexes;
+        key_pointers.clear();
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (!res[i]) {
+                indexes.emplace_back(i);
+                key_pointers.emplace_back(&keys[i]);
+            }
+        }
+        auto immutable_res = version.immutable_memtable->MultiFind(key_pointers, snapshot);
+        for (size_t j = 0; j < indexes.size(); ++j) {
+            res[indexes[j]] = std::move(immutable_res[j]);
+        }
+    }
+
+    struct PendingKey {
+        size_t index;
+        uint64_t hash_low;
+        uint64_t hash_high;
+    };
+    std::vector<PendingKey> pending;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if (!res[i] && !version.levels.empty()) {
+            auto [hash_low, hash_high] = CalculateHash(keys[i].data(), keys[i].size());
+            pending.emplace_back(i, hash_low, hash_high);
+        }
+    }
+    // Sorted keys let every sstable resolve them in a single pass over its index.
+    std::sort(pending.begin(), pending.end(), [&keys](const PendingKey& lhs, const PendingKey& rhs) {
+        return CompareKeys(keys[lhs.index], keys[rhs.index]) < 0;
+    });
+
+    std::vector<const Key*> table_keys;
+    std::vector<size_t> table_key_positions;
+    for (const auto& level : version.levels) {
+        for (size_t j = level.size() - 1; ~j && !pending.empty(); --j) {
+            auto reader = readers_manager_->CreateReader(level[j]->path);
+            table_keys.clear();
+            table_key_positions.clear();
+            for (size_t p = 0; p < pending.size(); ++p) {
+                if (reader.TestHashes(pending[p].hash_low, pending[p].hash_high)) {
+                    table_keys.emplace_back(&keys[pending[p].index]);
+                    table_key_positions.emplace_back(p);
+                }
+            }
+            if (table_keys.empty()) {
+                continue;
+            }
+            auto table_res = reader.MultiFind(table_keys, snapshot);
+            for (size_t q = 0; q < table_res.size(); ++q) {
+                res[pending[table_key_positions[q]].index] = std::move(table_res[q]);
+            }
+            std::erase_if(pending, [&res](const PendingKey& key) { return res[key.index].has_value(); });
+        }
+    }
+
+    for (auto& value : res) {
+        if (value && value->empty()) {
+            value.reset();
+        }
+    }
+    return res;
+}
+
+RangeLookupResult LSMTree::FindRange(Iterator it) {
+    RangeLookupResult res;
+    for (; it.IsValid(); it.Next()) {
+        KeyView key = it.GetKey();
+        ValueView value = it.GetValue();
+        res.emplace_hint(res.end(), Key(key.begin(), key.end()), Value(value.begin(), value.end()));
+    }
+    return res;
+}
+
+std::vector<SequenceNumber> LSMTree::GetLiveSnapshots() const {
+    return std::vector<SequenceNumber>(snapshots_.begin(), snapshots_.end());
+}
+
+bool LSMTree::Iterator::IsValid() const {
+    return !heap_.empty() && !IsPastLower(GetKey(heap_.front())) && !IsPastUpper(GetKey(heap_.front()));
+}
+
+void LSMTree::Iterator::Seek(const Key& key) {
+    if (range_.lower.has_value() && CompareKeys(key, *range_.lower) <= 0) {
+        SeekToFirst();
+        return;
+    }
+    SeekSources(&key, false);
+    SkipDeleted();
+}
+
+void LSMTree::Iterator::SeekForPrev(const Key& key) {
+    if (range_.upper.has_value() && CompareKeys(key, *range_.upper) >= 0) {
+        SeekToLast();
+        return;
+    }
+    SeekSources(&key, true);
+    SkipDeleted();
+}
+
+void LSMTree::Iterator::SeekToFirst() {
+    SeekSources(range_.lower.has_value() ? &*range_.lower : nullptr, false);
+    if (range_.lower.has_value() && !range_.including_lower && !heap_.empty() &&
+        CompareKeys(GetKey(heap_.front()), *range_.lower) == 0) {
+        SkipKey();
+    }
+    SkipDeleted();
+}
+
+void LSMTree::Iterator::SeekToLast() {
+    SeekSources(range_.upper.has_value() ? &*range_.upper : nullptr, true);
+    if (range_.upper.has_value() && !range_.including_upper && !heap_.empty() &&
+        CompareKeys(GetKey(heap_.front()), *range_.upper) == 0) {
+        SkipKey();
+    }
+    SkipDeleted();
+}
+
+void LSMTree::Iterator::Next() {
+    if (backward_) {
+        // The current key is visible, so it is on top again once the sources are turned around.
+        KeyView current = GetKey();
+        Key key(current.begin(), current.end());
+        SeekSources(&key, false);
+    }
+    SkipKey();
+    SkipDeleted();
+}
+
+void LSMTree::Iterator::Prev() {
+    if (!backward_) {
+        KeyView current = GetKey();
+        Key key(current.begin(), current.end());
+        SeekSources(&key, true);
+    }
+    SkipKey();
+    SkipDeleted();
+}
+
+KeyView LSMTree::Iterator::GetKey() const {
+    return GetKey(heap_.front());
+}
+
+ValueView LSMTree::Iterator::GetValue() const {
+    return GetValue(heap_.front());
+}
+
+LSMTree::Iterator::Iterator(const LSMTree& tree, std::shared_ptr<const Version> version, const KeyRange& range,
+                            SequenceNumber snapshot)
+    : version_(std::move(version)), range_(range) {
+    memtable_iterators_.emplace_back(version_->memtable->NewIterator(snapshot));
+    if (version_->immutable_memtable) {
+        memtable_iterators_.emplace_back(version_->immutable_memtable->NewIterator(snapshot));
+    }
+    size_t table_count = 0;
+    for (const auto& level : version_->levels) {
+        table_count += level.size();
+    }
+    readers_.reserve(table_count);
+    table_iterators_.reserve(table_count);
+    for (const auto& level : version_->levels) {
+        for (size_t j = level.size() - 1; ~j; --j) {
+            readers_.emplace_back(tree.readers_manager_->CreateReader(level[j]->path));
+            table_iterators_.emplace_back(readers_.back().NewIterator(snapshot));
+        }
+    }
+    heap_.reserve(GetSourceCount());
+    SeekToFirst();
+}
+
+size_t LSMTree::Iterator::GetSourceCount() const {
+    return memtable_iterators_.size() + table_iterators_.size();
+}
+
+bool LSMTree::Iterator::IsValid(size_t source) const {
+    return source < memtable_iterators_.size() ? memtable_iterators_[source].IsValid()
+                                               : table_iterators_[source - memtable_iterators_.size()].IsValid();
+}
+
+KeyView LSMTree::Iterator::GetKey(size_t source) const {
+    return source < memtable_iterators_.size() ? memtable_iterators_[source].GetKey()
+                                               : table_iterators_[source - memtable_iterators_.size()].GetKey();
+}
+
+ValueView LSMTree::Iterator::GetValue(size_t source) const {
+    return source < memtable_iterators_.size() ? memtable_iterators_[source].GetValue()
+                                               : table_iterators_[source - memtable_iterators_.size()].GetValue();
+}
+
+void LSMTree::Iterator::Step(size_t source) {
+    if (source < memtable_iterators_.size()) {
+        backward_ ? memtable_iterators_[source].Prev() : memtable_iterators_[source].Next();
+    } else {
+        auto& it = table_iterators_[source - memtable_iterators_.size()];
+        backward_ ? it.Prev() : it.Next();
+    }
+}
+
+void LSMTree::Iterator::SeekSources(const Key* key, bool backward) {
+    backward_ = backward;
+    heap_.clear();
+    auto seek = [key, backward](auto& it) {
+        if (backward) {
+            key ? it.SeekForPrev(*key) : it.SeekToLast();
+        } else {
+            key ? it.Seek(*key) : it.SeekToFirst();
+        }
+    };
+    std::for_each(memtable_iterators_.begin(), memtable_iterators_.end(), seek);
+    std::for_each(table_iterators_.begin(), table_iterators_.end(), seek);
+    for (size_t source = 0; source < GetSourceCount(); ++source) {
+        if (IsValid(source)) {
+            heap_.emplace_back(source);
+        }
+    }
+    auto greater = [this](size_t lhs, size_t rhs) { return HeapGreater(lhs, rhs); };
+    std::make_heap(heap_.begin(), heap_.end(), greater);
+}
+
+void LSMTree::Iterator::SkipKey() {
+    auto greater = [this](size_t lhs, size_t rhs) { return HeapGreater(lhs, rhs); };
+    std::pop_heap(heap_.begin(), heap_.end(), greater);
+    size_t top = heap_.back();
+    heap_.pop_back();
+    // The older versions of the key are right below it in the heap, top keeps its key valid until it is advanced.
+    while (!heap_.empty() && CompareKeys(GetKey(heap_.front()), GetKey(top)) == 0) {
+        std::pop_heap(heap_.begin(), heap_.end(), greater);
+        size_t source = heap_.back();
+        Step(source);
+        if (IsValid(source)) {
+            std::push_heap(heap_.begin(), heap_.end(), greater);
+        } else {
+            heap_.pop_back();
+        }
+    }
+    Step(top);
+    if (IsValid(top)) {
+        heap_.emplace_back(top);
+        std::push_heap(heap_.begin(), heap_.end(), greater);
+    }
+}
+
+void LSMTree::Iterator::SkipDeleted() {
+    while (!heap_.empty() && GetValue(heap_.front()).empty() &&
+           !(backward_ ? IsPastLower(GetKey(heap_.front())) : IsPastUpper(GetKey(heap_.front())))) {
+        SkipKey();
+    }
+}
+
+bool LSMTree::Iterator::IsPastLower(KeyView key) const {
+    return range_.lower.has_value() &&
+           (range_.including_lower ? CompareKeys(key, *range_.lower) < 0 : CompareKeys(key, *range_.lower) <= 0);
+}
+
+bool LSMTree::Iterator::IsPastUpper(KeyView key) const {
+    return range_.upper.has_value() &&
+           (range_.including_upper ? CompareKeys(key, *range_.upper) > 0 : CompareKeys(key, *range_.upper) >= 0);
+}
+
+bool LSMTree::Iterator::HeapGreater(size_t lhs, size_t rhs) const {
+    auto cmp = CompareKeys(GetKey(lhs), GetKey(rhs));
+    return (backward_ ? cmp < 0 : cmp > 0) || (cmp == 0 && lhs > rhs);
+}
+
+LSMTree::TableFile::TableFile(size_t id, const Path& path, SSTableReadersManager& manager)
+    : id(id), path(path), manager(&manager) {
+}
+
+LSMTree::TableFile::~TableFile() noexcept {
+    if (obsolete) {
+        manager->Unlink(path);
+    }
+}
+
+void LSMTree::StartBackgroundThreads() {
+    flush_thread_ = std::thread(&LSMTree::BackgroundFlush, this);
+    compaction_threads_.reserve(options_.compaction_thread_count);
+    for (size_t i = 0; i < options_.compaction_thread_count; ++i) {
+        compaction_threads_.emplace_back(&LSMTree::BackgroundCompaction, this);
+    }
+    subcompaction_threads_.reserve(options_.subcompaction_thread_count);
+    for (size_t i = 0; i < options_.subcompaction_thread_count; ++i) {
+        subcompaction_threads_.emplace_back(&LSMTree::BackgroundSubcompaction, this);
+    }
+}
+
+std::shared_ptr<LSMTree::Memtable> LSMTree::MakeMemtable() const {
+    return std::make_shared<Memtable>(options_.memtable_kv_count_limit, options_.kv_buffer_slice_size);
+}
+
+std::shared_ptr<const LSMTree::Version> LSMTree::GetCurrentVersion() const {
+    const LockGuard guard(version_mtx_);
+    return current_version_;
+}
+
+void LSMTree::InstallVersion() {
+    auto version = std::make_shared<Version>();
+    version->memtable = memtable_;
+    version->immutable_memtable = immutable_memtable_;
+    version->levels.resize(levels_.size());
+    for (size_t i = 0; i < levels_.size(); ++i) {
+        for (const auto& run : levels_[i]) {
+            for (size_t id : run) {
+                version->levels[i].emplace_back(table_files_.at(id));
+            }
         }
     }
+    std::shared_ptr<const Version> old_version;
+    {
+        const LockGuard guard(version_mtx_);
+        old_version = std::exchange(current_version_, std::move(version));
+    }
+    // The old version may be the last owner of obsolete sstables, which are deleted here, outside version_mtx_.
+}
 
-    return memtable_->FindRange(range, std::move(res));
+void LSMTree::AddTableFile(size_t id) {
+    table_files_.emplace(id, std::make_shared<TableFile>(id, GetSSTablePath(id), *readers_manager_));
 }
 
-void LSMTree::TryCompacting() {
-    if (memtable_->GetKVCount() < memtable_kv_count_limit_) {
+void LSMTree::RemoveTableFile(size_t id) {
+    auto it = table_files_.find(id);
+    it->second->obsolete = true;
+    table_files_.erase(it);
+}
+
+void LSMTree::Write(const Key& key, const Value& value) {
+    Writer writer(key, value);
+    UniqueLock lock(mtx_);
+    writers_.emplace_back(&writer);
+    while (!writer.done && &writer != writers_.front()) {
+        writer.cv.wait(lock);
+        if (Writer* leader = std::exchange(writer.leader, nullptr); leader) {
+            // The memtable can't be switched before the whole group is applied, the leader waits for it.
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                memtable_->Insert(*writer.key, *writer.value, writer.sequence);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+            if (error && !leader->error) {
+                leader->error = error;
+            }
+            if (--leader->pending_inserts == 0) {
+                leader->cv.notify_one();
+            }
+        }
+    }
+    if (writer.done) {
+        if (writer.error) {
+            std::rethrow_exception(writer.error);
+        }
         return;
     }
-    auto [number, delete_tombstones] = GetLastComponentAtLevel(0);
-    int fd0 = open(GetSSTablePath(0, number).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
-    if (fd0 < 0) {
-        throw std::runtime_error(std::string("Can't create/write sstable with name ") +
-                                 GetSSTablePath(0, number).c_str() + ": " + std::strerror(errno));
+
+    // This writer leads the group: it logs the records of everyone queued behind it with a single commit and gets them
+    // into the memtable. Followers keep queueing while the log and the memtable are written without the lock.
+    std::exception_ptr error;
+    size_t group_size = 1;
+    try {
+        MakeRoomForWrite(lock);
+        group_size = BuildWriteGroup();
+        std::vector<Writer*> group(writers_.begin(), writers_.begin() + group_size);
+        bool parallel = options_.concurrent_memtable_writes && group_size > 1 && WriteGroupKeysAreDistinct(group);
+        lock.unlock();
+        wal_->Commit();
+        try {
+            InsertIntoMemtable(group, parallel, lock);
+            if (writer.error) {
+                std::rethrow_exception(writer.error);
+            }
+        } catch (...) {
+            // The group is logged and maybe partly in the memtable, so it can be neither taken back nor retried with
+            // new sequence numbers. Like a failed flush, this fails every later write.
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            background_error_ = std::current_exception();
+            throw;
+        }
+        last_sequence_.store(group.back()->sequence, std::memory_order_release);
+    } catch (...) {
+        if (!lock.owns_lock()) {
+            lock.lock();
+        }
+        error = std::current_exception();
     }
-    size_t true_kv_count = memtable_->MakeSSTableInFd(fd0, delete_tombstones);
-    fsync(fd0);
-    close(fd0);
-    memtable_->Clear();
-    if (!true_kv_count) {
-        if (delete_tombstones) {
-            levels_.pop_back();
+    for (size_t i = 0; i < group_size; ++i) {
+        Writer* member = writers_.front();
+        writers_.pop_front();
+        if (member != &writer) {
+            member->error = error;
+            member->done = true;
+            member->cv.notify_one();
         }
+    }
+    if (!writers_.empty()) {
+        writers_.front()->cv.notify_one();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+size_t LSMTree::BuildWriteGroup() {
+    // The group never takes the memtable past its limit, MakeRoomForWrite guarantees room for at least one record.
+    size_t room = options_.memtable_kv_count_limit - memtable_->GetKVCount();
+    size_t group_size = 0;
+    // Groups are applied one at a time, so the previous one has published its last sequence number.
+    SequenceNumber sequence = last_sequence_.load(std::memory_order_relaxed);
+    while (group_size < writers_.size() && group_size < room &&
+           wal_->GetBatchSizeInBytes() < kMaxWriteGroupSizeInBytes) {
+        wal_->Append(*writers_[group_size]->key, *writers_[group_size]->value);
+        writers_[group_size]->sequence = ++sequence;
+        ++group_size;
+    }
+    return group_size;
+}
+
+bool LSMTree::WriteGroupKeysAreDistinct(const std::vector<Writer*>& group) {
+    std::vector<const Key*> keys(group.size());
+    for (size_t i = 0; i < group.size(); ++i) {
+        keys[i] = group[i]->key;
+    }
+    std::sort(keys.begin(), keys.end(), [](const Key* lhs, const Key* rhs) { return *lhs < *rhs; });
+    return std::adjacent_find(keys.begin(), keys.end(),
+                              [](const Key* lhs, const Key* rhs) { return *lhs == *rhs; }) == keys.end();
+}
+
+void LSMTree::InsertIntoMemtable(const std::vector<Writer*>& group, bool parallel, UniqueLock& lock) {
+    // Called without the lock, returns with it unless it throws. The group stays at the front of writers_ until its
+    // leader is done, so no memtable switch can happen meanwhile, and lookups don't lock the skip list.
+    if (!parallel) {
+        for (const Writer* member : group) {
+            memtable_->Insert(*member->key, *member->value, member->sequence);
+        }
+        lock.lock();
         return;
     }
-    ++levels_[0];
-    if (levels_[0] == sstable_scaling_factor_) {
-        size_t i = 1;
-        while (i < levels_.size() && levels_[i] + 1 == sstable_scaling_factor_) {
-            ++i;
+
+    Writer& leader = *group.front();
+    lock.lock();
+    leader.pending_inserts = group.size() - 1;
+    for (size_t i = 1; i < group.size(); ++i) {
+        group[i]->leader = &leader;
+        group[i]->cv.notify_one();
+    }
+    lock.unlock();
+    std::exception_ptr error;
+    try {
+        memtable_->Insert(*leader.key, *leader.value, leader.sequence);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    lock.lock();
+    leader.cv.wait(lock, [&leader] { return leader.pending_inserts == 0; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void LSMTree::MakeRoomForWrite(UniqueLock& lock) {
+    bool allow_delay = true;
+    while (true) {
+        if (background_error_) {
+            std::rethrow_exception(background_error_);
+        }
+        size_t level0_size = levels_.empty() ? 0 : levels_[0].size();
+        if (allow_delay && level0_size >= options_.level0_slowdown_trigger) {
+            // Delaying every write a little spreads the stall instead of blocking one writer for a whole compaction.
+            ++background_work_statistics_.write_slowdowns;
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            lock.lock();
+            allow_delay = false;
+            continue;
+        }
+        if (memtable_->GetKVCount() < options_.memtable_kv_count_limit &&
+            memtable_->GetMemoryUsage() < options_.memtable_size_limit &&
+            memtable_->GetGarbageSizeInBytes() < options_.memtable_garbage_limit) {
+            return;
+        }
+        if (immutable_memtable_ || level0_size >= options_.level0_stop_trigger) {
+            // Either the previous memtable is still being flushed or level 0 is too far ahead of compaction.
+            if (level0_size >= options_.level0_stop_trigger) {
+                ++background_work_statistics_.write_stops;
+            }
+            background_done_cv_.wait(lock);
+            continue;
+        }
+        // The next log is created without the lock, the queued writers wait for this leader anyway. Nothing is
+        // switched before the log and the memtable are ready, so a failure leaves the tree as it was. The state is
+        // persisted by the flush, recovery finds the logs created after the persisted one by their numbers.
+        std::shared_ptr<Memtable> memtable = recycled_memtable_ ? std::move(recycled_memtable_) : MakeMemtable();
+        size_t log_number = log_number_ + 1;
+        lock.unlock();
+        std::unique_ptr<WAL::WriteAheadLog> wal;
+        try {
+            wal = OpenLog(log_number);
+        } catch (...) {
+            lock.lock();
+            recycled_memtable_ = std::move(memtable);
+            throw;
+        }
+        lock.lock();
+        immutable_memtable_ = std::move(memtable_);
+        memtable_ = std::move(memtable);
+        std::unique_ptr<WAL::WriteAheadLog> old_wal = std::exchange(wal_, std::move(wal));
+        log_number_ = log_number;
+        background_work_cv_.notify_one();
+        try {
+            InstallVersion();
+        } catch (...) {
+            // Lookups would miss the writes to the new memtable.
+            background_error_ = std::current_exception();
+            throw;
+        }
+        // Syncs the tail of the old log. Its writes were acknowledged, so a failure here fails every later write.
+        lock.unlock();
+        try {
+            old_wal->Close();
+        } catch (...) {
+            lock.lock();
+            background_error_ = std::current_exception();
+            throw;
+        }
+        old_wal.reset();
+        lock.lock();
+        return;
+    }
+}
+
+void LSMTree::BackgroundFlush() {
+    UniqueLock lock(mtx_);
+    while (true) {
+        background_work_cv_.wait(lock, [this] { return immutable_memtable_ || stopping_; });
+        if (!immutable_memtable_) {
+            return;
+        }
+        try {
+            FlushImmutableMemtable(lock);
+        } catch (...) {
+            background_error_ = std::current_exception();
+            background_done_cv_.notify_all();
+            compaction_work_cv_.notify_all();
+            return;
+        }
+        background_done_cv_.notify_all();
+        compaction_work_cv_.notify_all();
+    }
+}
+
+void LSMTree::FlushImmutableMemtable(UniqueLock& lock) {
+    bool delete_tombstones = LevelsAreEmptyFrom(0);
+    std::vector<SequenceNumber> snapshots = GetLiveSnapshots();
+    size_t id = next_sstable_id_++;
+    Path path = GetSSTablePath(id);
+
+    // The immutable memtable is read-only, so the sstable is written without holding the lock.
+    lock.unlock();
+    size_t true_kv_count;
+    int fd0 = -1;
+    try {
+        fd0 = CreateSSTableFile(path);
+        SSTable::SSTableWriter writer(fd0, options_.sstable_write_buffer_size, options_.vectored_sstable_writes,
+                                      options_.sstable_block_size);
+        // Sized for the keys the memtable ended up with, which the byte limits may keep far below the count limit.
+        BloomFilter filter = MakeOptimalFilter(immutable_memtable_->GetKVCount(), options_.filter_false_positive_rate,
+                                               options_.filter_type);
+        true_kv_count = immutable_memtable_->MakeSSTable(writer, delete_tombstones, filter, snapshots);
+        // The logs covering the memtable are deleted below, the sstable must be durable before that.
+        if (fsync(fd0) != 0) {
+            ThrowCantCreateSSTable(path);
+        }
+        close(std::exchange(fd0, -1));
+        if (!SyncDirectory(path)) {
+            ThrowCantCreateSSTable(path);
+        }
+    } catch (...) {
+        if (fd0 >= 0) {
+            close(fd0);
+        }
+        lock.lock();
+        throw;
+    }
+    lock.lock();
+
+    std::shared_ptr<Memtable> flushed_memtable = std::move(immutable_memtable_);
+    if (true_kv_count) {
+        EnsureLevelCount(1);
+        levels_[0].emplace_back(Run{id});
+        background_work_statistics_.max_level0_run_count =
+            std::max(background_work_statistics_.max_level0_run_count, levels_[0].size());
+        AddTableFile(id);
+    } else {
+        readers_manager_->Unlink(path);
+    }
+    // Only the active memtable's log is needed once the sstable is part of the persisted tree.
+    size_t obsolete_log_number = min_log_number_;
+    min_log_number_ = log_number_;
+    PersistTreeState(false);
+    InstallVersion();
+    for (; obsolete_log_number < min_log_number_; ++obsolete_log_number) {
+        unlink(GetLogPath(obsolete_log_number).c_str());
+    }
+    // No new version includes the memtable, so once the old ones are gone nobody can get to it and it can be reused.
+    if (flushed_memtable.use_count() == 1) {
+        // Dropping a copy decrements the count with acquire semantics, which orders the lookups of the last reader
+        // before the Clear. use_count alone is a relaxed load.
+        std::shared_ptr<Memtable>(flushed_memtable).reset();
+        flushed_memtable->Clear();
+        recycled_memtable_ = std::move(flushed_memtable);
+    }
+}
+
+void LSMTree::BackgroundCompaction() {
+    IO::EventLoop loop(IO::EventLoop::kDefaultQueueDepth, IO::EventLoop::kDefaultFallbackThreadCount,
+                       options_.compaction_io_uring);
+    UniqueLock lock(mtx_);
+    while (true) {
+        std::optional<size_t> level;
+        compaction_work_cv_.wait(lock, [this, &level] {
+            return stopping_ || background_error_ || (level = PickLevelToCompact()).has_value();
+        });
+        if (stopping_ || background_error_) {
+            return;
+        }
+        level_is_compacting_[*level] = true;
+        ++running_compaction_count_;
+        background_work_statistics_.max_concurrent_compactions =
+            std::max(background_work_statistics_.max_concurrent_compactions, running_compaction_count_);
+        try {
+            CompactLevel(*level, lock, loop);
+        } catch (...) {
+            background_error_ = std::current_exception();
         }
-        CompactLevelsUpTo(i);
+        --running_compaction_count_;
+        level_is_compacting_[*level] = false;
+        RemoveTrailingEmptyLevels();
+        background_done_cv_.notify_all();
+        compaction_work_cv_.notify_all();
     }
 }
 
-void LSMTree::CompactLevelsUpTo(size_t level) {
-    auto [number, delete_tombstones] = GetLastComponentAtLevel(level);
-    int wfd = open(GetSSTablePath(level, number).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
-    size_t components_count = sstable_scaling_factor_ + (level - 1) * (sstable_scaling_factor_ - 1);
+std::optional<size_t> LSMTree::PickLevelToCompact() const {
+    for (size_t i = 0; i < levels_.size(); ++i) {
+        if (!level_is_compacting_[i] && levels_[i].size() >= options_.sstable_scaling_factor) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+void LSMTree::CompactLevel(size_t level, UniqueLock& lock, IO::EventLoop& loop) {
+    // Only this job removes runs from the level and others only append to it, so the oldest ones stay in front.
+    const size_t components_count = options_.sstable_scaling_factor;
+    const Level inputs(levels_[level].begin(), levels_[level].begin() + components_count);
+    bool delete_tombstones = LevelsAreEmptyFrom(level + 1);
+    // Snapshots taken later are newer than every input record, so they see the newest versions, which are kept anyway.
+    std::vector<SequenceNumber> snapshots = GetLiveSnapshots();
     std::vector<SSTableReader> readers;
-    readers.reserve(components_count);
+    for (size_t j = components_count - 1; ~j; --j) {
+        for (size_t id : inputs[j]) {
+            readers.emplace_back(readers_manager_->CreateReader(GetSSTablePath(id)));
+        }
+    }
+    std::vector<Subcompaction> subcompactions = SplitCompaction(readers);
+    for (auto& subcompaction : subcompactions) {
+        subcompaction.id = next_sstable_id_++;
+    }
 
+    // The readers are acquired and released under the lock, the merge itself only reads their files. This thread
+    // merges ranges too, so the compaction goes on even if every subcompaction thread is busy.
+    SubcompactionJob job{.readers = &readers,
+                         .delete_tombstones = delete_tombstones,
+                         .snapshots = snapshots,
+                         .subcompactions = &subcompactions,
+                         .unfinished = subcompactions.size()};
+    if (subcompactions.size() > 1 && !subcompaction_threads_.empty()) {
+        subcompaction_jobs_.push_back(&job);
+        subcompaction_work_cv_.notify_all();
+    }
+    while (RunNextSubcompaction(job, lock, loop)) {
+    }
+    subcompaction_done_cv_.wait(lock, [&job] { return job.unfinished == 0; });
+
+    readers.clear();
+    for (const auto& subcompaction : subcompactions) {
+        if (subcompaction.error) {
+            for (const auto& output : subcompactions) {
+                readers_manager_->Unlink(GetSSTablePath(output.id));
+            }
+            std::rethrow_exception(subcompaction.error);
+        }
+    }
+    // The outputs replace the inputs in one step, so no version holds a part of them.
+    Run outputs;
+    for (const auto& subcompaction : subcompactions) {
+        if (subcompaction.written_kv_count) {
+            outputs.emplace_back(subcompaction.id);
+            AddTableFile(subcompaction.id);
+        } else {
+            readers_manager_->Unlink(GetSSTablePath(subcompaction.id));
+        }
+    }
+    EnsureLevelCount(level + 2);
+    if (!outputs.empty()) {
+        levels_[level + 1].emplace_back(std::move(outputs));
+    }
+    levels_[level].erase(levels_[level].begin(), levels_[level].begin() + components_count);
+    PersistTreeState(false);
+    // The inputs are deleted once no lookup uses a version that includes them.
+    for (const auto& input : inputs) {
+        for (size_t id : input) {
+            RemoveTableFile(id);
+        }
+    }
+    InstallVersion();
+}
+
+std::vector<LSMTree::Subcompaction> LSMTree::SplitCompaction(const std::vector<SSTableReader>& readers) const {
     size_t total_kv_count = 0;
-    for (size_t i = 0; i < level; ++i) {
-        for (size_t j = levels_[i] - 1; ~j; --j) {
-            readers.emplace_back(readers_manager_->CreateReader(GetSSTablePath(i, j)));
-            total_kv_count += readers.back().GetKVCount();
+    size_t total_size = 0;
+    for (const auto& reader : readers) {
+        total_kv_count += reader.GetKVCount();
+        total_size += reader.GetDataSize();
+    }
+    size_t count = std::clamp<size_t>(total_size / std::max<size_t>(options_.subcompaction_min_size, 1), 1,
+                                      options_.max_subcompactions);
+    std::vector<const Key*> keys;
+    if (count > 1) {
+        for (const auto& reader : readers) {
+            for (const auto& key : reader.GetIndexKeys()) {
+                keys.emplace_back(&key);
+            }
+        }
+        std::sort(keys.begin(), keys.end(), [](const Key* lhs, const Key* rhs) { return CompareKeys(*lhs, *rhs) < 0; });
+    }
+
+    // Blocks hold about the same number of bytes, so every range gets about as many of them, and records by the share.
+    std::vector<Subcompaction> res;
+    std::optional<Key> lower;
+    size_t first = 0;
+    for (size_t i = 1; i <= count; ++i) {
+        size_t cut = i == count ? keys.size() : keys.size() * i / count;
+        std::optional<Key> upper;
+        if (i < count) {
+            // The versions of a key stay in one range.
+            if (CompareKeys(*keys[cut], *keys[first]) <= 0) {
+                continue;
+            }
+            upper = *keys[cut];
         }
+        size_t kv_count = count == 1 ? total_kv_count : total_kv_count * (cut - first) / keys.size() + 1;
+        res.push_back({.range = {.lower = lower, .upper = upper, .including_lower = true, .including_upper = false},
+                       .kv_count = kv_count,
+                       .id = 0});
+        lower = std::move(upper);
+        first = cut;
     }
+    return res;
+}
 
-    std::vector<KVIterator> key_buffer;
-    key_buffer.reserve(components_count);
+void LSMTree::BackgroundSubcompaction() {
+    try {
+        IO::EventLoop loop(IO::EventLoop::kDefaultQueueDepth, IO::EventLoop::kDefaultFallbackThreadCount,
+                           options_.compaction_io_uring);
+        UniqueLock lock(mtx_);
+        while (true) {
+            subcompaction_work_cv_.wait(lock, [this] { return stopping_ || !subcompaction_jobs_.empty(); });
+            // The compaction threads take whatever is left of their own jobs.
+            if (subcompaction_jobs_.empty()) {
+                return;
+            }
+            RunNextSubcompaction(*subcompaction_jobs_.front(), lock, loop);
+        }
+    } catch (...) {
+        // Without a loop this thread takes no ranges, the compaction threads merge them.
+    }
+}
+
+bool LSMTree::RunNextSubcompaction(SubcompactionJob& job, UniqueLock& lock, IO::EventLoop& loop) {
+    if (job.next == job.subcompactions->size()) {
+        return false;
+    }
+    Subcompaction& subcompaction = (*job.subcompactions)[job.next++];
+    if (job.next == job.subcompactions->size()) {
+        std::erase(subcompaction_jobs_, &job);
+    }
+    lock.unlock();
+    RunSubcompaction(loop, *job.readers, job.delete_tombstones, job.snapshots, subcompaction);
+    lock.lock();
+    if (--job.unfinished == 0) {
+        subcompaction_done_cv_.notify_all();
+    }
+    return true;
+}
+
+void LSMTree::RunSubcompaction(IO::EventLoop& loop, const std::vector<SSTableReader>& readers, bool delete_tombstones,
+                               std::span<const SequenceNumber> snapshots, Subcompaction& subcompaction) const {
+    int fd = -1;
+    try {
+        fd = CreateSSTableFile(GetSSTablePath(subcompaction.id));
+        SSTable::SSTableWriter writer(fd, options_.sstable_write_buffer_size, false, options_.sstable_block_size,
+                                      &loop);
+        subcompaction.written_kv_count = loop.Run(MergeSSTables(loop, readers, subcompaction.range,
+                                                                subcompaction.kv_count, delete_tombstones, snapshots,
+                                                                writer));
+    } catch (...) {
+        subcompaction.error = std::current_exception();
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+IO::Task<size_t> LSMTree::MergeSSTables(IO::EventLoop& loop, const std::vector<SSTableReader>& readers,
+                                        const KeyRange& range, size_t kv_count, bool delete_tombstones,
+                                        std::span<const SequenceNumber> snapshots,
+                                        SSTable::SSTableWriter& writer) const {
+    // Readers are ordered from the newest run to the oldest. Records come out by key and then from the newest version
+    // to the oldest, the records of legacy sstables have sequence number 0 and the one of the newer run goes first.
+    // Every input reads ahead and the output is written behind, so the merge waits only when the disk falls behind.
+    // The iterators may throw when moved, so a vector would have to copy them.
+    std::deque<PrefetchingKVIterator> key_buffer;
     for (const auto& reader : readers) {
-        key_buffer.emplace_back(reader.Begin());
-    }
-    std::vector<size_t> indexblock;
-    Offset kv_offset = 0;
-    indexblock.reserve(total_kv_count);
-    BloomFilter filter = MakeOptimalFilter(total_kv_count, filter_false_positive_rate_);
-    std::vector<size_t> to_advance;
-    Value value_buffer;
-
-    auto comparator = [&key_buffer](const size_t& c1, const size_t& c2) {
-        auto cmp = key_buffer[c1].GetKey() <=> key_buffer[c2].GetKey();
-        return cmp > 0 || (cmp == 0 && c1 > c2);
-    };
-    std::priority_queue<size_t, std::vector<size_t>, decltype(comparator)> heap(comparator);
-    for (size_t i = 0; i < components_count; ++i) {
-        heap.emplace(i);
-    }
-    while (!heap.empty()) {
-        size_t smallest_key_index = heap.top();
-        heap.pop();
-        const auto& smalles_key = key_buffer[smallest_key_index];
-        to_advance.clear();
-        to_advance.emplace_back(smallest_key_index);
-        while (!heap.empty() && (smalles_key.GetKey() <=> key_buffer[heap.top()].GetKey()) == 0) {
-            to_advance.emplace_back(heap.top());
-            heap.pop();
+        key_buffer.emplace_back(reader.Begin(loop, options_.compaction_readahead_depth, range, true));
+    }
+    std::exception_ptr error;
+    try {
+        BloomFilter filter = MakeOptimalFilter(kv_count, options_.filter_false_positive_rate, options_.filter_type);
+        BloomFilterBatchInserter filter_inserter(filter);
+
+        auto comparator = [&key_buffer](size_t lhs, size_t rhs) { return MergeOrderGreater(key_buffer, lhs, rhs); };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(comparator)> heap(comparator);
+        for (size_t i = 0; i < readers.size(); ++i) {
+            if (key_buffer[i].NeedsLoad()) {
+                co_await key_buffer[i].Load();
+            }
+            if (!key_buffer[i].IsEnd()) {
+                heap.emplace(i);
+            }
         }
+        Key current_key;
+        bool has_current_key = false;
+        bool key_written = false;
+        bool key_stopped = false;
+        SequenceNumber newer_sequence = kMaxSequenceNumber;
+        while (!heap.empty()) {
+            size_t index = heap.top();
+            heap.pop();
+            auto& it = key_buffer[index];
+            KeyView key = it.GetKey();
+            if (!has_current_key || CompareKeys(key, current_key) != 0) {
+                current_key.assign(key.begin(), key.end());
+                has_current_key = true;
+                key_written = false;
+                key_stopped = false;
+                newer_sequence = kMaxSequenceNumber;
+            }
+
+            if (!key_stopped) {
+                SequenceNumber sequence = it.GetSequenceNumber();
+                VersionRetention retention =
+                    RetainVersion(sequence, newer_sequence, it.GetValueSize() == 0, delete_tombstones, snapshots);
+                if (retention.keep) {
+                    writer.AddKV(key, it.GetValue(), sequence, key_written);
+                    if (!key_written) {
+                        filter_inserter.Insert(key);
+                    }
+                    key_written = true;
+                    // One buffer is being written while the merge fills the other.
+                    if (writer.GetWritesInFlight() > 1) {
+                        co_await writer.WaitForWrites(1);
+                    }
+                }
+                key_stopped = retention.stop;
+                newer_sequence = sequence;
+            }
 
-        if (!delete_tombstones || smalles_key.GetValueSize() != 0) {
-            value_buffer = smalles_key.GetValue(std::move(value_buffer));
-            KVSizes sizes(smalles_key.GetKey().size(), value_buffer.size());
-            write(wfd, &sizes, sizeof(sizes));
-            write(wfd, smalles_key.GetKey().data(), smalles_key.GetKey().size() * sizeof(smalles_key.GetKey()[0]));
-            write(wfd, value_buffer.data(), value_buffer.size() * sizeof(value_buffer[0]));
-            filter.Insert(smalles_key.GetKey());
-            indexblock.emplace_back(kv_offset);
-            size_t kv_size = smalles_key.GetKey().size() + value_buffer.size() + sizeof(sizes);
-            kv_offset += kv_size;
+            ++it;
+            if (it.NeedsLoad()) {
+                co_await it.Load();
+            }
+            if (!it.IsEnd()) {
+                heap.push(index);
+            }
+        }
+        filter_inserter.Flush();
+        if (writer.GetKVCount()) {
+            writer.Finish(filter);
+            co_await writer.SyncAsync();
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // The buffers of the reads and writes in flight go away with the task.
+    for (auto& it : key_buffer) {
+        co_await it.Drain();
+    }
+    if (error) {
+        try {
+            co_await writer.WaitForWrites(0);
+        } catch (...) {
         }
+        std::rethrow_exception(error);
+    }
+    co_return writer.GetKVCount();
+}
 
-        for (size_t i = to_advance.size() - 1; ~i; --i) {
-            size_t index = to_advance[i];
-            if (key_buffer[index].IsEnd()) {
-                continue;
+std::unique_ptr<WAL::WriteAheadLog> LSMTree::OpenLog(size_t number) const {
+    Path path = GetLogPath(number);
+    auto wal = std::make_unique<WAL::WriteAheadLog>(path, options_.wal_sync_mode,
+                                                    std::chrono::milliseconds(options_.wal_sync_interval_ms));
+    // Recovery looks the log up by its name, which has to survive a crash as well as the records.
+    if (!SyncDirectory(path)) {
+        ThrowCantCreateLog(path);
+    }
+    return wal;
+}
+
+std::vector<Path> LSMTree::LoadTreeState(int fd) {
+    TreeParams params;
+    ReadTreeData(fd, &params, sizeof(params), tree_data_);
+    options_ = params.options;
+    readers_manager_ = std::make_unique<SSTable::SSTableReadersManager>(
+        options_.fd_cache_size, options_.table_cache_size, options_.scan_readahead_size, options_.block_cache_size,
+        options_.mmap_sstable_reads);
+    next_sstable_id_ = params.next_sstable_id;
+    SequenceNumber last_sequence = params.last_sequence;
+    memtable_ = MakeMemtable();
+    // A memtable switch creates the next log before any state that names it is persisted, so the logs that follow
+    // the persisted one are replayed as well.
+    size_t last_log_number = params.log_number;
+    while (access(GetLogPath(last_log_number + 1).c_str(), F_OK) == 0) {
+        ++last_log_number;
+    }
+    // The records recovered below are logged again, so the new state needs neither the old logs nor a memtable dump.
+    log_number_ = last_log_number + 1;
+    min_log_number_ = log_number_;
+    wal_ = OpenLog(log_number_);
+
+    levels_.resize(params.level_count);
+    level_is_compacting_.resize(params.level_count, false);
+    for (auto& level : levels_) {
+        size_t run_count;
+        ReadTreeData(fd, &run_count, sizeof(run_count), tree_data_);
+        level.resize(run_count);
+        for (auto& run : level) {
+            size_t sstable_count;
+            ReadTreeData(fd, &sstable_count, sizeof(sstable_count), tree_data_);
+            run.resize(sstable_count);
+            ReadTreeData(fd, run.data(), run.size() * sizeof(run[0]), tree_data_);
+            for (size_t id : run) {
+                AddTableFile(id);
             }
-            ++key_buffer[index];
-            heap.push(index);
-        }
-    }
-    if (!indexblock.empty()) {
-        filter.MakeFilterBlockInFd(wfd);
-        write(wfd, indexblock.data(), indexblock.size() * sizeof(indexblock[0]));
-        MetaBlock meta(kv_offset, filter.BitsCount(), filter.HashFuncCount(), kv_offset + filter.GetSizeInBytes(),
-                       indexblock.size());
-        write(wfd, &meta, sizeof(meta));
-        fsync(wfd);
-        close(wfd);
-        ++levels_[level];
-    } else if (delete_tombstones) {
-        levels_.pop_back();
+        }
+    }
+
+    Key key;
+    Value value;
+    for (size_t i = 0; i < params.memtable_kv_count; ++i) {
+        RecordHeader header;
+        ReadTreeData(fd, &header, sizeof(header), tree_data_);
+        ReadTreeDataKV(fd, header.sizes, key, value, tree_data_);
+        RecoverRecord(key, value, header.sequence);
+    }
+
+    // Logs of the memtables that were not flushed before the tree was closed, oldest first. Their records are newer
+    // than everything persisted, so they get new sequence numbers in log order.
+    std::vector<Path> obsolete_logs;
+    for (size_t number = params.min_log_number; number <= last_log_number; ++number) {
+        WAL::WriteAheadLog::Replay(GetLogPath(number), [this, &last_sequence](const Key& key, const Value& value) {
+            RecoverRecord(key, value, ++last_sequence);
+        });
+        obsolete_logs.emplace_back(GetLogPath(number));
+    }
+    last_sequence_ = last_sequence;
+    return obsolete_logs;
+}
+
+std::vector<Path> LSMTree::LoadBaselineTreeState(int fd) {
+    BaselineTreeParams params;
+    ReadTreeData(fd, &params, sizeof(params), tree_data_);
+    if (params.sstable_scaling_factor < 2 || params.memtable_kv_count_limit == 0 ||
+        params.kv_buffer_slice_size == 0 || params.level_count > kMaxBaselineLevelCount ||
+        !(params.filter_false_positive_rate > 0 && params.filter_false_positive_rate < 1)) {
+        ThrowUnknownTreeFormat(tree_data_);
+    }
+    // Everything the baseline had no parameter for keeps its default.
+    options_ = LSMTreeOptions{.fd_cache_size = params.fd_cache_size,
+                              .sstable_scaling_factor = params.sstable_scaling_factor,
+                              .memtable_kv_count_limit = params.memtable_kv_count_limit,
+                              .kv_buffer_slice_size = params.kv_buffer_slice_size,
+                              .filter_false_positive_rate = params.filter_false_positive_rate,
+                              .level0_slowdown_trigger = 2 * params.sstable_scaling_factor,
+                              .level0_stop_trigger = 3 * params.sstable_scaling_factor};
+    readers_manager_ = std::make_unique<SSTable::SSTableReadersManager>(
+        options_.fd_cache_size, options_.table_cache_size, options_.scan_readahead_size, options_.block_cache_size,
+        options_.mmap_sstable_reads);
+    memtable_ = MakeMemtable();
+    wal_ = OpenLog(log_number_);
+
+    // Every sstable of a level is a run of its own, the oldest first. Their new names are linked before the migrated
+    // state is persisted, so a crash leaves the baseline tree as it was, and the baseline names go after that.
+    std::vector<size_t> sstable_counts(params.level_count);
+    ReadTreeData(fd, sstable_counts.data(), sstable_counts.size() * sizeof(sstable_counts[0]), tree_data_);
+    std::vector<Path> baseline_paths;
+    levels_.resize(params.level_count);
+    level_is_compacting_.resize(params.level_count, false);
+    for (size_t level = 0; level < levels_.size(); ++level) {
+        for (size_t number = 0; number < sstable_counts[level]; ++number) {
+            Path baseline_path = GetBaselineSSTablePath(level, number);
+            size_t id = LinkBaselineSSTable(baseline_path);
+            levels_[level].emplace_back(Run{id});
+            AddTableFile(id);
+            baseline_paths.emplace_back(std::move(baseline_path));
+        }
+    }
+
+    // The baseline memtable holds one record per key, the sstables have sequence number 0.
+    Key key;
+    Value value;
+    SequenceNumber last_sequence = 0;
+    for (size_t i = 0; i < params.memtable_kv_count; ++i) {
+        KVSizes sizes;
+        ReadTreeData(fd, &sizes, sizeof(sizes), tree_data_);
+        ReadTreeDataKV(fd, sizes, key, value, tree_data_);
+        RecoverRecord(key, value, ++last_sequence);
+    }
+    last_sequence_ = last_sequence;
+    return baseline_paths;
+}
+
+size_t LSMTree::LinkBaselineSSTable(const Path& baseline_path) {
+    // A name may be taken by the link of a migration that crashed before persisting the new state, which is reused,
+    // or by a file of something else, which is skipped.
+    while (true) {
+        size_t id = next_sstable_id_++;
+        Path path = GetSSTablePath(id);
+        if (link(baseline_path.c_str(), path.c_str()) == 0) {
+            return id;
+        }
+        struct stat baseline_stat;
+        struct stat stat;
+        if (errno != EEXIST || ::stat(baseline_path.c_str(), &baseline_stat) != 0 ||
+            ::stat(path.c_str(), &stat) != 0) {
+            ThrowCantOpenTree(tree_data_);
+        }
+        if (baseline_stat.st_dev == stat.st_dev && baseline_stat.st_ino == stat.st_ino) {
+            return id;
+        }
+    }
+}
+
+void LSMTree::RecoverRecord(const Key& key, const Value& value, SequenceNumber sequence) {
+    memtable_->Insert(key, value, sequence);
+    wal_->Append(key, value);
+    if (wal_->GetBatchSizeInBytes() >= kMaxWriteGroupSizeInBytes) {
+        wal_->Commit();
+    }
+}
+
+void LSMTree::PersistTreeState(bool dump_memtables) const {
+    // Written aside and renamed over tree_data, so a crash leaves either the old or the new state.
+    Path tmp_path = tree_data_;
+    tmp_path += ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        ThrowCantPersistTree(tree_data_);
+    }
+
+    // The immutable memtable is still here only if its flush failed, so it is dumped before the newer active one.
+    size_t memtable_kv_count = 0;
+    if (dump_memtables) {
+        memtable_kv_count += memtable_->GetKVCount();
+        if (immutable_memtable_) {
+            memtable_kv_count += immutable_memtable_->GetKVCount();
+        }
     }
-    for (size_t i = 0; i < level; ++i) {
-        levels_[i] = 0;
+    TreeParams params{.options = options_,
+                      .memtable_kv_count = memtable_kv_count,
+                      .level_count = levels_.size(),
+                      .next_sstable_id = next_sstable_id_,
+                      .min_log_number = min_log_number_,
+                      .log_number = log_number_,
+                      .last_sequence = last_sequence_.load(std::memory_order_relaxed)};
+    TreeDataHeader header{.magic = kTreeDataMagic, .version = kTreeDataVersion, .params_size = sizeof(TreeParams)};
+    SSTable::SSTableWriter writer(fd, options_.sstable_write_buffer_size);
+    writer.Append(&header, sizeof(header));
+    writer.Append(&params, sizeof(params));
+    for (const auto& level : levels_) {
+        size_t run_count = level.size();
+        writer.Append(&run_count, sizeof(run_count));
+        for (const auto& run : level) {
+            size_t sstable_count = run.size();
+            writer.Append(&sstable_count, sizeof(sstable_count));
+            writer.Append(run.data(), run.size() * sizeof(run[0]));
+        }
     }
-    for (size_t i = 0; i < level; ++i) {
-        for (size_t j = 0; j + 1 < sstable_scaling_factor_; ++j) {
-            readers_manager_->Unlink(GetSSTablePath(i, j).c_str());
+    if (dump_memtables) {
+        if (immutable_memtable_) {
+            immutable_memtable_->DumpKV(writer);
         }
+        memtable_->DumpKV(writer);
+    }
+    writer.Flush();
+    if (fsync(fd) != 0) {
+        close(fd);
+        ThrowCantPersistTree(tree_data_);
+    }
+    close(fd);
+    // Obsolete logs and sstables are deleted once this returns, so the new tree_data must not be lost in a crash.
+    if (rename(tmp_path.c_str(), tree_data_.c_str()) != 0 || !SyncDirectory(tree_data_)) {
+        ThrowCantPersistTree(tree_data_);
+    }
+}
+
+bool LSMTree::LevelsAreEmptyFrom(size_t level) const {
+    for (; level < levels_.size(); ++level) {
+        if (!levels_[level].empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void LSMTree::EnsureLevelCount(size_t count) {
+    if (levels_.size() < count) {
+        levels_.resize(count);
+        level_is_compacting_.resize(count, false);
+    }
+}
+
+void LSMTree::RemoveTrailingEmptyLevels() {
+    while (!levels_.empty() && levels_.back().empty() && !level_is_compacting_.back()) {
+        levels_.pop_back();
+        level_is_compacting_.pop_back();
     }
-    readers_manager_->Unlink(GetSSTablePath(0, sstable_scaling_factor_ - 1).c_str());
 }
 
 size_t LSMTree::CalculateKVCountForLevel(size_t level) const {
-    size_t count = memtable_kv_count_limit_;
+    size_t count = options_.memtable_kv_count_limit;
     while (level--) {
-        count *= sstable_scaling_factor_;
+        count *= options_.sstable_scaling_factor;
     }
     return count;
 }
 
-Path LSMTree::GetSSTablePath(size_t level, size_t number) const {
+Path LSMTree::GetSSTablePath(size_t id) const {
+    return std::to_string(id) + ".sst";
+}
+
+Path LSMTree::GetBaselineSSTablePath(size_t level, size_t number) {
     return std::to_string(level) + '_' + std::to_string(number) + ".sst";
 }
 
-LSMTree::ComponentInfo LSMTree::GetLastComponentAtLevel(size_t level) {
-    assert(level <= levels_.size());
-    if (level == levels_.size()) {
-        levels_.emplace_back(0);
-        return {levels_[level], true};
-    } else {
-        return {levels_[level], false};
-    }
+Path LSMTree::GetLogPath(size_t number) const {
+    return tree_data_.string() + '_' + std::to_string(number) + ".wal";
 }
 
 }  // namespace MyLSMTree
@@ -1,30 +1,229 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
+#include <thread>
 #include "common.h"
 #include "memtable/memtable.h"
 #include "sstable/sstable_reader.h"
+#include "sstable/sstable_writer.h"
+#include "wal/write_ahead_log.h"
 
 namespace MyLSMTree {
 
+struct LSMTreeOptions {
+    // Number of unused sstables kept open together with their filters and indexes.
+    size_t fd_cache_size = 64;
+    // Memory available to the filters and indexes of the open sstables.
+    size_t table_cache_size = 1 << 28;
+    // Memory for the data blocks read by point lookups, 0 disables the block cache.
+    size_t block_cache_size = 1 << 26;
+    // Maps the sstables into memory instead of reading them with pread. Makes sense when the data fits into the page
+    // cache. The block cache is not used in this mode.
+    bool mmap_sstable_reads = false;
+    // A level is merged into the next one as soon as it holds this many sstables.
+    size_t sstable_scaling_factor = 10;
+    size_t memtable_kv_count_limit = 100'000;
+    // The memtable is flushed once its keys, values and skip list nodes take this many bytes, whichever of the limits
+    // is reached first.
+    size_t memtable_size_limit = 1 << 26;
+    // The memtable is also flushed once this many bytes of its kv buffer are taken by overwritten records, so
+    // updates of the same keys can't grow it without bound.
+    size_t memtable_garbage_limit = 1 << 26;
+    size_t kv_buffer_slice_size = 1 << 26;
+    double filter_false_positive_rate = 0.05;
+    FilterType filter_type = FilterType::kBlocked;
+    size_t compaction_thread_count = 1;
+    // Every write is delayed by 1ms while level 0 holds at least this many sstables.
+    size_t level0_slowdown_trigger = 20;
+    // Memtable switches wait for compaction while level 0 holds at least this many sstables.
+    size_t level0_stop_trigger = 30;
+    WAL::SyncMode wal_sync_mode = WAL::SyncMode::kPeriodic;
+    size_t wal_sync_interval_ms = 100;
+    // Once a write group is logged, its writers insert their own records into the memtable in parallel. Groups that
+    // write some key more than once are still applied by their leader in log order.
+    bool concurrent_memtable_writes = true;
+    size_t sstable_write_buffer_size = 1 << 20;
+    // Target size of the sstable data blocks. The index keeps one key per block in memory.
+    size_t sstable_block_size = 1 << 12;
+    // Writes large values straight from the memtable with pwritev instead of copying them into the write buffer.
+    bool vectored_sstable_writes = false;
+    // Upper bound on a single read of the sequential sstable scans used by compaction and range lookups.
+    size_t scan_readahead_size = 1 << 18;
+    // Compactions keep the reads of this many chunks of scan_readahead_size bytes in flight on every input, and write
+    // the output in the background while the merge goes on.
+    size_t compaction_readahead_depth = 4;
+    // The I/O of compactions goes through io_uring if the kernel allows it, otherwise through a few threads.
+    bool compaction_io_uring = true;
+    // A compaction of more input bytes than subcompaction_min_size is split into up to max_subcompactions key ranges
+    // of about that size or more, which are merged in parallel.
+    size_t max_subcompactions = 4;
+    size_t subcompaction_min_size = 1 << 26;
+    // Threads that merge key ranges of split compactions next to the compaction threads. Each of them keeps one event
+    // loop for as long as the tree is open.
+    size_t subcompaction_thread_count = 3;
+};
+
+// Counters of the flushes and compactions since the tree was opened.
+struct BackgroundWorkStatistics {
+    // Writes delayed because level 0 held level0_slowdown_trigger sstables or more.
+    uint64_t write_slowdowns;
+    // Times a memtable switch waited for level 0 to drop below level0_stop_trigger.
+    uint64_t write_stops;
+    size_t max_level0_run_count;
+    size_t max_concurrent_compactions;
+};
+
+// A consistent view of the tree. Lookups through a snapshot see the writes made before it was taken and none of the
+// later ones. Flushes and compactions keep the versions it sees until it is released.
+struct Snapshot {
+    SequenceNumber sequence;
+};
+
 class LSMTree {
     using Memtable = Memtable::Memtable;
     using BloomFilter = MyLSMTree::Memtable::BloomFilter;
+    using BloomFilterBatchInserter = MyLSMTree::Memtable::BloomFilterBatchInserter;
     using SSTableReadersManager = SSTable::SSTableReadersManager;
     using SSTableReader = SSTableReadersManager::SSTableReader;
-    using Level = std::vector<Path>;
-    using Levels = std::vector<size_t>;
+    // Ids of the sstables of one sorted run in the order of their keys. A run is written by one flush or compaction,
+    // and a compaction split into key ranges writes an sstable for each of them.
+    using Run = std::vector<size_t>;
+    // Runs of one level, from the oldest to the newest.
+    using Level = std::vector<Run>;
+    using Levels = std::vector<Level>;
     using LockGuard = std::lock_guard<std::mutex>;
-    using KVIterator = SSTableReader::KVIterator;
+    using UniqueLock = std::unique_lock<std::mutex>;
+    using PrefetchingKVIterator = SSTableReader::PrefetchingKVIterator;
+
+    // An sstable of the tree, shared by the versions that include it. Once compaction has replaced it, its file is
+    // deleted with the last of them.
+    struct TableFile {
+        TableFile(size_t id, const Path& path, SSTableReadersManager& manager);
+        TableFile(const TableFile&) = delete;
+        ~TableFile() noexcept;
+
+        size_t id;
+        Path path;
+        SSTableReadersManager* manager;
+        std::atomic<bool> obsolete = false;
+    };
+
+    // Everything lookups read: the memtables and the sstables of every level. A version never changes, every change
+    // of the tree installs a new one, so lookups search the version they took without holding any lock. The sstables
+    // of a level go from the oldest run to the newest. The sstables of a run have no key in common, so lookups may
+    // take them in any order.
+    struct Version {
+        std::shared_ptr<Memtable> memtable;
+        std::shared_ptr<Memtable> immutable_memtable;
+        std::vector<std::vector<std::shared_ptr<TableFile>>> levels;
+    };
+
+    // One key range of a compaction, merged into an sstable of its own.
+    struct Subcompaction {
+        KeyRange range;
+        // Estimate of the input records in the range.
+        size_t kv_count;
+        size_t id;
+        size_t written_kv_count = 0;
+        std::exception_ptr error = nullptr;
+    };
+
+    // The key ranges of a running compaction. Threads take the ranges in order and merge them with their own loops.
+    struct SubcompactionJob {
+        const std::vector<SSTableReader>* readers;
+        bool delete_tombstones;
+        std::span<const SequenceNumber> snapshots;
+        std::vector<Subcompaction>* subcompactions;
+        size_t next = 0;
+        // Ranges not merged yet, including the ones being merged.
+        size_t unfinished;
+    };
+
+    // A pending Insert/Erase. The first queued writer commits its followers' records together with its own.
+    struct Writer {
+        Writer(const Key& key, const Value& value) : key(&key), value(&value) {
+        }
+
+        const Key* key;
+        const Value* value;
+        SequenceNumber sequence = 0;
+        bool done = false;
+        // Set by the leader once the group is logged and the follower may insert its record into the memtable.
+        Writer* leader = nullptr;
+        // Followers of a leader that have not inserted their records yet.
+        size_t pending_inserts = 0;
+        std::exception_ptr error;
+        std::condition_variable cv;
+    };
+
+public:
+    // Iterates over the keys of a range in either order, as they were when the iterator was created. It merges the
+    // cursors of the memtables and sstables with a heap, takes the newest version of every key and hides the deleted
+    // ones. The sstables are read only as far as the iterator gets, so a scan stopped early costs little, and the last
+    // keys before some key are best read with SeekForPrev and Prev. Changing the direction seeks every cursor again.
+    // The iterator holds on to the memtables and sstables it reads and must not outlive the tree.
+    class Iterator {
+        friend class LSMTree;
+
+    public:
+        Iterator(Iterator&&) = default;
+
+        bool IsValid() const;
+        // Moves to the first key of the range not less than key.
+        void Seek(const Key& key);
+        // Moves to the last key of the range not greater than key.
+        void SeekForPrev(const Key& key);
+        void SeekToFirst();
+        void SeekToLast();
+        void Next();
+        void Prev();
+        KeyView GetKey() const;
+        ValueView GetValue() const;
+
+    private:
+        Iterator(const LSMTree& tree, std::shared_ptr<const Version> version, const KeyRange& range,
+                 SequenceNumber snapshot);
+
+        // Sources go from the newest to the oldest: the memtables, then the sstables from the newest.
+        size_t GetSourceCount() const;
+        bool IsValid(size_t source) const;
+        KeyView GetKey(size_t source) const;
+        ValueView GetValue(size_t source) const;
+        // Moves the source on in the direction of the iterator.
+        void Step(size_t source);
+        // Positions every source at key, or at its first key if key is nullptr, going in the direction given, and
+        // rebuilds the heap.
+        void SeekSources(const Key* key, bool backward);
+        // Moves every source past the key on top of the heap.
+        void SkipKey();
+        void SkipDeleted();
+        bool IsPastLower(KeyView key) const;
+        bool IsPastUpper(KeyView key) const;
+        bool HeapGreater(size_t lhs, size_t rhs) const;
 
-    struct ComponentInfo {
-        size_t number;
-        bool level_was_created_just_now;
+    private:
+        std::shared_ptr<const Version> version_;
+        KeyRange range_;
+        std::vector<Memtable::Iterator> memtable_iterators_;
+        // Never reallocated, the sstable iterators point to the readers.
+        std::vector<SSTableReader> readers_;
+        std::vector<SSTableReader::Iterator> table_iterators_;
+        // Heap of the positioned sources by key, the least key on top going forward and the greatest going backward,
+        // and then by source, so the newest version of a key is on top.
+        std::vector<size_t> heap_;
+        bool backward_ = false;
     };
 
 public:
     explicit LSMTree(const Path& tree_data);
+    LSMTree(const LSMTreeOptions& options, const Path& tree_data);
     LSMTree(size_t fd_cache_size, size_t sstable_scaling_factor, size_t memtable_kv_count_limit,
             size_t kv_buffer_slice_size, double filter_false_positive_rate, const Path& tree_data);
     ~LSMTree() noexcept;
@@ -33,23 +232,132 @@ public:
     void Erase(const Key& key);
     LookupResult Find(const Key& key) const;
     RangeLookupResult FindRange(const KeyRange& range) const;
+    // Every snapshot has to be released, the tree keeps the versions it sees until then.
+    Snapshot GetSnapshot();
+    void ReleaseSnapshot(const Snapshot& snapshot);
+    LookupResult Find(const Key& key, const Snapshot& snapshot) const;
+    RangeLookupResult FindRange(const KeyRange& range, const Snapshot& snapshot) const;
+    // Looks up a batch of keys, the results go in the order of the keys. Every sstable is opened once for the whole
+    // batch and its filter is probed with the hashes computed once per key, the keys that pass are resolved together.
+    std::vector<LookupResult> MultiGet(std::span<const Key> keys) const;
+    std::vector<LookupResult> MultiGet(std::span<const Key> keys, const Snapshot& snapshot) const;
+    // Same as Find and FindRange, but the tasks wait for the sstable reads without blocking the thread, so one thread
+    // keeps many lookups in flight by running them together with IO::WhenAll. FindRangeAsync merges the sstables as it
+    // reads them, a chunk of scan_readahead_size bytes of each at a time. The lookups see the tree as it was when they
+    // were called. Opening an sstable that is not in the table cache still blocks. The tree must outlive the tasks.
+    IO::Task<LookupResult> FindAsync(IO::EventLoop& loop, const Key& key) const;
+    IO::Task<LookupResult> FindAsync(IO::EventLoop& loop, const Key& key, const Snapshot& snapshot) const;
+    IO::Task<RangeLookupResult> FindRangeAsync(IO::EventLoop& loop, const KeyRange& range) const;
+    IO::Task<RangeLookupResult> FindRangeAsync(IO::EventLoop& loop, const KeyRange& range,
+                                               const Snapshot& snapshot) const;
+    // The iterator is positioned at the first key of the range.
+    Iterator NewIterator(const KeyRange& range) const;
+    Iterator NewIterator(const KeyRange& range, const Snapshot& snapshot) const;
+    SSTable::BlockCacheStatistics GetBlockCacheStatistics() const;
+    BackgroundWorkStatistics GetBackgroundWorkStatistics() const;
 
 private:
-    void TryCompacting();
-    void CompactLevelsUpTo(size_t level);
+    LookupResult Find(const Version& version, const Key& key, SequenceNumber snapshot) const;
+    // Tombstones are returned as empty values.
+    static LookupResult FindInMemtables(const Version& version, const Key& key, SequenceNumber snapshot);
+    IO::Task<LookupResult> FindAsync(IO::EventLoop& loop, std::shared_ptr<const Version> version, Key key,
+                                     SequenceNumber snapshot) const;
+    IO::Task<RangeLookupResult> FindRangeAsync(IO::EventLoop& loop, std::shared_ptr<const Version> version,
+                                               KeyRange range, SequenceNumber snapshot) const;
+    std::vector<LookupResult> MultiGet(const Version& version, std::span<const Key> keys,
+                                       SequenceNumber snapshot) const;
+    static RangeLookupResult FindRange(Iterator it);
+    // Sequence numbers of the live snapshots in ascending order.
+    std::vector<SequenceNumber> GetLiveSnapshots() const;
+    void StartBackgroundThreads();
+    std::shared_ptr<Memtable> MakeMemtable() const;
+    std::shared_ptr<const Version> GetCurrentVersion() const;
+    void InstallVersion();
+    void AddTableFile(size_t id);
+    void RemoveTableFile(size_t id);
+    void Write(const Key& key, const Value& value);
+    size_t BuildWriteGroup();
+    static bool WriteGroupKeysAreDistinct(const std::vector<Writer*>& group);
+    void InsertIntoMemtable(const std::vector<Writer*>& group, bool parallel, UniqueLock& lock);
+    void MakeRoomForWrite(UniqueLock& lock);
+    // Load the state after the header of tree_data or the state of a baseline tree, and return the files that are no
+    // longer needed once the new state is persisted.
+    std::vector<Path> LoadTreeState(int fd);
+    std::vector<Path> LoadBaselineTreeState(int fd);
+    size_t LinkBaselineSSTable(const Path& baseline_path);
+    // Creates the log with a durable name.
+    std::unique_ptr<WAL::WriteAheadLog> OpenLog(size_t number) const;
+    // Puts a record recovered at open into the memtable and the new log.
+    void RecoverRecord(const Key& key, const Value& value, SequenceNumber sequence);
+    void PersistTreeState(bool dump_memtables) const;
+    void BackgroundFlush();
+    void FlushImmutableMemtable(UniqueLock& lock);
+    void BackgroundCompaction();
+    std::optional<size_t> PickLevelToCompact() const;
+    void CompactLevel(size_t level, UniqueLock& lock, IO::EventLoop& loop);
+    // Key ranges of about the same size, cut at the first keys of the blocks of the inputs.
+    std::vector<Subcompaction> SplitCompaction(const std::vector<SSTableReader>& readers) const;
+    // Waits for jobs of split compactions and merges their ranges.
+    void BackgroundSubcompaction();
+    // Merges the next range of the job if it has one left. Called with the lock, returns with it.
+    bool RunNextSubcompaction(SubcompactionJob& job, UniqueLock& lock, IO::EventLoop& loop);
+    // Merges the key range into its sstable, the error is kept in the subcompaction.
+    void RunSubcompaction(IO::EventLoop& loop, const std::vector<SSTableReader>& readers, bool delete_tombstones,
+                          std::span<const SequenceNumber> snapshots, Subcompaction& subcompaction) const;
+    // Writes and syncs the records of the range merged through the asynchronous writer. The arguments must outlive
+    // the task.
+    IO::Task<size_t> MergeSSTables(IO::EventLoop& loop, const std::vector<SSTableReader>& readers,
+                                   const KeyRange& range, size_t kv_count, bool delete_tombstones,
+                                   std::span<const SequenceNumber> snapshots, SSTable::SSTableWriter& writer) const;
+    bool LevelsAreEmptyFrom(size_t level) const;
+    void EnsureLevelCount(size_t count);
+    void RemoveTrailingEmptyLevels();
     size_t CalculateKVCountForLevel(size_t level) const;
-    Path GetSSTablePath(size_t level, size_t number) const;
-    ComponentInfo GetLastComponentAtLevel(size_t level);
+    Path GetSSTablePath(size_t id) const;
+    static Path GetBaselineSSTablePath(size_t level, size_t number);
+    Path GetLogPath(size_t number) const;
 
 private:
-    std::unique_ptr<Memtable> memtable_;
+    LSMTreeOptions options_;
+    std::shared_ptr<Memtable> memtable_;
+    // Frozen memtable waiting for the background thread to turn it into an L0 sstable.
+    std::shared_ptr<Memtable> immutable_memtable_;
+    // Already flushed memtable, kept cleared so its buffers can be reused by the next one.
+    std::shared_ptr<Memtable> recycled_memtable_;
     std::unique_ptr<SSTable::SSTableReadersManager> readers_manager_;
     Levels levels_;
+    // Sstables of levels_ by id.
+    std::map<size_t, std::shared_ptr<TableFile>> table_files_;
+    // Built from the fields above under mtx_, swapped under version_mtx_ so lookups never wait for mtx_.
+    std::shared_ptr<const Version> current_version_;
+    mutable std::mutex version_mtx_;
+    std::vector<bool> level_is_compacting_;
+    size_t next_sstable_id_ = 0;
+    std::unique_ptr<WAL::WriteAheadLog> wal_;
+    // Log of the active memtable. Logs from min_log_number_ on are still needed by the memtables.
+    size_t log_number_ = 0;
+    size_t min_log_number_ = 0;
+    std::deque<Writer*> writers_;
+    // Sequence number of the last write group applied to the memtable. Lookups don't see the records of the groups
+    // that are still being applied.
+    std::atomic<SequenceNumber> last_sequence_ = 0;
+    std::multiset<SequenceNumber> snapshots_;
     Path tree_data_;
-    size_t sstable_scaling_factor_;
-    size_t memtable_kv_count_limit_;
-    double filter_false_positive_rate_;
     mutable std::mutex mtx_;
+    std::condition_variable background_work_cv_;
+    std::condition_variable compaction_work_cv_;
+    std::condition_variable background_done_cv_;
+    // Jobs with ranges no thread has taken yet.
+    std::deque<SubcompactionJob*> subcompaction_jobs_;
+    std::condition_variable subcompaction_work_cv_;
+    std::condition_variable subcompaction_done_cv_;
+    std::exception_ptr background_error_;
+    bool stopping_ = false;
+    size_t running_compaction_count_ = 0;
+    BackgroundWorkStatistics background_work_statistics_{};
+    std::thread flush_thread_;
+    std::vector<std::thread> compaction_threads_;
+    std::vector<std::thread> subcompaction_threads_;
 };
 
 }  // namespace MyLSMTree
@@ -1,16 +1,16 @@
 #include "bitset.h"
 #include <cstdint>
+#include <utility>
 
 namespace MyLSMTree::Memtable {
 
 Bitset::Bitset(size_t bits_count) : data_((bits_count + 63) / 64, 0) {
 }
 
-Bitset::Bitset(std::vector<uint64_t> data) : data_(data) {
+Bitset::Bitset(Words data) : data_(std::move(data)) {
 
 }
 
-
 bool Bitset::Test(size_t i) const {
     return data_[i >> 6] & (1ULL << (i & 63));
 }
@@ -27,6 +27,10 @@ void Bitset::Clear() {
     data_.assign(data_.size(), 0);
 }
 
+uint64_t* Bitset::Data() {
+    return data_.data();
+}
+
 const uint64_t* Bitset::Data() const {
     return data_.data();
 }
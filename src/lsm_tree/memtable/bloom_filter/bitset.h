@@ -2,25 +2,54 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <new>
 #include <vector>
 
 namespace MyLSMTree::Memtable {
 
+// Aligns the words of a bitset to cache lines, so each block of a blocked bloom filter is a single cache line.
+template <typename T>
+struct CacheLineAllocator {
+    using value_type = T;
+    static constexpr std::align_val_t kAlignment{64};
+
+    CacheLineAllocator() = default;
+    template <typename U>
+    CacheLineAllocator(const CacheLineAllocator<U>&) {
+    }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), kAlignment));
+    }
+
+    void deallocate(T* p, size_t) {
+        ::operator delete(p, kAlignment);
+    }
+
+    template <typename U>
+    bool operator==(const CacheLineAllocator<U>&) const {
+        return true;
+    }
+};
+
 class Bitset {
 public:
+    using Words = std::vector<uint64_t, CacheLineAllocator<uint64_t>>;
+
     explicit Bitset(size_t bits_count);
-    explicit Bitset(std::vector<uint64_t> data);
+    explicit Bitset(Words data);
 
     bool Test(size_t i) const;
     void Set(size_t i);
     void Reset(size_t i);
     void Clear();
 
+    uint64_t* Data();
     const uint64_t* Data() const;
     size_t GetSizeInBytes() const;
 
 private:
-    std::vector<uint64_t> data_;
+    Words data_;
 };
 
 }  // namespace MyLSMTree::Memtable
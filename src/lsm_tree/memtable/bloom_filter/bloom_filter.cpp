@@ -1,32 +1,156 @@
 #include "bloom_filter.h"
 
+#include <algorithm>
 #include <cassert>
 #include <unistd.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "../../common.h"
 
 namespace MyLSMTree::Memtable {
 
-BloomFilter::BloomFilter(size_t bits_count, size_t hash_func_count)
-    : filter_(bits_count), hash_func_count_(hash_func_count), bits_count_(bits_count) {
+namespace {
+
+constexpr size_t kBlockWordsCount = BloomFilter::kBlockBitsCount / 64;
+
+alignas(32) constexpr uint32_t kBlockSalts[kBlockWordsCount] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                                                0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+
+__extension__ using Uint128 = unsigned __int128;
+
+// Maps the hash onto [0, blocks count) with a multiplication instead of a division.
+size_t GetBlockIndex(uint64_t low_hash, size_t bits_count) {
+    size_t blocks_count = bits_count / BloomFilter::kBlockBitsCount;
+    return static_cast<size_t>((static_cast<Uint128>(low_hash) * blocks_count) >> 64);
+}
+
+// With less than eight hash functions the probed words start at a key-dependent word, so all words get used.
+size_t GetBlockRotation(uint64_t high_hash) {
+    return (high_hash >> 32) % kBlockWordsCount;
+}
+
+#ifdef __AVX2__
+
+struct BlockMasks {
+    __m256i low;
+    __m256i high;
+};
+
+// Bits to set in words 0-3 and 4-7 of the block.
+BlockMasks MakeBlockMasks(uint64_t high_hash, size_t hash_func_count) {
+    const int rotation = static_cast<int>(GetBlockRotation(high_hash));
+    __m256i salts = _mm256_load_si256(reinterpret_cast<const __m256i*>(kBlockSalts));
+    __m256i key = _mm256_set1_epi32(static_cast<uint32_t>(high_hash));
+    __m256i shifts = _mm256_srli_epi32(_mm256_mullo_epi32(key, salts), 26);
+    // Words past hash_func_count get a shift of at least 64, which leaves their masks empty.
+    __m256i used = _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(hash_func_count)),
+                                      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    shifts = _mm256_or_si256(shifts, _mm256_andnot_si256(used, _mm256_set1_epi32(64)));
+    __m256i source_words = _mm256_and_si256(
+        _mm256_sub_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(rotation)), _mm256_set1_epi32(7));
+    shifts = _mm256_permutevar8x32_epi32(shifts, source_words);
+    __m256i ones = _mm256_set1_epi64x(1);
+    return {_mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(shifts))),
+            _mm256_sllv_epi64(ones, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(shifts, 1)))};
+}
+
+void InsertIntoBlock(uint64_t* block, uint64_t high_hash, size_t hash_func_count) {
+    BlockMasks masks = MakeBlockMasks(high_hash, hash_func_count);
+    auto* low = reinterpret_cast<__m256i*>(block);
+    auto* high = reinterpret_cast<__m256i*>(block + 4);
+    _mm256_store_si256(low, _mm256_or_si256(_mm256_load_si256(low), masks.low));
+    _mm256_store_si256(high, _mm256_or_si256(_mm256_load_si256(high), masks.high));
+}
+
+bool TestBlock(const uint64_t* block, uint64_t high_hash, size_t hash_func_count) {
+    BlockMasks masks = MakeBlockMasks(high_hash, hash_func_count);
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 4));
+    return _mm256_testc_si256(low, masks.low) & _mm256_testc_si256(high, masks.high);
+}
+
+#else
+
+uint64_t GetBlockWordMask(uint64_t high_hash, size_t i) {
+    return 1ULL << ((static_cast<uint32_t>(high_hash) * kBlockSalts[i]) >> 26);
+}
+
+void InsertIntoBlock(uint64_t* block, uint64_t high_hash, size_t hash_func_count) {
+    size_t rotation = GetBlockRotation(high_hash);
+    for (size_t i = 0; i < hash_func_count; ++i) {
+        block[(i + rotation) % kBlockWordsCount] |= GetBlockWordMask(high_hash, i);
+    }
+}
+
+bool TestBlock(const uint64_t* block, uint64_t high_hash, size_t hash_func_count) {
+    size_t rotation = GetBlockRotation(high_hash);
+    for (size_t i = 0; i < hash_func_count; ++i) {
+        uint64_t mask = GetBlockWordMask(high_hash, i);
+        if ((block[(i + rotation) % kBlockWordsCount] & mask) != mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
+
+size_t AdjustBitsCount(size_t bits_count, FilterType type) {
+    if (type != FilterType::kBlocked) {
+        return bits_count;
+    }
+    size_t blocks_count = (bits_count + BloomFilter::kBlockBitsCount - 1) / BloomFilter::kBlockBitsCount;
+    blocks_count = std::max<size_t>(blocks_count, 1);
+    return blocks_count * BloomFilter::kBlockBitsCount;
+}
+
+size_t AdjustHashFuncCount(size_t hash_func_count, FilterType type) {
+    return type == FilterType::kBlocked ? std::min(hash_func_count, BloomFilter::kMaxBlockedHashFuncCount)
+                                        : hash_func_count;
+}
+
+}  // namespace
+
+BloomFilter::BloomFilter(size_t bits_count, size_t hash_func_count, FilterType type)
+    : filter_(AdjustBitsCount(bits_count, type)),
+      hash_func_count_(AdjustHashFuncCount(hash_func_count, type)),
+      bits_count_(AdjustBitsCount(bits_count, type)),
+      type_(type) {
 }
 
 BloomFilter::BloomFilter(Bitset filter, size_t bits_count, size_t hash_func_count)
     : filter_(std::move(filter)), hash_func_count_(hash_func_count), bits_count_(bits_count) {
 }
 
-
-void BloomFilter::Insert(const Key& key) {
-    Insert(key.data(), key.size() * sizeof(key[0]));
+void BloomFilter::Insert(KeyView key) {
+    InsertHash(CalculateHash(key.data(), key.size() * sizeof(key[0])));
 }
 
-bool BloomFilter::Find(const Key& key) {
-    return Find(key.data(), key.size() * sizeof(key[0]));
+void BloomFilter::InsertHash(KeyHash hash) {
+    auto [low_hash, high_hash] = hash;
+    if (type_ == FilterType::kBlocked) {
+        size_t block = GetBlockIndex(low_hash, bits_count_);
+        InsertIntoBlock(filter_.Data() + block * kBlockWordsCount, high_hash, hash_func_count_);
+        return;
+    }
+    for (size_t i = 0; i < hash_func_count_; ++i) {
+        filter_.Set(CalculateIthHash(low_hash, high_hash, i, bits_count_));
+    }
 }
 
+void BloomFilter::InsertHashes(std::span<const KeyHash> hashes) {
+    for (const auto& hash : hashes) {
+        Prefetch(hash);
+    }
+    for (const auto& hash : hashes) {
+        InsertHash(hash);
+    }
+}
 
-void BloomFilter::MakeFilterBlockInFd(int fd) const {
-    write(fd, filter_.Data(), filter_.GetSizeInBytes());
+bool BloomFilter::Find(const Key& key) {
+    return Find(key.data(), key.size() * sizeof(key[0]));
 }
 
 void BloomFilter::Clear() {
@@ -41,23 +165,63 @@ size_t BloomFilter::HashFuncCount() const {
     return hash_func_count_;
 }
 
+FilterType BloomFilter::Type() const {
+    return type_;
+}
+
 size_t BloomFilter::GetSizeInBytes() const {
     return filter_.GetSizeInBytes();
 }
 
-void BloomFilter::Insert(const uint8_t* data, size_t size) {
-    for (size_t i = 0; i < hash_func_count_; ++i) {
-        filter_.Set(CalculateIthHash(data, size, i, bits_count_));
-    }
+const uint64_t* BloomFilter::Data() const {
+    return filter_.Data();
 }
 
-bool BloomFilter::Find(const uint8_t* data, size_t size) const {
-    for (size_t i = 0; i < hash_func_count_; ++i) {
-        if (!filter_.Test(CalculateIthHash(data, size, i, bits_count_))) {
+bool BloomFilter::Test(const uint64_t* data, size_t bits_count, size_t hash_func_count, FilterType type,
+                       uint64_t low_hash, uint64_t high_hash) {
+    if (type == FilterType::kBlocked) {
+        size_t block = GetBlockIndex(low_hash, bits_count);
+        return TestBlock(data + block * kBlockWordsCount, high_hash, hash_func_count);
+    }
+    for (size_t i = 0; i < hash_func_count; ++i) {
+        size_t bit = CalculateIthHash(low_hash, high_hash, i, bits_count);
+        if (!(data[bit >> 6] & (1ULL << (bit & 63)))) {
             return false;
         }
     }
     return true;
 }
 
+bool BloomFilter::Find(const uint8_t* data, size_t size) const {
+    auto [low_hash, high_hash] = CalculateHash(data, size);
+    return Test(filter_.Data(), bits_count_, hash_func_count_, type_, low_hash, high_hash);
+}
+
+void BloomFilter::Prefetch(KeyHash hash) const {
+    auto [low_hash, high_hash] = hash;
+    if (type_ == FilterType::kBlocked) {
+        __builtin_prefetch(filter_.Data() + GetBlockIndex(low_hash, bits_count_) * kBlockWordsCount, 1);
+        return;
+    }
+    for (size_t i = 0; i < hash_func_count_; ++i) {
+        __builtin_prefetch(filter_.Data() + (CalculateIthHash(low_hash, high_hash, i, bits_count_) >> 6), 1);
+    }
+}
+
+BloomFilterBatchInserter::BloomFilterBatchInserter(BloomFilter& filter) : filter_(&filter) {
+    hashes_.reserve(kBatchSize);
+}
+
+void BloomFilterBatchInserter::Insert(KeyView key) {
+    hashes_.emplace_back(CalculateHash(key.data(), key.size()));
+    if (hashes_.size() == kBatchSize) {
+        Flush();
+    }
+}
+
+void BloomFilterBatchInserter::Flush() {
+    filter_->InsertHashes(hashes_);
+    hashes_.clear();
+}
+
 }  // namespace MyLSMTree::Memtable
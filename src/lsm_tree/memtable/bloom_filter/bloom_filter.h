@@ -6,27 +6,59 @@
 
 namespace MyLSMTree::Memtable {
 
+// A blocked filter sets its bits in a single 64-byte block per key: one bit in each of hash_func_count consecutive
+// (cyclically) words of the block's eight, so there are at most eight hash functions. The block is picked with a
+// multiply-shift of the low half of the key hash, the first word and the bits come from the high half.
 class BloomFilter {
 public:
-    BloomFilter(size_t bits_count, size_t hash_func_count);
+    static constexpr size_t kBlockBitsCount = 512;
+    static constexpr size_t kMaxBlockedHashFuncCount = 8;
+
+    using KeyHash = std::pair<uint64_t, uint64_t>;
+
+    BloomFilter(size_t bits_count, size_t hash_func_count, FilterType type = FilterType::kStandard);
     BloomFilter(Bitset filter, size_t hash_func_count, size_t bits_count);
 
-    void Insert(const Key& key);
+    void Insert(KeyView key);
+    void InsertHash(KeyHash hash);
+    // Prefetches the words of every key of the batch before setting any bit, so their cache misses overlap.
+    void InsertHashes(std::span<const KeyHash> hashes);
     bool Find(const Key& key);
-    void MakeFilterBlockInFd(int fd) const;
     void Clear();
     size_t BitsCount() const;
     size_t HashFuncCount() const;
+    FilterType Type() const;
     size_t GetSizeInBytes() const;
+    const uint64_t* Data() const;
+
+    // Probes a filter laid out in memory, such as the filter block of an sstable.
+    static bool Test(const uint64_t* data, size_t bits_count, size_t hash_func_count, FilterType type,
+                     uint64_t low_hash, uint64_t high_hash);
 
 private:
     bool Find(const uint8_t* data, size_t size) const;
-    void Insert(const uint8_t* data, size_t size);
+    void Prefetch(KeyHash hash) const;
 
 private:
     Bitset filter_;
     size_t hash_func_count_;
     size_t bits_count_;
+    FilterType type_ = FilterType::kStandard;
+};
+
+// Hashes the keys as they come and inserts them into the filter with InsertHashes in batches. Flush inserts the rest.
+class BloomFilterBatchInserter {
+public:
+    static constexpr size_t kBatchSize = 64;
+
+    explicit BloomFilterBatchInserter(BloomFilter& filter);
+
+    void Insert(KeyView key);
+    void Flush();
+
+private:
+    BloomFilter* filter_;
+    std::vector<BloomFilter::KeyHash> hashes_;
 };
 
 }  // namespace MyLSMTree::Memtable
@@ -6,29 +6,39 @@
 
 namespace MyLSMTree::Memtable {
 
+// The filter of the sstable is not kept in the memtable, it is built at flush time for the actual number of keys.
+// The memtable keeps every version of a key, the lookups see the newest one up to the sequence number snapshot.
 class Memtable {
 public:
-    Memtable(size_t filter_bits_count, size_t filter_hash_func_count, size_t kv_count_limit,
-             uint32_t kv_buffer_slice_size, std::mt19937::result_type list_rng_seed = 6);
+    using Iterator = SkipList::Iterator;
 
-    Memtable(BloomFilter filter, size_t kv_count_limit, uint32_t kv_buffer_slice_size,
-             std::mt19937::result_type list_rng_seed = 6);
+    Memtable(size_t kv_count_limit, uint32_t kv_buffer_slice_size, std::mt19937::result_type list_rng_seed = 6);
 
-    void Insert(const Key& key, const Value& value);
-    LookupResult Find(const Key& key) const;
-    RangeLookupResult FindRange(const KeyRange& range, RangeLookupResult accumulated = {}) const;
+    void Insert(const Key& key, const Value& value, SequenceNumber sequence);
+    LookupResult Find(const Key& key, SequenceNumber snapshot = kMaxSequenceNumber) const;
+    // Same as Find for every key, with the lookups interleaved to overlap their cache misses.
+    std::vector<LookupResult> MultiFind(std::span<const Key* const> keys,
+                                        SequenceNumber snapshot = kMaxSequenceNumber) const;
+    RangeLookupResult FindRange(const KeyRange& range, SequenceNumber snapshot = kMaxSequenceNumber,
+                                RangeLookupResult accumulated = {}) const;
 
-    void Erase(const Key& key);
+    // The iterator is not positioned until it is sought.
+    Iterator NewIterator(SequenceNumber snapshot = kMaxSequenceNumber) const;
+
+    void Erase(const Key& key, SequenceNumber sequence);
     void Clear();
     size_t GetKVCount() const;
+    size_t GetGarbageSizeInBytes() const;
+    size_t GetMemoryUsage() const;
     size_t GetKVBufferSliceSize() const;
-    size_t GetFilterBitsCount() const;
-    size_t GetFilterHashFuncCount() const;
-    size_t MakeSSTableInFd(int fd, bool skip_deleted) const;
-    void DumpKVInFd(int fd) const;
+    // The filter gets the keys of the written records and is stored in the sstable. Older versions of the keys are
+    // written only if some of the sorted snapshots sees them.
+    size_t MakeSSTable(SSTable::SSTableWriter& writer, bool skip_deleted, BloomFilter& filter,
+                       std::span<const SequenceNumber> snapshots) const;
+    // Writes the newest version of every key.
+    void DumpKV(SSTable::SSTableWriter& writer) const;
 
 private:
-    BloomFilter filter_;
     SkipList list_;
 };
 
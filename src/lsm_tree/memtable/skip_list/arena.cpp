@@ -0,0 +1,94 @@
+#include "arena.h"
+
+#include <cstdlib>
+#include <stdexcept>
+
+namespace MyLSMTree::Memtable {
+
+Arena::Arena(size_t block_size) : block_size_(block_size) {
+    if (!block_size_) {
+        throw std::runtime_error("Arena must have block_size > 0.");
+    }
+    EnsureBlocks(0, 0);
+}
+
+Arena::~Arena() noexcept {
+    for (auto& chunk_ptr : directory_) {
+        Chunk* chunk = chunk_ptr.load(std::memory_order_relaxed);
+        if (!chunk) {
+            continue;
+        }
+        for (size_t i = 0; i < kDirectoryChunkSize; ++i) {
+            std::free(chunk[i].load(std::memory_order_relaxed));
+        }
+        delete[] chunk;
+    }
+}
+
+size_t Arena::Allocate(size_t size) {
+    size_t offset = size_.fetch_add(size, std::memory_order_relaxed);
+    if (size) {
+        EnsureBlocks(offset / block_size_, (offset + size - 1) / block_size_);
+    }
+    return offset;
+}
+
+size_t Arena::AllocateContiguous(size_t size) {
+    if (size > block_size_) {
+        throw std::runtime_error("Arena can't allocate more than a block contiguously.");
+    }
+    size_t offset = size_.load(std::memory_order_relaxed);
+    size_t start;
+    do {
+        // The tail of a block that can't fit the allocation is skipped.
+        start = offset % block_size_ + size > block_size_ ? (offset / block_size_ + 1) * block_size_ : offset;
+    } while (!size_.compare_exchange_weak(offset, start + size, std::memory_order_relaxed));
+    if (size) {
+        EnsureBlocks(start / block_size_, start / block_size_);
+    }
+    return start;
+}
+
+uint8_t* Arena::GetBlock(size_t index) const {
+    Chunk* chunk = directory_[index / kDirectoryChunkSize].load(std::memory_order_acquire);
+    return chunk[index % kDirectoryChunkSize].load(std::memory_order_acquire);
+}
+
+size_t Arena::GetBlockSize() const {
+    return block_size_;
+}
+
+size_t Arena::GetSize() const {
+    return size_.load(std::memory_order_relaxed);
+}
+
+void Arena::Clear() {
+    size_.store(0, std::memory_order_relaxed);
+}
+
+void Arena::EnsureBlocks(size_t first, size_t last) {
+    if (last >= kMaxBlockCount) {
+        throw std::runtime_error("Arena is full.");
+    }
+    for (size_t i = first; i <= last; ++i) {
+        Chunk* chunk = directory_[i / kDirectoryChunkSize].load(std::memory_order_acquire);
+        if (chunk && chunk[i % kDirectoryChunkSize].load(std::memory_order_acquire)) {
+            continue;
+        }
+        const std::lock_guard guard(mtx_);
+        chunk = directory_[i / kDirectoryChunkSize].load(std::memory_order_relaxed);
+        if (!chunk) {
+            chunk = new Chunk[kDirectoryChunkSize]{};
+            directory_[i / kDirectoryChunkSize].store(chunk, std::memory_order_release);
+        }
+        if (!chunk[i % kDirectoryChunkSize].load(std::memory_order_relaxed)) {
+            auto* block = static_cast<uint8_t*>(std::malloc(block_size_));
+            if (!block) {
+                throw std::runtime_error("Arena can't allocate memory.");
+            }
+            chunk[i % kDirectoryChunkSize].store(block, std::memory_order_release);
+        }
+    }
+}
+
+}  // namespace MyLSMTree::Memtable
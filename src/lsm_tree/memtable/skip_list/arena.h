@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace MyLSMTree::Memtable {
+
+// Append-only memory addressed by offsets. It is allocated in blocks of block_size bytes that never move, so readers
+// can follow offsets while other threads allocate. Allocate and the reads are thread-safe, Clear is not. Clear keeps
+// the blocks for reuse.
+class Arena {
+public:
+    static constexpr size_t kDirectoryChunkSize = 1 << 10;
+    static constexpr size_t kMaxBlockCount = kDirectoryChunkSize * kDirectoryChunkSize;
+
+    explicit Arena(size_t block_size);
+    Arena(const Arena&) = delete;
+    ~Arena() noexcept;
+
+    // Returns the offset of size bytes, which may span several blocks.
+    size_t Allocate(size_t size);
+    // Returns the offset of size bytes within a single block, size must not exceed the block size. The offsets stay
+    // aligned to any alignment that all sizes passed to the arena are multiples of.
+    size_t AllocateContiguous(size_t size);
+    uint8_t* GetBlock(size_t index) const;
+    size_t GetBlockSize() const;
+    // Bytes handed out since the last Clear.
+    size_t GetSize() const;
+    void Clear();
+
+private:
+    void EnsureBlocks(size_t first, size_t last);
+
+private:
+    using Chunk = std::atomic<uint8_t*>;
+
+    // Two-level table of blocks, so the arena can grow without moving anything that readers may be looking at.
+    std::array<std::atomic<Chunk*>, kDirectoryChunkSize> directory_{};
+    std::atomic<size_t> size_ = 0;
+    // Serializes the allocation of blocks.
+    std::mutex mtx_;
+    size_t block_size_;
+};
+
+}  // namespace MyLSMTree::Memtable
@@ -2,37 +2,37 @@
 
 #include <cstdint>
 #include <unistd.h>
-#include <vector>
+
+#include "arena.h"
+
+namespace MyLSMTree::SSTable {
+class SSTableWriter;
+}  // namespace MyLSMTree::SSTable
 
 namespace MyLSMTree::Memtable {
 
+// Keys and values of the memtable, stored back to back in slices of slice_size bytes. A record may span slices.
+// Space is reserved with Allocate and then filled with Fill, both thread-safe. Bytes may be refilled only until their
+// record is published to readers, after that they never change until Clear.
 class KVBuffer {
-    struct Slice {
-        uint8_t* data;
-        uint32_t size;
-    };
-
 public:
     explicit KVBuffer(uint32_t slice_size);
     KVBuffer(const KVBuffer&) = delete;
-    ~KVBuffer() noexcept;
 
-    void Append(const uint8_t* data, uint32_t size);
+    size_t Allocate(size_t size);
+    void Fill(size_t offset, const uint8_t* data, uint32_t size);
     size_t GetTotalKVSizeInBytes() const;
     size_t GetKVBufferSliceSize() const;
     int Compare(const uint8_t* lhs, size_t rhs_offset, uint32_t size) const;
     void Write(uint8_t* dest, size_t offset, uint32_t size) const;
-    void WriteToFd(int fd, size_t offset, uint32_t size) const;
+    // Hints the cache line at offset to be loaded, the offset must have been allocated.
+    void Prefetch(size_t offset) const;
+    void AppendTo(SSTable::SSTableWriter& writer, size_t offset, uint32_t size) const;
 
     void Clear();
 
 private:
-    void AllocateSlice();
-    bool AllocatedSuccessfully() const;
-    void DeleteInvalidSlicesAndThrow(uint32_t slices_to_pop_count);
-
-private:
-    std::vector<Slice> slices_;
+    Arena arena_;
     uint32_t slice_size_;
 };
 
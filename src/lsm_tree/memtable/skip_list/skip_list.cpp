@@ -1,8 +1,14 @@
 #include "skip_list.h"
 
+#include <array>
 #include <bit>
+#include <cstring>
+#include <new>
+#include <optional>
 #include <stdexcept>
 
+#include "../../sstable/sstable_writer.h"
+
 namespace MyLSMTree::Memtable {
 
 namespace {
@@ -13,111 +19,215 @@ size_t ThrowIfZeroLimit() {
 
 }  // namespace
 
+SkipList::Iterator::Iterator(const SkipList& list, SequenceNumber snapshot) : list_(&list), snapshot_(snapshot) {
+}
+
+bool SkipList::Iterator::IsValid() const {
+    return node_ != kNil;
+}
+
+void SkipList::Iterator::Seek(const Key& key) {
+    node_ = list_->FindNode(key, true);
+    Settle();
+}
+
+void SkipList::Iterator::SeekForPrev(const Key& key) {
+    node_ = list_->FindNode(key, true);
+    if (list_->Compare(node_, key, GetKeyPrefix(key)) != 0) {
+        node_ = list_->FindLastNode(&key);
+    }
+    SettleBackward();
+}
+
+void SkipList::Iterator::SeekToFirst() {
+    node_ = list_->Next(0)[0].load(std::memory_order_acquire);
+    Settle();
+}
+
+void SkipList::Iterator::SeekToLast() {
+    node_ = list_->FindLastNode(nullptr);
+    SettleBackward();
+}
+
+void SkipList::Iterator::Next() {
+    node_ = list_->Next(node_)[0].load(std::memory_order_acquire);
+    Settle();
+}
+
+void SkipList::Iterator::Prev() {
+    node_ = list_->FindLastNode(&key_);
+    SettleBackward();
+}
+
+KeyView SkipList::Iterator::GetKey() const {
+    return key_;
+}
+
+ValueView SkipList::Iterator::GetValue() const {
+    return value_;
+}
+
+bool SkipList::Iterator::Read() {
+    const Node& node = list_->GetNode(node_);
+    key_.resize(list_->GetKeySize(node_));
+    list_->kvbuffer_.Write(key_.data(), node.key_offset, key_.size());
+    size_t value_offset = list_->FindVersion(node, snapshot_);
+    if (value_offset == kNoValue) {
+        return false;
+    }
+    value_.resize(list_->ReadValueHeader(value_offset).value_size);
+    list_->kvbuffer_.Write(value_.data(), value_offset + kValueHeaderSize, value_.size());
+    return true;
+}
+
+void SkipList::Iterator::Settle() {
+    while (node_ != kNil && !Read()) {
+        node_ = list_->Next(node_)[0].load(std::memory_order_acquire);
+    }
+}
+
+void SkipList::Iterator::SettleBackward() {
+    while (node_ != kNil && !Read()) {
+        node_ = list_->FindLastNode(&key_);
+    }
+}
+
 SkipList::SkipList(size_t kv_count_limit, uint32_t kv_buffer_slice_size, std::mt19937::result_type rng_seed)
-    : index_block_buffer_(kv_count_limit),
-      rng_gen_(rng_seed),
+    : node_arena_(kNodeArenaBlockSize),
       kvbuffer_(kv_buffer_slice_size),
+      rng_state_(rng_seed),
       level_count_limit_(kv_count_limit ? std::min(kMaxLevel, static_cast<size_t>(std::bit_width(kv_count_limit) + 3))
                                         : ThrowIfZeroLimit()) {
-    nodes_.reserve(kv_count_limit * level_count_limit_ + 1);
-    nodes_.emplace_back();
-#ifndef NDEBUG
-    std::fill_n(statistics, kMaxLevel, 0);
-#endif
-}
-
-void SkipList::Insert(const Key& key, const Value& value) {
-    if (!kv_count_) {
-        ++kv_count_;
-        nodes_.emplace_back();
-        auto& new_node = nodes_.back();
-        new_node.height = RandomLevel();
-        for (size_t level = 0; level < new_node.height; ++level) {
-            nodes_[0].next[level] = 1;
-        }
-        WriteToNode(new_node, key, value);
-    } else {
-        size_t update[kMaxLevel];
-        std::fill_n(update, kMaxLevel, 0);
-        auto cur_node = 0;
-        for (size_t cur_level = level_count_limit_ - 1; ~cur_level; --cur_level) {
-            while (true) {
-                size_t next_node = nodes_[cur_node].next[cur_level];
-                int cmp = Compare(next_node, key);
-                if (cmp == 0) {
-                    if (value.size() == 0) {
-                        nodes_[next_node].value_size = 0;
-                    } else {
-                        WriteToNode(nodes_[next_node], key, value);
-                    }
-                    return;
-                } else if (cmp < 0) {
-                    break;
-                }
-                cur_node = next_node;
+    AllocateNode(level_count_limit_);
+}
+
+void SkipList::Insert(const Key& key, const Value& value, SequenceNumber sequence) {
+    uint32_t prev[kMaxLevel];
+    uint32_t next[kMaxLevel];
+    uint64_t key_prefix = GetKeyPrefix(key);
+    uint32_t cur_node = 0;
+    for (size_t cur_level = level_count_limit_ - 1; ~cur_level; --cur_level) {
+        FindSpliceForLevel(key, key_prefix, cur_node, cur_level, prev[cur_level], next[cur_level]);
+        cur_node = prev[cur_level];
+    }
+    if (Compare(next[0], key, key_prefix) == 0) {
+        PushValue(GetNode(next[0]), WriteValue(kvbuffer_.Allocate(kValueHeaderSize + value.size()), value, sequence),
+                  value.size());
+        return;
+    }
+
+    uint32_t height = RandomHeight();
+    uint32_t new_node = AllocateNode(height);
+    Node& node = GetNode(new_node);
+    node.key_offset = kvbuffer_.Allocate(key.size() + kValueHeaderSize + value.size());
+    node.key_prefix = key_prefix;
+    GetKeySize(new_node) = key.size();
+    kvbuffer_.Fill(node.key_offset, key.data(), key.size());
+    node.value_offset.store(WriteValue(node.key_offset + key.size(), value, sequence), std::memory_order_relaxed);
+    for (size_t level = 0; level < height; ++level) {
+        while (true) {
+            Next(new_node)[level].store(next[level], std::memory_order_relaxed);
+            // Publishes the node together with its key and value.
+            if (Next(prev[level])[level].compare_exchange_strong(next[level], new_node, std::memory_order_release,
+                                                                 std::memory_order_relaxed)) {
+                break;
+            }
+            // Someone linked a node in between, the nodes before prev[level] can't have changed.
+            FindSpliceForLevel(key, key_prefix, prev[level], level, prev[level], next[level]);
+            if (level == 0 && Compare(next[0], key, key_prefix) == 0) {
+                // The same key was linked first by another writer, so the new node stays unlinked.
+                PushValue(GetNode(next[0]), node.value_offset.load(std::memory_order_relaxed), value.size());
+                return;
             }
-            update[cur_level] = cur_node;
-        }
-        nodes_.emplace_back();
-        auto& new_node = nodes_.back();
-        new_node.height = RandomLevel();
-        for (size_t level = 0; level < new_node.height; ++level) {
-            auto& prev_node = nodes_[update[level]];
-            new_node.next[level] = prev_node.next[level];
-            prev_node.next[level] = nodes_.size() - 1;
         }
-        WriteToNode(nodes_.back(), key, value);
-        ++kv_count_;
     }
+    live_size_.fetch_add(key.size() + kValueHeaderSize + value.size(), std::memory_order_relaxed);
+    kv_count_.fetch_add(1, std::memory_order_relaxed);
 }
 
-void SkipList::Erase(const Key& key) {
-    Insert(key, {});
+void SkipList::Erase(const Key& key, SequenceNumber sequence) {
+    Insert(key, {}, sequence);
 }
 
-LookupResult SkipList::Find(const Key& key) const {
-    if (!kv_count_) {
+LookupResult SkipList::Find(const Key& key, SequenceNumber snapshot) const {
+    if (!Size()) {
         return std::nullopt;
     }
-    auto cur_node = 0;
-    for (size_t cur_level = level_count_limit_ - 1; ~cur_level; --cur_level) {
-        while (true) {
-            size_t next_node = nodes_[cur_node].next[cur_level];
-            int cmp = Compare(next_node, key);
-            if (cmp == 0) {
-                const auto& node = nodes_[next_node];
-                LookupResult value = std::make_optional<Value>(0);
-                if (node.value_size == 0) {
-                    return value;
-                }
-                value->resize(node.value_size);
-                kvbuffer_.Write(value->data(), node.key_offset + node.key_size, node.value_size);
-                return value;
-            } else if (cmp < 0) {
-                break;
+    uint32_t node_index = FindNode(key, true);
+    if (Compare(node_index, key, GetKeyPrefix(key)) != 0) {
+        return std::nullopt;
+    }
+    return ReadVersion(node_index, snapshot);
+}
+
+std::vector<LookupResult> SkipList::MultiFind(std::span<const Key* const> keys, SequenceNumber snapshot) const {
+    std::vector<LookupResult> res(keys.size());
+    if (!Size()) {
+        return res;
+    }
+    std::array<Search, kMultiFindGroupSize> searches;
+    std::array<size_t, kMultiFindGroupSize> key_indexes;
+    size_t next_key = 0;
+    auto start_search = [&](size_t slot) {
+        searches[slot] = Search{.key = keys[next_key],
+                                .key_prefix = GetKeyPrefix(*keys[next_key]),
+                                .cur_node = 0,
+                                .next_node = kNil,
+                                .level = level_count_limit_ - 1,
+                                .stage = Search::Stage::kLink};
+        key_indexes[slot] = next_key++;
+    };
+    size_t active = 0;
+    for (; active < kMultiFindGroupSize && next_key < keys.size(); ++active) {
+        start_search(active);
+    }
+    while (active) {
+        for (size_t slot = 0; slot < active;) {
+            if (!StepSearch(searches[slot])) {
+                ++slot;
+                continue;
+            }
+            if (searches[slot].next_node != kNil) {
+                res[key_indexes[slot]] = ReadVersion(searches[slot].next_node, snapshot);
+            }
+            // The slot is taken by the next key, or by the last active search.
+            if (next_key < keys.size()) {
+                start_search(slot++);
+            } else {
+                --active;
+                searches[slot] = searches[active];
+                key_indexes[slot] = key_indexes[active];
             }
-            cur_node = next_node;
         }
     }
-    return std::nullopt;
+    return res;
 }
 
-RangeLookupResult SkipList::FindRange(const KeyRange& range, RangeLookupResult accumulated) const {
-    if (!kv_count_) {
+RangeLookupResult SkipList::FindRange(const KeyRange& range, SequenceNumber snapshot,
+                                      RangeLookupResult accumulated) const {
+    if (!Size()) {
         return accumulated;
     }
-    uint32_t cur_node = range.lower.has_value() ? FindNode(*range.lower, range.including_lower) : nodes_[0].next[0];
+    uint32_t cur_node = range.lower.has_value() ? FindNode(*range.lower, range.including_lower)
+                                                : Next(0)[0].load(std::memory_order_acquire);
     Key key_buffer;
-    for (; cur_node != kNil && (!range.upper.has_value() || Compare(cur_node, *range.upper) > (range.including_upper ? -1 : 0));
-         cur_node = nodes_[cur_node].next[0]) {
-        const Node& node = nodes_[cur_node];
-        key_buffer.resize(node.key_size);
+    uint64_t upper_prefix = range.upper.has_value() ? GetKeyPrefix(*range.upper) : 0;
+    int min_cmp = range.including_upper ? -1 : 0;
+    for (; cur_node != kNil && (!range.upper.has_value() || Compare(cur_node, *range.upper, upper_prefix) > min_cmp);
+         cur_node = Next(cur_node)[0].load(std::memory_order_acquire)) {
+        const Node& node = GetNode(cur_node);
+        size_t value_offset = FindVersion(node, snapshot);
+        if (value_offset == kNoValue) {
+            continue;
+        }
+        key_buffer.resize(GetKeySize(cur_node));
         kvbuffer_.Write(key_buffer.data(), node.key_offset, key_buffer.size() * sizeof(key_buffer[0]));
-        if (!node.value_size) {
+        uint32_t value_size = ReadValueHeader(value_offset).value_size;
+        if (!value_size) {
             accumulated.erase(key_buffer);
         } else {
-            Value value(node.value_size);
-            kvbuffer_.Write(value.data(), node.key_offset + node.key_size, value.size() * sizeof(value[0]));
+            Value value(value_size);
+            kvbuffer_.Write(value.data(), value_offset + kValueHeaderSize, value.size() * sizeof(value[0]));
             accumulated[std::move(key_buffer)] = std::move(value);
         }
     }
@@ -126,102 +236,294 @@ RangeLookupResult SkipList::FindRange(const KeyRange& range, RangeLookupResult a
 
 void SkipList::Clear() {
     kvbuffer_.Clear();
-    nodes_.clear();
-    nodes_.emplace_back();
+    node_arena_.Clear();
+    AllocateNode(level_count_limit_);
     kv_count_ = 0;
+    live_size_ = 0;
 }
 
 size_t SkipList::Size() const {
-    return kv_count_;
+    return kv_count_.load(std::memory_order_relaxed);
 }
 
 size_t SkipList::GetDataSizeInBytes() const {
     return kvbuffer_.GetTotalKVSizeInBytes();
 }
 
+size_t SkipList::GetGarbageSizeInBytes() const {
+    // Writers allocate before they count their records as live, so a racing reader may see more live bytes.
+    size_t live_size = live_size_.load(std::memory_order_relaxed);
+    size_t total_size = kvbuffer_.GetTotalKVSizeInBytes();
+    return total_size > live_size ? total_size - live_size : 0;
+}
+
+size_t SkipList::GetMemoryUsage() const {
+    return kvbuffer_.GetTotalKVSizeInBytes() + node_arena_.GetSize();
+}
+
 size_t SkipList::GetKVBufferSliceSize() const {
     return kvbuffer_.GetKVBufferSliceSize();
 }
 
-void SkipList::MakeIndexBlockInFd(int fd, bool skip_deleted) const {
-    index_block_buffer_.clear();
-    for (size_t cur_node = nodes_[0].next[0], i = 0, total_offset = 0; cur_node != kNil;
-         cur_node = nodes_[cur_node].next[0], ++i) {
-        const Node& node = nodes_[cur_node];
-        if (node.value_size || !skip_deleted) {
-            index_block_buffer_.emplace_back(total_offset);
-            total_offset += node.key_size + node.value_size + sizeof(KVSizes);
+void SkipList::MakeDataBlock(SSTable::SSTableWriter& writer, bool skip_deleted, BloomFilter* filter,
+                             std::span<const SequenceNumber> snapshots) const {
+    Key key_buffer;
+    std::optional<BloomFilterBatchInserter> filter_inserter;
+    if (filter) {
+        filter_inserter.emplace(*filter);
+    }
+    for (uint32_t cur_node = Next(0)[0].load(std::memory_order_acquire); cur_node != kNil;
+         cur_node = Next(cur_node)[0].load(std::memory_order_acquire)) {
+        const Node& node = GetNode(cur_node);
+        uint32_t key_size = GetKeySize(cur_node);
+        bool key_written = false;
+        SequenceNumber newer_sequence = kMaxSequenceNumber;
+        for (size_t value_offset = node.value_offset.load(std::memory_order_acquire); value_offset != kNoValue;) {
+            ValueHeader header = ReadValueHeader(value_offset);
+            VersionRetention retention =
+                RetainVersion(header.sequence, newer_sequence, header.value_size == 0, skip_deleted, snapshots);
+            if (retention.keep) {
+                writer.AddKVSizes({key_size, header.value_size}, header.sequence, key_written);
+                kvbuffer_.AppendTo(writer, node.key_offset, key_size);
+                kvbuffer_.AppendTo(writer, value_offset + kValueHeaderSize, header.value_size);
+                key_written = true;
+            }
+            if (retention.stop) {
+                break;
+            }
+            newer_sequence = header.sequence;
+            value_offset = header.older_value_offset;
+        }
+        if (key_written && filter_inserter) {
+            key_buffer.resize(key_size);
+            kvbuffer_.Write(key_buffer.data(), node.key_offset, key_size);
+            filter_inserter->Insert(key_buffer);
         }
     }
-    write(fd, index_block_buffer_.data(), index_block_buffer_.size() * sizeof(index_block_buffer_[0]));
+    if (filter_inserter) {
+        filter_inserter->Flush();
+    }
 }
 
-std::pair<size_t, size_t> SkipList::MakeDataBlockInFd(int fd, bool skip_deleted) const {
-    size_t true_kv_count = 0;
-    size_t true_data_size_in_bytes = 0;
-    for (auto cur_node = nodes_[0].next[0]; cur_node != kNil; cur_node = nodes_[cur_node].next[0]) {
-        const Node& node = nodes_[cur_node];
-        if (node.value_size || !skip_deleted) {
-            KVSizes sizes{node.key_size, node.value_size};
-            write(fd, &sizes, sizeof(sizes));
-            kvbuffer_.WriteToFd(fd, node.key_offset, node.key_size + node.value_size);
-            ++true_kv_count;
-            true_data_size_in_bytes += node.key_size + node.value_size;
-        }
+uint32_t SkipList::FindNode(const Key& key, bool including) const {
+    uint64_t key_prefix = GetKeyPrefix(key);
+    uint32_t cur_node = 0;
+    uint32_t next_node = kNil;
+    for (size_t cur_level = level_count_limit_ - 1; ~cur_level; --cur_level) {
+        FindSpliceForLevel(key, key_prefix, cur_node, cur_level, cur_node, next_node);
     }
-    return {true_kv_count, true_data_size_in_bytes};
+    if (!including && Compare(next_node, key, key_prefix) == 0) {
+        return Next(next_node)[0].load(std::memory_order_acquire);
+    }
+    return next_node;
 }
 
-uint32_t SkipList::FindNode(const Key& key, bool including) const {
-    if (!kv_count_) {
-        return 0;
+bool SkipList::StepSearch(Search& search) const {
+    using Stage = Search::Stage;
+    while (true) {
+        switch (search.stage) {
+            case Stage::kLink:
+                search.next_node = Next(search.cur_node)[search.level].load(std::memory_order_acquire);
+                search.stage = Stage::kNode;
+                if (search.next_node != kNil) {
+                    __builtin_prefetch(&GetNode(search.next_node));
+                    __builtin_prefetch(Next(search.next_node) + search.level);
+                    return false;
+                }
+                break;
+            case Stage::kNode:
+                if (search.next_node != kNil) {
+                    const Node& node = GetNode(search.next_node);
+                    if (node.key_prefix == search.key_prefix &&
+                        std::min<size_t>(search.key->size(), GetKeySize(search.next_node)) > kKeyPrefixSize) {
+                        kvbuffer_.Prefetch(node.key_offset + kKeyPrefixSize);
+                        search.stage = Stage::kKey;
+                        return false;
+                    }
+                }
+                [[fallthrough]];
+            case Stage::kKey: {
+                int cmp = Compare(search.next_node, *search.key, search.key_prefix);
+                search.stage = Stage::kLink;
+                if (cmp > 0) {
+                    search.cur_node = search.next_node;
+                } else if (search.level) {
+                    --search.level;
+                } else if (cmp < 0) {
+                    search.next_node = kNil;
+                    return true;
+                } else {
+                    kvbuffer_.Prefetch(GetNode(search.next_node).value_offset.load(std::memory_order_acquire));
+                    search.stage = Stage::kValue;
+                    return false;
+                }
+                break;
+            }
+            case Stage::kValue:
+                return true;
+        }
     }
-    auto cur_node = 0;
+}
+
+uint32_t SkipList::FindLastNode(const Key* key) const {
+    uint64_t key_prefix = key ? GetKeyPrefix(*key) : 0;
+    uint32_t cur_node = 0;
     for (size_t cur_level = level_count_limit_ - 1; ~cur_level; --cur_level) {
         while (true) {
-            size_t next_node = nodes_[cur_node].next[cur_level];
-            int cmp = Compare(next_node, key);
-            if (cmp == 0) {
-                return including ? next_node : nodes_[next_node].next[0];
-            } else if (cmp < 0) {
+            uint32_t next_node = Next(cur_node)[cur_level].load(std::memory_order_acquire);
+            if (next_node == kNil || (key && Compare(next_node, *key, key_prefix) <= 0)) {
                 break;
             }
             cur_node = next_node;
         }
     }
-    return nodes_[cur_node].next[0];
+    return cur_node == 0 ? kNil : cur_node;
 }
 
-int SkipList::Compare(uint32_t node_index, const Key& key) const {
-    int cmp =
-        node_index == kNil
-            ? -1
-            : kvbuffer_.Compare(key.data(), nodes_[node_index].key_offset,
-                                key.size() < nodes_[node_index].key_size ? key.size() : nodes_[node_index].key_size);
-    cmp = cmp != 0                                   ? cmp
-          : key.size() < nodes_[node_index].key_size ? -1
-          : key.size() > nodes_[node_index].key_size ? 1
-                                                     : 0;
+void SkipList::FindSpliceForLevel(const Key& key, uint64_t key_prefix, uint32_t start, size_t level, uint32_t& prev,
+                                  uint32_t& next) const {
+    uint32_t cur_node = start;
+    while (true) {
+        uint32_t next_node = Next(cur_node)[level].load(std::memory_order_acquire);
+        if (Compare(next_node, key, key_prefix) <= 0) {
+            prev = cur_node;
+            next = next_node;
+            return;
+        }
+        cur_node = next_node;
+    }
+}
+
+int SkipList::Compare(uint32_t node_index, const Key& key, uint64_t key_prefix) const {
+    if (node_index == kNil) {
+        return -1;
+    }
+    const Node& node = GetNode(node_index);
+    if (key_prefix != node.key_prefix) {
+        return key_prefix < node.key_prefix ? -1 : 1;
+    }
+    // Equal prefixes mean equal first min(size, kKeyPrefixSize) bytes, only the rest of the keys is left to compare.
+    uint32_t key_size = GetKeySize(node_index);
+    size_t common_size = std::min<size_t>(key.size(), key_size);
+    int cmp = common_size <= kKeyPrefixSize ? 0
+                                            : kvbuffer_.Compare(key.data() + kKeyPrefixSize,
+                                                                node.key_offset + kKeyPrefixSize,
+                                                                common_size - kKeyPrefixSize);
+    cmp = cmp != 0                ? cmp
+          : key.size() < key_size ? -1
+          : key.size() > key_size ? 1
+                                  : 0;
     return cmp;
 }
 
-uint8_t SkipList::RandomLevel() {
-    uint8_t level = 0;
-    while (level < level_count_limit_ && rng_gen_() % 2) {
-        ++level;
+uint64_t SkipList::GetKeyPrefix(const Key& key) {
+    uint64_t prefix = 0;
+    std::memcpy(&prefix, key.data(), std::min(key.size(), kKeyPrefixSize));
+    if constexpr (std::endian::native == std::endian::little) {
+        prefix = __builtin_bswap64(prefix);
+    }
+    return prefix;
+}
+
+uint32_t SkipList::AllocateNode(uint32_t height) {
+    size_t size = (kLinksOffset + height + kNodeAlignment - 1) / kNodeAlignment * kNodeAlignment;
+    size_t offset = node_arena_.AllocateContiguous(size * sizeof(uint32_t)) / sizeof(uint32_t);
+    if (offset + size > kNil) {
+        throw std::runtime_error("Skiplist has run out of node indexes.");
+    }
+    uint32_t node_index = offset;
+    new (&GetNode(node_index)) Node{.key_offset = 0, .key_prefix = 0, .value_offset = 0};
+    new (&GetKeySize(node_index)) uint32_t(0);
+    for (size_t level = 0; level < height; ++level) {
+        new (Next(node_index) + level) Link(kNil);
+    }
+    return node_index;
+}
+
+SkipList::Node& SkipList::GetNode(uint32_t node_index) {
+    size_t offset = size_t{node_index} * sizeof(uint32_t);
+    return *reinterpret_cast<Node*>(node_arena_.GetBlock(offset / kNodeArenaBlockSize) + offset % kNodeArenaBlockSize);
+}
+
+const SkipList::Node& SkipList::GetNode(uint32_t node_index) const {
+    size_t offset = size_t{node_index} * sizeof(uint32_t);
+    return *reinterpret_cast<const Node*>(node_arena_.GetBlock(offset / kNodeArenaBlockSize) +
+                                          offset % kNodeArenaBlockSize);
+}
+
+uint32_t& SkipList::GetKeySize(uint32_t node_index) {
+    return reinterpret_cast<uint32_t*>(&GetNode(node_index))[kKeySizeOffset];
+}
+
+uint32_t SkipList::GetKeySize(uint32_t node_index) const {
+    return reinterpret_cast<const uint32_t*>(&GetNode(node_index))[kKeySizeOffset];
+}
+
+SkipList::Link* SkipList::Next(uint32_t node_index) {
+    return reinterpret_cast<Link*>(reinterpret_cast<uint32_t*>(&GetNode(node_index)) + kLinksOffset);
+}
+
+const SkipList::Link* SkipList::Next(uint32_t node_index) const {
+    return reinterpret_cast<const Link*>(reinterpret_cast<const uint32_t*>(&GetNode(node_index)) + kLinksOffset);
+}
+
+uint32_t SkipList::RandomHeight() {
+    // splitmix64, so concurrent writers share one generator without a lock.
+    uint64_t x = rng_state_.fetch_add(0x9e3779b97f4a7c15ULL, std::memory_order_relaxed) + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    // Every bit is a coin flip, a node gets one more level per trailing one.
+    return std::min<size_t>(level_count_limit_, std::countr_one(x) + 1);
+}
+
+size_t SkipList::WriteValue(size_t offset, const Value& value, SequenceNumber sequence) {
+    ValueHeader header{.sequence = sequence,
+                       .older_value_offset = kNoValue,
+                       .value_size = static_cast<uint32_t>(value.size())};
+    kvbuffer_.Fill(offset, reinterpret_cast<const uint8_t*>(&header), kValueHeaderSize);
+    kvbuffer_.Fill(offset + kValueHeaderSize, value.data(), header.value_size);
+    return offset;
+}
+
+LookupResult SkipList::ReadVersion(uint32_t node_index, SequenceNumber snapshot) const {
+    size_t value_offset = FindVersion(GetNode(node_index), snapshot);
+    if (value_offset == kNoValue) {
+        return std::nullopt;
+    }
+    LookupResult value = std::make_optional<Value>(ReadValueHeader(value_offset).value_size);
+    kvbuffer_.Write(value->data(), value_offset + kValueHeaderSize, value->size());
+    return value;
+}
+
+SkipList::ValueHeader SkipList::ReadValueHeader(size_t value_offset) const {
+    ValueHeader header;
+    kvbuffer_.Write(reinterpret_cast<uint8_t*>(&header), value_offset, kValueHeaderSize);
+    return header;
+}
+
+size_t SkipList::FindVersion(const Node& node, SequenceNumber snapshot) const {
+    size_t value_offset = node.value_offset.load(std::memory_order_acquire);
+    while (value_offset != kNoValue) {
+        ValueHeader header = ReadValueHeader(value_offset);
+        if (header.sequence <= snapshot) {
+            break;
+        }
+        value_offset = header.older_value_offset;
     }
-#ifndef NDEBUG
-    ++statistics[level];
-#endif
-    return level + 1;
+    return value_offset;
 }
 
-void SkipList::WriteToNode(Node& node, const Key& key, const Value& value) {
-    node.key_offset = kvbuffer_.GetTotalKVSizeInBytes();
-    node.key_size = key.size();
-    node.value_size = value.size();
-    kvbuffer_.Append(key.data(), key.size());
-    kvbuffer_.Append(value.data(), value.size());
+void SkipList::PushValue(Node& node, size_t value_offset, uint32_t value_size) {
+    size_t older_value_offset = node.value_offset.load(std::memory_order_acquire);
+    do {
+        // The record is not published yet, so its link to the older version may still be rewritten.
+        kvbuffer_.Fill(value_offset + offsetof(ValueHeader, older_value_offset),
+                       reinterpret_cast<const uint8_t*>(&older_value_offset), sizeof(older_value_offset));
+    } while (!node.value_offset.compare_exchange_weak(older_value_offset, value_offset, std::memory_order_acq_rel,
+                                                      std::memory_order_acquire));
+    live_size_.fetch_add(value_size, std::memory_order_relaxed);
+    live_size_.fetch_sub(ReadValueHeader(older_value_offset).value_size, std::memory_order_relaxed);
 }
 
 }  // namespace MyLSMTree::Memtable
@@ -1,62 +1,187 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdint>
 #include <random>
+#include <span>
+#include <type_traits>
 #include <vector>
 
+#include "arena.h"
 #include "kvbuffer.h"
+#include "../bloom_filter/bloom_filter.h"
 #include "../../common.h"
 
 namespace MyLSMTree::Memtable {
 
+// Lock-free skip list. Insert and Erase link new nodes with compare-and-swap and may run concurrently with each other
+// and with the lookups, which take no locks. Every write carries a sequence number and the writes of one key must
+// come in the order of their sequence numbers, the writes of distinct keys in any order. A lookup at a sequence number
+// sees the newest version of every key up to it. Clear and MakeDataBlock need exclusive access.
 class SkipList {
     static constexpr size_t kMaxLevel = 32;
     static constexpr uint32_t kNil = -1;
 
+    // Nodes are stored in node_arena_: a Node, the key size word and the forward links, one per level of the node. A
+    // node is referred to by its offset in the arena in words, the head node is at 0. Only the value of a linked node
+    // changes: a new version is written to the kv buffer and swapped in, so readers never see a half-written value.
     struct Node {
-        uint32_t next[kMaxLevel];
         size_t key_offset;
-        uint32_t key_size;
+        // First kKeyPrefixSize bytes of the key as a big-endian number, padded with zeros, so most comparisons
+        // are decided without touching the kv buffer.
+        uint64_t key_prefix;
+        // Offset of the value record of the newest version in the kv buffer.
+        std::atomic<size_t> value_offset;
+    };
+    using Link = std::atomic<uint32_t>;
+
+    // Starts every value record in the kv buffer and is followed by the value. Empty values are tombstones. The records
+    // of a key are chained from the newest to the oldest.
+    struct ValueHeader {
+        SequenceNumber sequence;
+        size_t older_value_offset;
         uint32_t value_size;
-        uint8_t height = 0;
+    };
+
+    static constexpr size_t kKeyPrefixSize = sizeof(uint64_t);
+    static constexpr size_t kValueHeaderSize = offsetof(ValueHeader, value_size) + sizeof(uint32_t);
+    static constexpr size_t kNoValue = -1;
+    // The key size and the links follow the whole Node, so none of them lives in its storage.
+    static constexpr size_t kKeySizeOffset = sizeof(Node) / sizeof(uint32_t);
+    static constexpr size_t kLinksOffset = kKeySizeOffset + 1;
+    static_assert(std::is_trivially_destructible_v<Node> && sizeof(Node) % sizeof(uint32_t) == 0);
+    static_assert(sizeof(Link) == sizeof(uint32_t) && alignof(Link) == alignof(uint32_t));
+    // Keeps every node aligned for its key_offset.
+    static constexpr size_t kNodeAlignment = alignof(Node) / sizeof(uint32_t);
+    static constexpr size_t kNodeArenaBlockSize = 1 << 20;
+    // Searches of MultiFind in flight, each waits for at most a couple of cache lines.
+    static constexpr size_t kMultiFindGroupSize = 8;
+
+    // One search of MultiFind. A stage either reads memory that was prefetched in the previous one, or ends the turn of
+    // the search by prefetching the memory the next stage reads.
+    struct Search {
+        enum class Stage : uint8_t {
+            // Reads the link of cur_node on the level.
+            kLink,
+            // Compares the key with next_node by the prefix, or waits for the rest of the key of next_node.
+            kNode,
+            kKey,
+            // The key is found, its value record is on the way.
+            kValue,
+        };
+
+        const Key* key;
+        uint64_t key_prefix;
+        uint32_t cur_node;
+        uint32_t next_node;
+        size_t level;
+        Stage stage;
+    };
+
+public:
+    // Walks the keys in either direction, positioned at the newest version of each up to the snapshot. Keys that have
+    // no such version are skipped, tombstones are not. It copies the current key and value out of the kv buffer, so it
+    // may run alongside the writers. Nodes have no backward links, so Prev searches for the predecessor from the head.
+    class Iterator {
+    public:
+        Iterator(const SkipList& list, SequenceNumber snapshot);
 
-        Node() {
-            std::fill_n(next, kMaxLevel, kNil);
-        }
+        bool IsValid() const;
+        // Moves to the first key not less than key.
+        void Seek(const Key& key);
+        // Moves to the last key not greater than key.
+        void SeekForPrev(const Key& key);
+        void SeekToFirst();
+        void SeekToLast();
+        void Next();
+        void Prev();
+        KeyView GetKey() const;
+        ValueView GetValue() const;
+
+    private:
+        // Reads the key of node_ and its version that the snapshot sees, returns false if there is none.
+        bool Read();
+        // Moves on from node_ to the first node with a version that the snapshot sees and reads it.
+        void Settle();
+        // Same as Settle, but moves back.
+        void SettleBackward();
+
+    private:
+        const SkipList* list_;
+        SequenceNumber snapshot_;
+        uint32_t node_ = kNil;
+        Key key_;
+        Value value_;
     };
 
 public:
     SkipList(size_t kv_count_limit, uint32_t kv_buffer_slice_size, std::mt19937::result_type rng_seed = 6);
 
-    void Insert(const Key& key, const Value& value);
-    void Erase(const Key& key);
-    LookupResult Find(const Key& key) const;
-    RangeLookupResult FindRange(const KeyRange& range, RangeLookupResult accumulated = {}) const;
+    void Insert(const Key& key, const Value& value, SequenceNumber sequence);
+    void Erase(const Key& key, SequenceNumber sequence);
+    LookupResult Find(const Key& key, SequenceNumber snapshot = kMaxSequenceNumber) const;
+    // Looks up the keys with the searches interleaved: a search that is about to miss the cache prefetches what it
+    // needs and lets the next one run, so the misses of several searches overlap.
+    std::vector<LookupResult> MultiFind(std::span<const Key* const> keys,
+                                        SequenceNumber snapshot = kMaxSequenceNumber) const;
+    RangeLookupResult FindRange(const KeyRange& range, SequenceNumber snapshot = kMaxSequenceNumber,
+                                RangeLookupResult accumulated = {}) const;
     void Clear();
     size_t Size() const;
     size_t GetDataSizeInBytes() const;
+    // Bytes of the kv buffer taken by overwritten values, whether or not some snapshot still sees them.
+    size_t GetGarbageSizeInBytes() const;
+    // The kv buffer together with the nodes.
+    size_t GetMemoryUsage() const;
     size_t GetKVBufferSliceSize() const;
-    void MakeIndexBlockInFd(int fd, bool skip_deleted) const;
-    std::pair<size_t, size_t> MakeDataBlockInFd(int fd, bool skip_deleted) const;
+    // Writes the newest version of every key and the older ones that the sorted snapshots see. Inserts the keys of the
+    // written records into the filter, unless it is nullptr.
+    void MakeDataBlock(SSTable::SSTableWriter& writer, bool skip_deleted, BloomFilter* filter,
+                       std::span<const SequenceNumber> snapshots) const;
 
 private:
     uint32_t FindNode(const Key& key, bool including) const;
-    int Compare(uint32_t node_index, const Key& key) const;
+    // Runs the search until it has to wait for memory and returns false, or until it is over and returns true.
+    // next_node is then the node of the key, or kNil if there is none.
+    bool StepSearch(Search& search) const;
+    // Last node less than the key, or the last node if key is nullptr. kNil if there is none.
+    uint32_t FindLastNode(const Key* key) const;
+    // Moves right from the node start on the level, until the next node is not less than the key.
+    void FindSpliceForLevel(const Key& key, uint64_t key_prefix, uint32_t start, size_t level, uint32_t& prev,
+                            uint32_t& next) const;
+    // key_prefix must be the prefix of key.
+    int Compare(uint32_t node_index, const Key& key, uint64_t key_prefix) const;
+    static uint64_t GetKeyPrefix(const Key& key);
+
+    uint32_t AllocateNode(uint32_t height);
+    Node& GetNode(uint32_t node_index);
+    const Node& GetNode(uint32_t node_index) const;
+    uint32_t& GetKeySize(uint32_t node_index);
+    uint32_t GetKeySize(uint32_t node_index) const;
+    Link* Next(uint32_t node_index);
+    const Link* Next(uint32_t node_index) const;
 
-    uint8_t RandomLevel();
-    void WriteToNode(Node& node, const Key& key, const Value& value);
+    uint32_t RandomHeight();
+    size_t WriteValue(size_t offset, const Value& value, SequenceNumber sequence);
+    ValueHeader ReadValueHeader(size_t value_offset) const;
+    // Offset of the newest version of the node up to the snapshot, or kNoValue.
+    size_t FindVersion(const Node& node, SequenceNumber snapshot) const;
+    // Value of the newest version of the node up to the snapshot.
+    LookupResult ReadVersion(uint32_t node_index, SequenceNumber snapshot) const;
+    // Makes the written value record the newest version of the node.
+    void PushValue(Node& node, size_t value_offset, uint32_t value_size);
 
 private:
-    std::vector<Node> nodes_;
-    mutable std::vector<Offset> index_block_buffer_;
-    std::mt19937 rng_gen_;
+    Arena node_arena_;
     KVBuffer kvbuffer_;
+    // State of the splitmix64 generator of node heights.
+    std::atomic<uint64_t> rng_state_;
     size_t level_count_limit_;
-    size_t kv_count_ = 0;
-#ifndef NDEBUG
-    uint32_t statistics[kMaxLevel];
-#endif
+    std::atomic<size_t> kv_count_ = 0;
+    // Total size of the keys and current value records.
+    std::atomic<size_t> live_size_ = 0;
 };
 
 }  // namespace MyLSMTree::Memtable
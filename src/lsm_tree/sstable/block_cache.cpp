@@ -0,0 +1,103 @@
+#include "block_cache.h"
+
+#include <functional>
+
+namespace MyLSMTree::SSTable {
+
+namespace {
+
+// Memory taken by an entry besides the block data.
+constexpr size_t kEntryOverhead = sizeof(BlockCache::Block) + 64;
+
+}  // namespace
+
+size_t BlockCache::BlockKeyHash::operator()(const BlockKey& key) const {
+    return std::hash<uint64_t>()(key.table_id * 0x9e3779b97f4a7c15ULL ^ key.offset);
+}
+
+BlockCache::BlockCache(size_t capacity) : capacity_(capacity), shard_capacity_(capacity / kShardCount) {
+}
+
+BlockCache::BlockPtr BlockCache::Lookup(uint64_t table_id, Offset offset) {
+    BlockKey key{table_id, offset};
+    Shard& shard = GetShard(key);
+    {
+        const std::lock_guard guard(shard.mtx);
+        if (auto it = shard.slots.find(key); it != shard.slots.end()) {
+            Entry& entry = shard.entries[it->second];
+            entry.referenced = true;
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            return entry.block;
+        }
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+BlockCache::BlockPtr BlockCache::Insert(uint64_t table_id, Offset offset, BlockPtr block) {
+    BlockKey key{table_id, offset};
+    Shard& shard = GetShard(key);
+    size_t charge = GetCharge(*block);
+    const std::lock_guard guard(shard.mtx);
+    if (auto it = shard.slots.find(key); it != shard.slots.end()) {
+        return shard.entries[it->second].block;
+    }
+    if (charge > shard_capacity_) {
+        return block;
+    }
+    while (shard.usage + charge > shard_capacity_) {
+        EvictOne(shard);
+    }
+    shard.slots.emplace(key, shard.entries.size());
+    shard.entries.push_back({key, block, false});
+    shard.usage += charge;
+    return block;
+}
+
+BlockCacheStatistics BlockCache::GetStatistics() const {
+    size_t usage = 0;
+    for (const auto& shard : shards_) {
+        const std::lock_guard guard(shard.mtx);
+        usage += shard.usage;
+    }
+    return {.hits = hits_.load(std::memory_order_relaxed),
+            .misses = misses_.load(std::memory_order_relaxed),
+            .usage = usage,
+            .capacity = capacity_};
+}
+
+BlockCache::Shard& BlockCache::GetShard(const BlockKey& key) {
+    return shards_[BlockKeyHash()(key) % kShardCount];
+}
+
+void BlockCache::EvictOne(Shard& shard) {
+    while (true) {
+        if (shard.hand >= shard.entries.size()) {
+            shard.hand = 0;
+        }
+        Entry& entry = shard.entries[shard.hand];
+        if (entry.referenced) {
+            entry.referenced = false;
+            ++shard.hand;
+            continue;
+        }
+        // The last entry takes the place of the evicted one, so the ring stays dense. It is the newest one, and the
+        // hand moves past it, so like a new entry it gets a whole turn before it is looked at. The hand always moves,
+        // or it would stay at the end of the ring and evict every new entry right away.
+        shard.usage -= GetCharge(*entry.block);
+        shard.slots.erase(entry.key);
+        if (shard.hand + 1 != shard.entries.size()) {
+            entry = std::move(shard.entries.back());
+            shard.slots[entry.key] = shard.hand;
+        }
+        shard.entries.pop_back();
+        ++shard.hand;
+        return;
+    }
+}
+
+size_t BlockCache::GetCharge(const Block& block) {
+    return block.size() + kEntryOverhead;
+}
+
+}  // namespace MyLSMTree::SSTable
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+#include "../common.h"
+
+namespace MyLSMTree::SSTable {
+
+struct BlockCacheStatistics {
+    uint64_t hits;
+    uint64_t misses;
+    size_t usage;
+    size_t capacity;
+};
+
+// Data blocks of the sstables, keyed by the id the table cache gave to the sstable and the offset of the block.
+// The capacity is split evenly between shards, each with its own lock and CLOCK eviction. A block starts unreferenced
+// and is only marked as referenced by a hit, so blocks read once are evicted before the ones that are read again.
+class BlockCache {
+public:
+    using Block = std::vector<uint8_t>;
+    using BlockPtr = std::shared_ptr<const Block>;
+
+    static constexpr size_t kShardCount = 16;
+
+    explicit BlockCache(size_t capacity);
+    BlockCache(const BlockCache&) = delete;
+
+    BlockPtr Lookup(uint64_t table_id, Offset offset);
+    // Returns the cached block, which is not the given one if the same block was inserted by someone else first.
+    BlockPtr Insert(uint64_t table_id, Offset offset, BlockPtr block);
+    BlockCacheStatistics GetStatistics() const;
+
+private:
+    struct BlockKey {
+        uint64_t table_id;
+        Offset offset;
+
+        bool operator==(const BlockKey&) const = default;
+    };
+
+    struct BlockKeyHash {
+        size_t operator()(const BlockKey& key) const;
+    };
+
+    struct Entry {
+        BlockKey key;
+        BlockPtr block;
+        bool referenced;
+    };
+
+    struct Shard {
+        mutable std::mutex mtx;
+        std::unordered_map<BlockKey, size_t, BlockKeyHash> slots;
+        // Clock ring, the hand points to the next eviction candidate.
+        std::vector<Entry> entries;
+        size_t hand = 0;
+        size_t usage = 0;
+    };
+
+    Shard& GetShard(const BlockKey& key);
+    void EvictOne(Shard& shard);
+    static size_t GetCharge(const Block& block);
+
+private:
+    std::array<Shard, kShardCount> shards_;
+    size_t capacity_;
+    size_t shard_capacity_;
+    std::atomic<uint64_t> hits_ = 0;
+    std::atomic<uint64_t> misses_ = 0;
+};
+
+}  // namespace MyLSMTree::SSTable
@@ -1,256 +1,906 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <stdexcept>
+#include <tuple>
 #include <utility>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "sstable_reader.h"
 
+#include "../memtable/bloom_filter/bloom_filter.h"
+
 namespace MyLSMTree::SSTable {
 
 using SSTableReader = SSTableReadersManager::SSTableReader;
 
+namespace {
+
+// Range scans usually stop after a few records, so they start with a small read and grow it while they keep going.
+constexpr size_t kRangeScanInitialReadaheadSize = 1 << 12;
+// Most keys are short, so the index is built with one read per key.
+constexpr size_t kKeyReadSize = 128;
+
+[[noreturn]] void ThrowCantReadSSTable(const Path& path) {
+    throw std::runtime_error(std::string("Can't read sstable with name ") + path.c_str() + ": " +
+                             std::strerror(errno));
+}
+
+void ReadExactly(int fd, void* data, size_t size, Offset offset, const Path& path) {
+    auto* ptr = static_cast<uint8_t*>(data);
+    while (size) {
+        ssize_t r = pread(fd, ptr, size, offset);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r == 0) {
+                errno = EIO;
+            }
+            ThrowCantReadSSTable(path);
+        }
+        ptr += r;
+        size -= r;
+        offset += r;
+    }
+}
+
+Key ReadKey(int fd, Offset offset, Offset data_end, const Path& path) {
+    uint8_t buffer[kKeyReadSize];
+    size_t size = std::min(kKeyReadSize, data_end - offset);
+    ReadExactly(fd, buffer, size, offset, path);
+    KVSizes sizes;
+    std::memcpy(&sizes, buffer, sizeof(sizes));
+    if (sizeof(sizes) + sizes.key_size <= size) {
+        return Key(buffer + sizeof(sizes), buffer + sizeof(sizes) + sizes.key_size);
+    }
+    Key key(sizes.key_size);
+    ReadExactly(fd, key.data(), key.size(), offset + sizeof(sizes), path);
+    return key;
+}
+
+RecordHeader ReadRecordHeader(const uint8_t* data, size_t header_size) {
+    RecordHeader header{.sizes = {0, 0}, .sequence = 0};
+    std::memcpy(&header, data, header_size);
+    return header;
+}
+
+}  // namespace
+
 bool SSTableReader::KVIterator::IsEnd() const {
-    return kv_.value_token.value_offset_ + kv_.value_token.value_size_ == parent_->meta_.filter_offset;
+    return is_end_;
 }
 
 void SSTableReader::KVIterator::operator++() {
-    kv_ = parent_->GetNextKey(std::move(kv_));
+    Load(GetRecordOffset() + header_size_ + header_.sizes.key_size + header_.sizes.value_size);
 }
 
-const Key& SSTableReader::KVIterator::GetKey() const {
-    return kv_.key;
+KeyView SSTableReader::KVIterator::GetKey() const {
+    return {data_ + record_pos_ + header_size_, header_.sizes.key_size};
 }
 
-Value SSTableReader::KVIterator::GetValue(Value buffer) const {
-    return parent_->GetValueFromToken(kv_.value_token, std::move(buffer));
+ValueView SSTableReader::KVIterator::GetValue() const {
+    return {data_ + record_pos_ + header_size_ + header_.sizes.key_size, header_.sizes.value_size};
 }
 
 size_t SSTableReader::KVIterator::GetValueSize() const {
-    return kv_.value_token.value_size_;
+    return header_.sizes.value_size;
+}
+
+SequenceNumber SSTableReader::KVIterator::GetSequenceNumber() const {
+    return header_.sequence;
+}
+
+SSTableReader::KVIterator::KVIterator(const SSTableReader& parent, Offset offset, size_t readahead_size,
+                                      size_t max_readahead_size)
+    : header_size_(GetRecordHeaderSize(parent.table_->meta.format_version)),
+      readahead_size_(std::min(readahead_size, max_readahead_size)),
+      max_readahead_size_(max_readahead_size),
+      parent_(&parent),
+      end_(parent.table_->meta.filter_offset) {
+    Load(offset);
 }
 
-SSTableReader::KVIterator::KVIterator(KeyWithValueToken kv, const SSTableReader& parent)
-    : kv_(std::move(kv)), parent_(&parent) {
+SSTableReader::KVIterator::KVIterator(const SSTableReader& parent, std::span<const uint8_t> data, Offset offset)
+    : data_(data.data()),
+      buffer_offset_(offset),
+      buffer_size_(data.size()),
+      header_size_(GetRecordHeaderSize(parent.table_->meta.format_version)),
+      readahead_size_(0),
+      max_readahead_size_(0),
+      parent_(&parent),
+      end_(offset + data.size()) {
+    Load(offset);
 }
 
-SSTableReader::SSTableReader(SSTableReadersManager& manager, const Path& path, int fd)
-    : manager_(&manager), path_(path), fd_(fd) {
-    struct stat st;
-    if (fstat(fd, &st) != 0) {
-        perror("fstat failed");
+void SSTableReader::KVIterator::Load(Offset offset) {
+    if (offset >= end_) {
+        is_end_ = true;
         return;
     }
-    pread(fd_, &meta_, sizeof(meta_), st.st_size - sizeof(meta_));
+    Fill(offset, header_size_);
+    header_ = ReadRecordHeader(data_ + record_pos_, header_size_);
+    Fill(offset, header_size_ + header_.sizes.key_size + header_.sizes.value_size);
+}
+
+void SSTableReader::KVIterator::Fill(Offset offset, size_t size) {
+    if (offset >= buffer_offset_ && offset + size <= buffer_offset_ + buffer_size_) {
+        record_pos_ = offset - buffer_offset_;
+        return;
+    }
+    if (const uint8_t* mapping = parent_->table_->mapping; mapping) {
+        data_ = mapping;
+        buffer_offset_ = 0;
+        buffer_size_ = parent_->table_->meta.filter_offset;
+        record_pos_ = offset;
+        return;
+    }
+    // The unread tail of the buffer is kept and the rest of the chunk is read after it.
+    size_t kept = 0;
+    if (offset >= buffer_offset_ && offset < buffer_offset_ + buffer_size_) {
+        kept = buffer_offset_ + buffer_size_ - offset;
+        std::memmove(buffer_.data(), buffer_.data() + (offset - buffer_offset_), kept);
+    }
+    size_t chunk_size = std::max(size, readahead_size_);
+    readahead_size_ = std::min(readahead_size_ * 2, max_readahead_size_);
+    chunk_size = std::min(chunk_size, parent_->table_->meta.filter_offset - offset);
+    if (buffer_.size() < chunk_size) {
+        buffer_.resize(chunk_size);
+    }
+    parent_->Read(buffer_.data() + kept, chunk_size - kept, offset + kept);
+    data_ = buffer_.data();
+    buffer_offset_ = offset;
+    buffer_size_ = chunk_size;
+    record_pos_ = 0;
+}
+
+Offset SSTableReader::KVIterator::GetRecordOffset() const {
+    return buffer_offset_ + record_pos_;
+}
+
+bool SSTableReader::PrefetchingKVIterator::IsEnd() const {
+    return past_upper_ || ((!it_ || it_->IsEnd()) && chunks_.empty());
+}
+
+bool SSTableReader::PrefetchingKVIterator::NeedsLoad() const {
+    return !past_upper_ && (!it_ || it_->IsEnd()) && !chunks_.empty();
+}
+
+IO::Task<void> SSTableReader::PrefetchingKVIterator::Load() {
+    // A chunk may hold only records below the range, then the iterator moves on to the next one.
+    do {
+        Chunk& chunk = chunks_.front();
+        co_await chunk.read;
+        spare_ = std::exchange(current_, std::move(chunk.buffer));
+        Offset offset = chunk.offset;
+        chunks_.pop_front();
+        it_ = KVIterator(*parent_, std::span<const uint8_t>(current_), offset);
+        Settle();
+        ReadAhead();
+    } while (NeedsLoad());
+}
+
+IO::Task<void> SSTableReader::PrefetchingKVIterator::Drain() {
+    for (auto& chunk : chunks_) {
+        try {
+            co_await chunk.read;
+        } catch (...) {
+        }
+    }
+    chunks_.clear();
+}
+
+void SSTableReader::PrefetchingKVIterator::operator++() {
+    ++*it_;
+    Settle();
+}
+
+KeyView SSTableReader::PrefetchingKVIterator::GetKey() const {
+    return it_->GetKey();
+}
+
+ValueView SSTableReader::PrefetchingKVIterator::GetValue() const {
+    return it_->GetValue();
+}
+
+size_t SSTableReader::PrefetchingKVIterator::GetValueSize() const {
+    return it_->GetValueSize();
+}
+
+SequenceNumber SSTableReader::PrefetchingKVIterator::GetSequenceNumber() const {
+    return it_->GetSequenceNumber();
+}
+
+SSTableReader::PrefetchingKVIterator::PrefetchingKVIterator(const SSTableReader& parent, IO::EventLoop& loop,
+                                                            size_t depth, const KeyRange& range)
+    : parent_(&parent),
+      loop_(&loop),
+      depth_(std::max<size_t>(depth, 1)),
+      range_(range),
+      check_lower_(range.lower.has_value()) {
+    const Table& table = *parent.table_;
+    auto [begin, end] = parent.GetRangeBounds(range);
+    // The bounds are offsets of segments.
+    next_segment_ = std::lower_bound(table.index_offsets.begin(), table.index_offsets.end(), begin) -
+                    table.index_offsets.begin();
+    end_segment_ = std::lower_bound(table.index_offsets.begin(), table.index_offsets.end(), end) -
+                   table.index_offsets.begin();
+    if (table.mapping) {
+        it_ = KVIterator(parent, std::span<const uint8_t>(table.mapping + begin, end - begin), begin);
+        Settle();
+        return;
+    }
+    ReadAhead();
+}
+
+void SSTableReader::PrefetchingKVIterator::ReadAhead() {
+    const auto& offsets = parent_->table_->index_offsets;
+    size_t chunk_size = parent_->manager_->ScanReadaheadSize();
+    while (chunks_.size() < depth_ && next_segment_ < end_segment_) {
+        Offset begin = offsets[next_segment_];
+        size_t end_segment = next_segment_ + 1;
+        while (end_segment < end_segment_ && offsets[end_segment] - begin < chunk_size) {
+            ++end_segment;
+        }
+        next_segment_ = end_segment;
+        std::vector<uint8_t> buffer = std::move(spare_);
+        buffer.resize(offsets[end_segment] - begin);
+        auto read = IO::Spawn(parent_->ReadAsync(*loop_, buffer.data(), buffer.size(), begin));
+        chunks_.push_back({.offset = begin, .buffer = std::move(buffer), .read = std::move(read)});
+    }
+    loop_->SubmitPending();
+}
+
+void SSTableReader::PrefetchingKVIterator::Settle() {
+    for (; !it_->IsEnd(); ++*it_) {
+        KeyView key = it_->GetKey();
+        if (check_lower_ && (range_.including_lower ? CompareKeys(key, *range_.lower) < 0
+                                                    : CompareKeys(key, *range_.lower) <= 0)) {
+            continue;
+        }
+        check_lower_ = false;
+        past_upper_ = range_.upper.has_value() && (range_.including_upper ? CompareKeys(key, *range_.upper) > 0
+                                                                          : CompareKeys(key, *range_.upper) >= 0);
+        return;
+    }
+}
+
+bool SSTableReader::Iterator::IsValid() const {
+    return backward_ ? record_index_ < visible_records_.size() : it_.has_value() && !it_->IsEnd();
+}
+
+void SSTableReader::Iterator::Seek(const Key& key) {
+    auto segment = parent_->FindSegment(key);
+    Seek(segment ? parent_->table_->index_offsets[*segment] : 0, &key);
+}
+
+void SSTableReader::Iterator::SeekForPrev(const Key& key) {
+    if (auto segment = parent_->FindSegment(key); segment) {
+        SeekBackward(*segment, &key, true);
+    } else {
+        backward_ = true;
+        visible_records_.clear();
+    }
+}
+
+void SSTableReader::Iterator::SeekToFirst() {
+    Seek(0, nullptr);
+}
+
+void SSTableReader::Iterator::SeekToLast() {
+    SeekBackward(parent_->table_->index_keys.size() - 1, nullptr, true);
+}
+
+void SSTableReader::Iterator::Next() {
+    if (backward_) {
+        if (record_index_ + 1 < visible_records_.size()) {
+            ++record_index_;
+            CopyBlockRecordKey();
+            return;
+        }
+        // Versions of a key never span segments, so the next key starts the next segment.
+        const auto& offsets = parent_->table_->index_offsets;
+        Seek(offsets[std::min(segment_ + 1, offsets.size() - 1)], nullptr);
+        return;
+    }
+    do {
+        ++*it_;
+    } while (!it_->IsEnd() && CompareKeys(it_->GetKey(), key_) == 0);
+    Settle();
+}
+
+void SSTableReader::Iterator::Prev() {
+    if (!backward_) {
+        Key key = std::move(key_);
+        SeekBackward(*parent_->FindSegment(key), &key, false);
+        return;
+    }
+    if (record_index_ > 0) {
+        --record_index_;
+        CopyBlockRecordKey();
+        return;
+    }
+    if (segment_ == 0) {
+        visible_records_.clear();
+        return;
+    }
+    SeekBackward(segment_ - 1, nullptr, true);
+}
+
+KeyView SSTableReader::Iterator::GetKey() const {
+    return key_;
+}
+
+ValueView SSTableReader::Iterator::GetValue() const {
+    if (backward_) {
+        RecordHeader header = GetBlockRecordHeader(record_index_);
+        return block_.subspan(visible_records_[record_index_] + header_size_ + header.sizes.key_size,
+                              header.sizes.value_size);
+    }
+    return it_->GetValue();
+}
+
+SSTableReader::Iterator::Iterator(const SSTableReader& parent, SequenceNumber snapshot)
+    : parent_(&parent), snapshot_(snapshot), header_size_(GetRecordHeaderSize(parent.table_->meta.format_version)) {
+}
+
+void SSTableReader::Iterator::Seek(Offset offset, const Key* key) {
+    backward_ = false;
+    it_ = KVIterator(*parent_, offset, kRangeScanInitialReadaheadSize, parent_->manager_->ScanReadaheadSize());
+    while (key && !it_->IsEnd() && CompareKeys(it_->GetKey(), *key) < 0) {
+        ++*it_;
+    }
+    Settle();
+}
+
+void SSTableReader::Iterator::Settle() {
+    while (!it_->IsEnd() && it_->GetSequenceNumber() > snapshot_) {
+        ++*it_;
+    }
+    if (!it_->IsEnd()) {
+        KeyView key = it_->GetKey();
+        key_.assign(key.begin(), key.end());
+    }
+}
+
+void SSTableReader::Iterator::SeekBackward(size_t segment, const Key* key, bool including) {
+    backward_ = true;
+    it_.reset();
+    for (; ~segment; --segment, key = nullptr) {
+        ReadSegment(segment);
+        // The first version of a key that the snapshot sees is the newest one it sees.
+        visible_records_.clear();
+        size_t bounded_count = 0;
+        for (size_t pos = 0; pos < block_.size();) {
+            RecordHeader header = ReadRecordHeader(block_.data() + pos, header_size_);
+            KeyView record_key = block_.subspan(pos + header_size_, header.sizes.key_size);
+            bool is_older_version = !visible_records_.empty() &&
+                                    CompareKeys(record_key, GetBlockRecordKey(visible_records_.size() - 1)) == 0;
+            if (header.sequence <= snapshot_ && !is_older_version) {
+                visible_records_.emplace_back(pos);
+                auto cmp = key ? CompareKeys(record_key, *key) : std::strong_ordering::less;
+                if (cmp < 0 || (including && cmp == 0)) {
+                    bounded_count = visible_records_.size();
+                }
+            }
+            pos += header_size_ + header.sizes.key_size + header.sizes.value_size;
+        }
+        if (bounded_count) {
+            segment_ = segment;
+            record_index_ = bounded_count - 1;
+            CopyBlockRecordKey();
+            return;
+        }
+    }
+    visible_records_.clear();
+}
+
+void SSTableReader::Iterator::ReadSegment(size_t segment) {
+    // Scans read around the block cache, like the forward ones.
+    Offset begin = parent_->table_->index_offsets[segment];
+    size_t size = parent_->table_->index_offsets[segment + 1] - begin;
+    if (const uint8_t* mapping = parent_->table_->mapping; mapping) {
+        block_ = {mapping + begin, size};
+        return;
+    }
+    buffer_.resize(size);
+    parent_->Read(buffer_.data(), size, begin);
+    block_ = buffer_;
+}
+
+RecordHeader SSTableReader::Iterator::GetBlockRecordHeader(size_t index) const {
+    return ReadRecordHeader(block_.data() + visible_records_[index], header_size_);
+}
+
+KeyView SSTableReader::Iterator::GetBlockRecordKey(size_t index) const {
+    return block_.subspan(visible_records_[index] + header_size_, GetBlockRecordHeader(index).sizes.key_size);
+}
+
+void SSTableReader::Iterator::CopyBlockRecordKey() {
+    KeyView key = GetBlockRecordKey(record_index_);
+    key_.assign(key.begin(), key.end());
+}
+
+SSTableReader::SSTableReader(SSTableReadersManager& manager, const Path& path, const Table& table)
+    : table_(&table), manager_(&manager), path_(path) {
 }
 
 SSTableReader::SSTableReader(SSTableReader&& other)
-    : meta_(other.meta_),
-      manager_(std::exchange(other.manager_, nullptr)),
-      path_(std::move(other.path_)),
-      fd_(std::exchange(other.fd_, -1)) {
+    : table_(other.table_), manager_(std::exchange(other.manager_, nullptr)), path_(std::move(other.path_)) {
 }
 
 SSTableReader::~SSTableReader() noexcept {
     if (manager_) {
-        manager_->DecreaseFdCounter(path_);
+        manager_->ReleaseTable(path_);
     }
 }
 
 size_t SSTableReader::GetKVCount() const {
-    return meta_.kv_count;
-}
-
-bool SSTableReader::GetFilterIthBit(size_t i) const {
-    size_t batch_offset = GetFilterBatchOffsetWithIthBit(i);
-    uint64_t batch;
-    pread(fd_, &batch, sizeof(batch), batch_offset);
-    return batch & (1ULL << (i & 63));
+    return table_->meta.kv_count;
 }
 
-bool SSTableReader::TestHash(uint64_t hash) const {
-    return GetFilterIthBit(hash % meta_.filter_bits_count);
+bool SSTableReader::TestHashes(uint64_t low_hash, uint64_t high_hash) const {
+    const MetaBlock& meta = table_->meta;
+    return Memtable::BloomFilter::Test(table_->filter.data(), meta.filter_bits_count, meta.filter_hash_func_count,
+                                       meta.filter_type, low_hash, high_hash);
 }
 
-bool SSTableReader::TestHashes(uint64_t low_hash, uint64_t high_hash) const {
-    for (size_t i = 0; i < meta_.filter_hash_func_count; ++i) {
-        if (!TestHash(low_hash + i * high_hash)) {
-            return false;
+std::pair<LookupResult, Key> SSTableReader::Find(const Key& key, SequenceNumber snapshot, Key buffer) const {
+    auto segment = FindSegment(key);
+    if (!segment) {
+        return {std::nullopt, std::move(buffer)};
+    }
+    // The whole block is read at once and searched in memory.
+    Offset begin = table_->index_offsets[*segment];
+    size_t block_size = table_->index_offsets[*segment + 1] - begin;
+    BlockCache::BlockPtr cached_block;
+    std::span<const uint8_t> block;
+    if (table_->mapping) {
+        block = {table_->mapping + begin, block_size};
+    } else {
+        cached_block = ReadCachedBlock(*segment);
+        if (!cached_block) {
+            buffer.resize(block_size);
+            Read(buffer.data(), buffer.size(), begin);
         }
+        block = cached_block ? std::span<const uint8_t>(*cached_block) : std::span<const uint8_t>(buffer);
     }
-    return true;
+    LookupResult res = FindInBlock(block, key, snapshot);
+    return {std::move(res), std::move(buffer)};
 }
 
-std::pair<LookupResult, Key> SSTableReader::Find(const Key& key, Key buffer) const {
-    size_t l = 0;
-    size_t r = meta_.kv_count + 1;
-    while (l + 1 != r) {
-        size_t m = (l + r) >> 1;
-        auto key_token = GetIthKeyToken(m - 1);
-        auto [buffer_ret, value_token] = GetKeyFromToken(key_token, std::move(buffer));
-        buffer = std::move(buffer_ret);
-        // int cmp = Compare(key, buffer);
-        auto cmp = key <=> buffer;
-        if (cmp < 0) {
-            r = m;
-        } else if (cmp > 0) {
-            l = m;
-        } else {
-            return {GetValueFromToken(value_token), std::move(buffer)};
+std::vector<LookupResult> SSTableReader::MultiFind(std::span<const Key* const> keys, SequenceNumber snapshot) const {
+    // The keys are sorted, so every next segment is searched for from the previous one.
+    const auto& index_keys = table_->index_keys;
+    const auto& offsets = table_->index_offsets;
+    std::vector<size_t> key_segments(keys.size());
+    std::vector<size_t> segments;
+    auto index_it = index_keys.begin();
+    for (size_t i = 0; i < keys.size(); ++i) {
+        index_it = std::upper_bound(index_it, index_keys.end(), *keys[i],
+                                    [](const Key& lhs, const Key& rhs) { return CompareKeys(lhs, rhs) < 0; });
+        key_segments[i] = index_it - index_keys.begin() - 1;
+        if (~key_segments[i] && (segments.empty() || segments.back() != key_segments[i])) {
+            segments.emplace_back(key_segments[i]);
         }
     }
-    return {std::nullopt, std::move(buffer)};
-}
 
-std::pair<RangeLookupResult, Key> SSTableReader::FindRange(const KeyRange& range, RangeLookupResult accumulated,
-                                                           Key buffer) const {
-    size_t l = 0;
-    size_t r = meta_.kv_count + 1;
-    if (range.lower.has_value()) {
-        while (l + 1 < r) {
-            size_t m = (l + r) >> 1;
-            auto key_token = GetIthKeyToken(m - 1);
-            auto [buffer_ret, value_token] = GetKeyFromToken(key_token, std::move(buffer));
-            buffer = std::move(buffer_ret);
-            // cmp = Compare(*range.lower, buffer);
-            auto cmp = *range.lower <=> buffer;
-            if (cmp < 0) {
-                r = m;
-            } else if (cmp > 0) {
-                l = m;
+    std::vector<std::span<const uint8_t>> blocks(segments.size());
+    std::vector<BlockCache::BlockPtr> cached_blocks(segments.size());
+    std::vector<uint8_t> buffer;
+    if (table_->mapping) {
+        for (size_t k = 0; k < segments.size(); ++k) {
+            blocks[k] = {table_->mapping + offsets[segments[k]], offsets[segments[k] + 1] - offsets[segments[k]]};
+        }
+    } else {
+        BlockCache* cache = manager_->block_cache_.get();
+        size_t missing_size = 0;
+        for (size_t k = 0; k < segments.size(); ++k) {
+            if (cache) {
+                cached_blocks[k] = cache->Lookup(table_->id, offsets[segments[k]]);
+            }
+            if (cached_blocks[k]) {
+                blocks[k] = *cached_blocks[k];
             } else {
-                l = range.including_lower ? m - 1 : m;
-                break;
+                missing_size += offsets[segments[k] + 1] - offsets[segments[k]];
+            }
+        }
+        buffer.resize(missing_size);
+        size_t buffer_pos = 0;
+        for (size_t k = 0; k < segments.size();) {
+            if (cached_blocks[k]) {
+                ++k;
+                continue;
+            }
+            size_t run_end = k + 1;
+            while (run_end < segments.size() && !cached_blocks[run_end] &&
+                   segments[run_end] == segments[run_end - 1] + 1) {
+                ++run_end;
+            }
+            Read(buffer.data() + buffer_pos, offsets[segments[run_end - 1] + 1] - offsets[segments[k]],
+                 offsets[segments[k]]);
+            for (; k < run_end; ++k) {
+                blocks[k] = {buffer.data() + buffer_pos, offsets[segments[k] + 1] - offsets[segments[k]]};
+                buffer_pos += blocks[k].size();
+                if (cache) {
+                    auto block = std::make_shared<BlockCache::Block>(blocks[k].begin(), blocks[k].end());
+                    cached_blocks[k] = cache->Insert(table_->id, offsets[segments[k]], std::move(block));
+                }
             }
         }
     }
-    for (; l < meta_.kv_count; ++l) {
-        auto key_token = GetIthKeyToken(l);
-        auto [buffer_ret, value_token] = GetKeyFromToken(key_token, std::move(buffer));
-        buffer = std::move(buffer_ret);
-        if (range.upper.has_value() && (range.including_upper ? buffer > *range.upper : buffer >= *range.upper)) {
-            break;
+
+    std::vector<LookupResult> res(keys.size());
+    for (size_t i = 0, k = 0; i < keys.size(); ++i) {
+        if (!~key_segments[i]) {
+            continue;
         }
-        if (value_token.value_size_ == 0) {
-            accumulated.erase(buffer);
-        } else {
-            Value value = GetValueFromToken(value_token);
-            accumulated[buffer] = std::move(value);
+        while (segments[k] != key_segments[i]) {
+            ++k;
         }
+        res[i] = FindInBlock(blocks[k], *keys[i], snapshot);
     }
+    return res;
+}
 
-    return {std::move(accumulated), std::move(buffer)};
+IO::Task<LookupResult> SSTableReader::FindAsync(IO::EventLoop& loop, const Key& key, SequenceNumber snapshot) const {
+    auto segment = FindSegment(key);
+    if (!segment) {
+        co_return std::nullopt;
+    }
+    Offset begin = table_->index_offsets[*segment];
+    size_t block_size = table_->index_offsets[*segment + 1] - begin;
+    if (table_->mapping) {
+        co_return FindInBlock({table_->mapping + begin, block_size}, key, snapshot);
+    }
+    BlockCache* cache = manager_->block_cache_.get();
+    if (cache) {
+        if (auto block = cache->Lookup(table_->id, begin); block) {
+            co_return FindInBlock(*block, key, snapshot);
+        }
+    }
+    auto block = std::make_shared<BlockCache::Block>(block_size);
+    co_await ReadAsync(loop, block->data(), block->size(), begin);
+    if (cache) {
+        cache->Insert(table_->id, begin, block);
+    }
+    co_return FindInBlock(*block, key, snapshot);
 }
 
-SSTableReader::KVIterator SSTableReader::Begin() const {
-    return KVIterator(GetFirstKey(), *this);
+SSTableReader::PrefetchingKVIterator SSTableReader::Begin(IO::EventLoop& loop, size_t depth, const KeyRange& range,
+                                                          bool for_compaction) const {
+    // The inputs of a compaction are deleted right after, so the hint can't hurt point lookups.
+    if (for_compaction && table_->mapping) {
+        madvise(const_cast<uint8_t*>(table_->mapping), table_->mapping_size, MADV_SEQUENTIAL);
+    }
+    return PrefetchingKVIterator(*this, loop, depth, range);
 }
 
-Offset SSTableReader::GetIthOffsetOffset(size_t i) const {
-    return meta_.index_offset + i * sizeof(Offset);
+size_t SSTableReader::GetDataSize() const {
+    return table_->index_offsets.back();
 }
 
-size_t SSTableReader::GetFilterBatchOffsetWithIthBit(size_t i) const {
-    return meta_.filter_offset + (i / 64) * 8;
+std::span<const Key> SSTableReader::GetIndexKeys() const {
+    return table_->index_keys;
 }
 
-SSTableReader::KeyAccessToken SSTableReader::GetIthKeyToken(size_t i) const {
-    Offset offset;
-    pread(fd_, &offset, sizeof(offset), GetIthOffsetOffset(i));
-    return {offset};
+SSTableReader::Iterator SSTableReader::NewIterator(SequenceNumber snapshot) const {
+    return Iterator(*this, snapshot);
 }
 
-SSTableReader::KeyWithValueToken SSTableReader::GetFirstKey() const {
-    KVSizes sizes;
-    pread(fd_, &sizes, sizeof(sizes), 0);
-    Key buffer(sizes.key_size);
-    pread(fd_, buffer.data(), buffer.size() * sizeof(buffer[0]), 0 + sizeof(sizes));
-    return {std::move(buffer), {0 + sizeof(sizes) + sizes.key_size, sizes.value_size}};
+std::pair<Offset, Offset> SSTableReader::GetRangeBounds(const KeyRange& range) const {
+    const auto& offsets = table_->index_offsets;
+    Offset begin = 0;
+    if (range.lower.has_value()) {
+        if (auto segment = FindSegment(*range.lower); segment) {
+            begin = offsets[*segment];
+        }
+    }
+    Offset end = offsets.back();
+    if (range.upper.has_value()) {
+        auto segment = FindSegment(*range.upper);
+        end = segment ? offsets[*segment + 1] : 0;
+    }
+    return {begin, std::max(begin, end)};
 }
 
-SSTableReader::KeyWithValueToken SSTableReader::GetKeyFromToken(KeyAccessToken token, Key buffer) const {
-    KVSizes sizes;
-    pread(fd_, &sizes, sizeof(sizes), token.kv_offset_);
-    buffer.resize(sizes.key_size);
-    pread(fd_, buffer.data(), buffer.size() * sizeof(buffer[0]), token.kv_offset_ + sizeof(sizes));
-    return {std::move(buffer), {token.kv_offset_ + sizeof(sizes) + sizes.key_size, sizes.value_size}};
+std::optional<size_t> SSTableReader::FindSegment(KeyView key) const {
+    const auto& keys = table_->index_keys;
+    auto it = std::upper_bound(keys.begin(), keys.end(), key,
+                               [](KeyView lhs, const Key& rhs) { return CompareKeys(lhs, rhs) < 0; });
+    if (it == keys.begin()) {
+        return std::nullopt;
+    }
+    return it - keys.begin() - 1;
 }
 
-SSTableReader::KeyWithValueToken SSTableReader::GetNextKey(KeyWithValueToken token) const {
-    KVSizes sizes;
-    pread(fd_, &sizes, sizeof(sizes), token.value_token.value_offset_ + token.value_token.value_size_);
-    token.key.resize(sizes.key_size);
-    pread(fd_, token.key.data(), token.key.size() * sizeof(token.key[0]),
-          token.value_token.value_offset_ + token.value_token.value_size_ + sizeof(sizes));
-    token.value_token.value_offset_ =
-        token.value_token.value_offset_ + token.value_token.value_size_ + sizeof(sizes) + sizes.key_size;
-    token.value_token.value_size_ = sizes.value_size;
-    return token;
+LookupResult SSTableReader::FindInBlock(std::span<const uint8_t> block, const Key& key, SequenceNumber snapshot) const {
+    size_t header_size = GetRecordHeaderSize(table_->meta.format_version);
+    for (size_t pos = 0; pos < block.size();) {
+        RecordHeader header = ReadRecordHeader(block.data() + pos, header_size);
+        const uint8_t* record_key = block.data() + pos + header_size;
+        auto cmp = CompareKeys(key, KeyView(record_key, header.sizes.key_size));
+        if (cmp < 0) {
+            break;
+        }
+        // The versions of the key go from the newest, the first one the snapshot sees is the answer.
+        if (cmp == 0 && header.sequence <= snapshot) {
+            const uint8_t* value = record_key + header.sizes.key_size;
+            return Value(value, value + header.sizes.value_size);
+        }
+        pos += header_size + header.sizes.key_size + header.sizes.value_size;
+    }
+    return std::nullopt;
+}
+
+BlockCache::BlockPtr SSTableReader::ReadCachedBlock(size_t segment) const {
+    BlockCache* cache = manager_->block_cache_.get();
+    if (!cache) {
+        return nullptr;
+    }
+    Offset begin = table_->index_offsets[segment];
+    if (auto block = cache->Lookup(table_->id, begin); block) {
+        return block;
+    }
+    auto block = std::make_shared<BlockCache::Block>(table_->index_offsets[segment + 1] - begin);
+    Read(block->data(), block->size(), begin);
+    return cache->Insert(table_->id, begin, std::move(block));
+}
+
+void SSTableReader::Read(uint8_t* data, size_t size, Offset offset) const {
+    if (table_->mapping) {
+        std::memcpy(data, table_->mapping + offset, size);
+        return;
+    }
+    ReadExactly(table_->fd, data, size, offset, path_);
 }
 
-Value SSTableReader::GetValueFromToken(ValueAccessToken token, Value buffer) const {
-    buffer.resize(token.value_size_);
-    pread(fd_, buffer.data(), buffer.size() * sizeof(buffer[0]), token.value_offset_);
-    return buffer;
+IO::Task<void> SSTableReader::ReadAsync(IO::EventLoop& loop, uint8_t* data, size_t size, Offset offset) const {
+    while (size) {
+        int64_t r = co_await loop.Read(table_->fd, data, size, offset);
+        if (r <= 0) {
+            if (r == -EINTR) {
+                continue;
+            }
+            errno = r == 0 ? EIO : static_cast<int>(-r);
+            ThrowCantReadSSTable(path_);
+        }
+        data += r;
+        size -= r;
+        offset += r;
+    }
 }
 
-SSTableReadersManager::SSTableReadersManager(size_t cahce_size) : cache_size_(cahce_size) {
+SSTableReadersManager::SSTableReadersManager(size_t cahce_size, size_t memory_budget, size_t scan_readahead_size,
+                                             size_t block_cache_size, bool use_mmap)
+    : cache_size_(cahce_size),
+      memory_budget_(memory_budget),
+      scan_readahead_size_(scan_readahead_size),
+      block_cache_(block_cache_size && !use_mmap ? std::make_unique<BlockCache>(block_cache_size) : nullptr),
+      use_mmap_(use_mmap) {
+}
+
+SSTableReadersManager::~SSTableReadersManager() noexcept {
+    for (auto& [path, table] : tables_) {
+        CloseTable(table);
+    }
 }
 
 SSTableReadersManager::SSTableReader SSTableReadersManager::CreateReader(const Path& path) {
     auto normal_path = path.lexically_normal();
-    if (auto it = fd_mapping_.find(normal_path); it != fd_mapping_.end()) {
-        ++it->second.count;
-        return SSTableReader(*this, normal_path, it->second.fd);
+    std::unique_lock lock(mtx_);
+    auto it = tables_.find(normal_path);
+    if (it == tables_.end()) {
+        lock.unlock();
+        Table table = LoadTable(normal_path);
+        lock.lock();
+        bool inserted;
+        std::tie(it, inserted) = tables_.try_emplace(normal_path, std::move(table));
+        if (inserted) {
+            memory_usage_ += it->second.charge;
+            // Tables in use are never evicted, so the budget may only be exceeded until they are released.
+            TryClearingCache();
+            return SSTableReader(*this, normal_path, it->second);
+        }
+        // Another reader has loaded the table meanwhile.
+        CloseTable(table);
     }
-    int fd = open(normal_path.c_str(), O_RDONLY | O_CLOEXEC);
-    if (fd < 0) {
-        throw std::runtime_error(std::string("Can't read sstable with name ") + path.c_str() + ": " +
-                                 std::strerror(errno));
+    if (!it->second.count++) {
+        lru_.erase(it->second.lru_position);
     }
-    fd_mapping_[normal_path] = {1, fd};
-    return SSTableReader(*this, normal_path, fd);
+    return SSTableReader(*this, normal_path, it->second);
 }
 
 size_t SSTableReadersManager::CacheSize() const {
     return cache_size_;
 }
 
+size_t SSTableReadersManager::MemoryBudget() const {
+    return memory_budget_;
+}
+
+size_t SSTableReadersManager::MemoryUsage() const {
+    const std::lock_guard guard(mtx_);
+    return memory_usage_;
+}
+
+size_t SSTableReadersManager::ScanReadaheadSize() const {
+    return scan_readahead_size_;
+}
+
+BlockCacheStatistics SSTableReadersManager::GetBlockCacheStatistics() const {
+    if (!block_cache_) {
+        return {.hits = 0, .misses = 0, .usage = 0, .capacity = 0};
+    }
+    return block_cache_->GetStatistics();
+}
+
 void SSTableReadersManager::Unlink(const Path& path) {
     auto normal_path = path.lexically_normal();
-    if (auto it = fd_mapping_.find(normal_path); it != fd_mapping_.end()) {
-        close(it->second.fd);
-        fd_mapping_.erase(it);
+    const std::lock_guard guard(mtx_);
+    if (auto it = tables_.find(normal_path); it != tables_.end()) {
+        if (it->second.count) {
+            it->second.unlinked = true;
+        } else {
+            lru_.erase(it->second.lru_position);
+            EraseTable(it);
+        }
     }
     unlink(normal_path.c_str());
 }
 
-void SSTableReadersManager::DecreaseFdCounter(const Path& normal_path) {
-    auto it = fd_mapping_.find(normal_path);
-    if (it == fd_mapping_.end()) {
-        return;
+SSTableReadersManager::Table SSTableReadersManager::LoadTable(const Path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ThrowCantReadSSTable(path);
+    }
+    Table table;
+    // Blocks of an evicted table are left in the block cache. A reopened table gets a new id, so they age out.
+    table.id = next_table_id_++;
+    table.fd = fd;
+    try {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ThrowCantReadSSTable(path);
+        }
+        // Versioned sstables end with the fields of their version, format_version and magic. Legacy ones only with
+        // their five fields.
+        size_t file_size = st.st_size;
+        if (file_size < kLegacyMetaBlockSize) {
+            errno = EINVAL;
+            ThrowCantReadSSTable(path);
+        }
+        uint8_t trailer[sizeof(MetaBlock)];
+        size_t trailer_size = std::min(sizeof(trailer), file_size);
+        const uint8_t* trailer_end = trailer + trailer_size;
+        ReadExactly(fd, trailer, trailer_size, file_size - trailer_size, path);
+        uint64_t magic;
+        std::memcpy(&magic, trailer_end - sizeof(magic), sizeof(magic));
+        uint64_t format_version = kSSTableFormatLegacy;
+        size_t meta_size = kLegacyMetaBlockSize;
+        if (magic == kSSTableMagic) {
+            std::memcpy(&format_version, trailer_end - sizeof(magic) - sizeof(format_version), sizeof(format_version));
+            if (format_version == kSSTableFormatLegacy || format_version > kSSTableFormatLatest) {
+                throw std::runtime_error(std::string("Unsupported format version of sstable with name ") +
+                                         path.c_str());
+            }
+            meta_size = GetMetaBlockFieldsSize(format_version) + sizeof(format_version) + sizeof(magic);
+        }
+        std::memcpy(&table.meta, trailer_end - meta_size, GetMetaBlockFieldsSize(format_version));
+        table.meta.format_version = format_version;
+        Offset index_end = file_size - meta_size;
+
+        table.filter.resize((table.meta.filter_bits_count + 63) / 64);
+        ReadExactly(fd, table.filter.data(), table.filter.size() * sizeof(table.filter[0]), table.meta.filter_offset,
+                    path);
+
+        if (table.meta.format_version == kSSTableFormatLegacy) {
+            LoadLegacyIndex(table, path);
+        } else {
+            LoadBlockIndex(table, index_end, path);
+        }
+        table.index_offsets.emplace_back(table.meta.filter_offset);
+
+        size_t keys_size = 0;
+        for (const auto& key : table.index_keys) {
+            keys_size += key.size();
+        }
+        if (use_mmap_) {
+            void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED) {
+                ThrowCantReadSSTable(path);
+            }
+            // Point lookups touch one block per table, reading ahead around it would only pollute the page cache.
+            madvise(mapping, file_size, MADV_RANDOM);
+            table.mapping = static_cast<const uint8_t*>(mapping);
+            table.mapping_size = file_size;
+        }
+
+        // The mapping is backed by the page cache, so it does not count towards the memory budget.
+        table.charge = sizeof(table) + table.filter.size() * sizeof(table.filter[0]) +
+                       table.index_offsets.size() * sizeof(table.index_offsets[0]) +
+                       table.index_keys.size() * sizeof(table.index_keys[0]) + keys_size;
+    } catch (...) {
+        close(fd);
+        throw;
     }
-    --it->second.count;
-    if (!it->second.count) {
-        cache_queue_.push(normal_path);
-        TryClearingCache();
+    return table;
+}
+
+void SSTableReadersManager::LoadBlockIndex(Table& table, Offset index_end, const Path& path) {
+    std::vector<uint8_t> index(index_end - table.meta.index_offset);
+    ReadExactly(table.fd, index.data(), index.size(), table.meta.index_offset, path);
+    table.index_keys.reserve(table.meta.block_count);
+    table.index_offsets.reserve(table.meta.block_count + 1);
+    size_t pos = 0;
+    for (size_t i = 0; i < table.meta.block_count; ++i) {
+        Offset block_offset;
+        uint32_t key_size;
+        if (pos + sizeof(block_offset) + sizeof(key_size) > index.size()) {
+            errno = EINVAL;
+            ThrowCantReadSSTable(path);
+        }
+        std::memcpy(&block_offset, index.data() + pos, sizeof(block_offset));
+        std::memcpy(&key_size, index.data() + pos + sizeof(block_offset), sizeof(key_size));
+        pos += sizeof(block_offset) + sizeof(key_size);
+        if (pos + key_size > index.size()) {
+            errno = EINVAL;
+            ThrowCantReadSSTable(path);
+        }
+        table.index_offsets.emplace_back(block_offset);
+        table.index_keys.emplace_back(index.data() + pos, index.data() + pos + key_size);
+        pos += key_size;
     }
 }
 
-void SSTableReadersManager::TryClearingCache() {
-    while (cache_queue_.size() > cache_size_) {
-        Path normal_path = std::move(cache_queue_.front());
-        cache_queue_.pop();
-        auto it = fd_mapping_.find(normal_path);
-        if (it == fd_mapping_.end()) {
+void SSTableReadersManager::LoadLegacyIndex(Table& table, const Path& path) {
+    // A new segment starts at the first record at least kIndexSegmentSize bytes after the start of the previous one.
+    std::vector<Offset> offsets(table.meta.kv_count);
+    ReadExactly(table.fd, offsets.data(), offsets.size() * sizeof(offsets[0]), table.meta.index_offset, path);
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (i && offsets[i] - table.index_offsets.back() < kIndexSegmentSize) {
             continue;
         }
-        if (!it->second.count) {
-            close(it->second.fd);
-            fd_mapping_.erase(it);
-        }
+        table.index_offsets.emplace_back(offsets[i]);
+        table.index_keys.emplace_back(ReadKey(table.fd, offsets[i], table.meta.filter_offset, path));
+    }
+}
+
+void SSTableReadersManager::ReleaseTable(const Path& normal_path) {
+    const std::lock_guard guard(mtx_);
+    auto it = tables_.find(normal_path);
+    if (it == tables_.end() || --it->second.count) {
+        return;
+    }
+    if (it->second.unlinked) {
+        EraseTable(it);
+        return;
+    }
+    it->second.lru_position = lru_.insert(lru_.end(), normal_path);
+    TryClearingCache();
+}
+
+void SSTableReadersManager::EraseTable(std::map<Path, Table>::iterator it) {
+    CloseTable(it->second);
+    memory_usage_ -= it->second.charge;
+    tables_.erase(it);
+}
+
+void SSTableReadersManager::CloseTable(Table& table) {
+    if (table.mapping) {
+        munmap(const_cast<uint8_t*>(table.mapping), table.mapping_size);
+    }
+    close(table.fd);
+}
+
+void SSTableReadersManager::TryClearingCache() {
+    while (!lru_.empty() && (lru_.size() > cache_size_ || memory_usage_ > memory_budget_)) {
+        auto it = tables_.find(lru_.front());
+        lru_.pop_front();
+        EraseTable(it);
     }
 }
 
@@ -1,52 +1,194 @@
 #pragma once
 
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <mutex>
 
 #include "../common.h"
+#include "../io/event_loop.h"
+#include "../memtable/bloom_filter/bitset.h"
+#include "block_cache.h"
 
 namespace MyLSMTree::SSTable {
 
+// Table cache. Every open sstable keeps its meta block, filter and a sparse key index in memory, so a point lookup
+// reads the file only once, for the data block that may hold the key. Sstables of the legacy format have no blocks, so
+// their index is built by sampling a key about every kIndexSegmentSize bytes. Blocks read by point lookups go through
+// the block cache, while scans read around it so they can't evict the blocks of hot keys. In mmap mode the files are
+// mapped instead, lookups and scans work on the mapping directly and the page cache takes the place of the block cache.
+// The manager is thread-safe. Tables are loaded without holding its lock, so a slow open doesn't stall other readers.
 class SSTableReadersManager {
-    struct FdCounter {
-        uint32_t count;
-        int fd;
+    struct Table {
+        // Identifies the sstable in the block cache.
+        uint64_t id = 0;
+        int fd = -1;
+        // Whole file mapped into memory in mmap mode, nullptr otherwise.
+        const uint8_t* mapping = nullptr;
+        size_t mapping_size = 0;
+        MetaBlock meta{};
+        Memtable::Bitset::Words filter;
+        // First keys and offsets of the data blocks, or of the sampled segments of a legacy sstable. The last offset is
+        // the end of the data.
+        std::vector<Key> index_keys;
+        std::vector<Offset> index_offsets;
+        size_t charge = 0;
+        // The fields below are guarded by the lock of the manager, the ones above never change once loaded.
+        uint32_t count = 1;
+        // The file was unlinked while readers were still using it, so the table is dropped with its last reader.
+        bool unlinked = false;
+        // Position in lru_, only meaningful while nobody uses the table.
+        std::list<Path>::iterator lru_position;
     };
 
 public:
     class SSTableReader {
         friend class SSTableReadersManager;
 
-        struct KeyAccessToken {
-            Offset kv_offset_;
-        };
+    public:
+        // Sequential scanner over the data block. It reads the file in large chunks and hands out views into its
+        // buffer, which stay valid until the iterator is advanced.
+        class KVIterator {
+            friend class SSTableReader;
 
-        struct ValueAccessToken {
-            Offset value_offset_;
-            size_t value_size_;
-        };
+        public:
+            bool IsEnd() const;
+            void operator++();
+            KeyView GetKey() const;
+            ValueView GetValue() const;
+            size_t GetValueSize() const;
+            SequenceNumber GetSequenceNumber() const;
+
+        private:
+            // Every refill reads twice as much as the previous one, from readahead_size up to max_readahead_size.
+            KVIterator(const SSTableReader& parent, Offset offset, size_t readahead_size, size_t max_readahead_size);
+            // Walks the records of data, which holds whole blocks of the file from offset on.
+            KVIterator(const SSTableReader& parent, std::span<const uint8_t> data, Offset offset);
+
+            void Load(Offset offset);
+            void Fill(Offset offset, size_t size);
+            Offset GetRecordOffset() const;
 
-        struct KeyWithValueToken {
-            Key key;
-            ValueAccessToken value_token;
+        private:
+            std::vector<uint8_t> buffer_;
+            // Start of the buffered part of the file, either buffer_ or the mapping of the sstable.
+            const uint8_t* data_ = nullptr;
+            Offset buffer_offset_ = 0;
+            size_t buffer_size_ = 0;
+            size_t record_pos_ = 0;
+            RecordHeader header_{.sizes = {0, 0}, .sequence = 0};
+            size_t header_size_;
+            size_t readahead_size_;
+            size_t max_readahead_size_;
+            const SSTableReader* parent_;
+            Offset end_;
+            bool is_end_ = false;
         };
 
-    public:
-        class KVIterator {
+        // Sequential scanner for compactions, over the records of a key range. It reads the blocks that may hold them
+        // in chunks of whole blocks of about the scan readahead size and keeps the reads of up to depth chunks in
+        // flight on the loop, so the records of one chunk are walked while the next ones are read. Records never cross
+        // blocks, so every chunk is walked on its own. In mmap mode it walks the mapping. The reads in flight must be
+        // over before it is destroyed, Drain waits for them.
+        class PrefetchingKVIterator {
             friend class SSTableReader;
 
         public:
             bool IsEnd() const;
+            // The current chunk is over and the iterator moves on to the next one by awaiting Load.
+            bool NeedsLoad() const;
+            IO::Task<void> Load();
+            IO::Task<void> Drain();
             void operator++();
-            const Key& GetKey() const;
-            Value GetValue(Value buffer) const;
+            KeyView GetKey() const;
+            ValueView GetValue() const;
             size_t GetValueSize() const;
+            SequenceNumber GetSequenceNumber() const;
 
         private:
-            KVIterator(KeyWithValueToken kv, const SSTableReader& parent);
+            struct Chunk {
+                Offset offset;
+                std::vector<uint8_t> buffer;
+                IO::Future<void> read;
+            };
+
+            PrefetchingKVIterator(const SSTableReader& parent, IO::EventLoop& loop, size_t depth,
+                                  const KeyRange& range);
+
+            // Starts reading the next chunks until depth of them are in flight.
+            void ReadAhead();
+            // Skips the records below the range and stops at the first one above it.
+            void Settle();
 
         private:
-            KeyWithValueToken kv_;
             const SSTableReader* parent_;
+            IO::EventLoop* loop_;
+            size_t depth_;
+            // Chunks being read, the oldest first.
+            std::deque<Chunk> chunks_;
+            KeyRange range_;
+            // Set until a record that is not below the range is found.
+            bool check_lower_;
+            bool past_upper_ = false;
+            // First segment of the index that no chunk covers yet, and the end of the segments of the range.
+            size_t next_segment_ = 0;
+            size_t end_segment_ = 0;
+            std::vector<uint8_t> current_;
+            // Buffer of the previous chunk, reused by the next read.
+            std::vector<uint8_t> spare_;
+            std::optional<KVIterator> it_;
+        };
+
+        // Walks the keys in either direction, positioned at the newest version of each up to the snapshot. Keys that
+        // have no such version are skipped, tombstones are not. Going forward, it reads from the block that may hold
+        // the key on, with a readahead that starts small, so a short scan reads little more than it consumes. Records
+        // can only be parsed forward, so going backward it reads a whole block and steps through the versions in it.
+        class Iterator {
+            friend class SSTableReader;
+
+        public:
+            bool IsValid() const;
+            // Moves to the first key not less than key.
+            void Seek(const Key& key);
+            // Moves to the last key not greater than key.
+            void SeekForPrev(const Key& key);
+            void SeekToFirst();
+            void SeekToLast();
+            void Next();
+            void Prev();
+            KeyView GetKey() const;
+            ValueView GetValue() const;
+
+        private:
+            Iterator(const SSTableReader& parent, SequenceNumber snapshot);
+
+            void Seek(Offset offset, const Key* key);
+            // Moves on to the first record that the snapshot sees.
+            void Settle();
+            // Moves to the last key of the segment that is less than key, or not greater if including, and to the
+            // previous segments while there is none. Every key of the segment counts if key is nullptr.
+            void SeekBackward(size_t segment, const Key* key, bool including);
+            void ReadSegment(size_t segment);
+            RecordHeader GetBlockRecordHeader(size_t index) const;
+            KeyView GetBlockRecordKey(size_t index) const;
+            void CopyBlockRecordKey();
+
+        private:
+            const SSTableReader* parent_;
+            SequenceNumber snapshot_;
+            size_t header_size_;
+            // Going forward the records are streamed from it_.
+            std::optional<KVIterator> it_;
+            // Going backward block_ holds the segment, either in buffer_ or in the mapping, and visible_records_ the
+            // positions of the versions in it that the snapshot sees.
+            bool backward_ = false;
+            std::vector<uint8_t> buffer_;
+            std::span<const uint8_t> block_;
+            std::vector<size_t> visible_records_;
+            size_t record_index_ = 0;
+            size_t segment_ = 0;
+            // Copy of the current key, so the older versions of it can be skipped.
+            Key key_;
         };
 
     public:
@@ -55,48 +197,89 @@ public:
         ~SSTableReader() noexcept;
 
         size_t GetKVCount() const;
-        bool GetFilterIthBit(size_t i) const;
-        bool TestHash(uint64_t hash) const;
         bool TestHashes(uint64_t low_hash, uint64_t high_hash) const;
-        std::pair<LookupResult, Key> Find(const Key& key, Key buffer = {}) const;
-        std::pair<RangeLookupResult, Key> FindRange(const KeyRange& range,
-                                                              RangeLookupResult accumulated = {},
-                                                              Key buffer = {}) const;
-        KVIterator Begin() const;
+        // The lookups see the newest version of a key up to the sequence number snapshot.
+        std::pair<LookupResult, Key> Find(const Key& key, SequenceNumber snapshot = kMaxSequenceNumber,
+                                          Key buffer = {}) const;
+        // Looks up the sorted keys together: the index is walked once, every block is searched once for all of its
+        // keys, and the blocks missing from the block cache that lie next to each other in the file are read at once.
+        std::vector<LookupResult> MultiFind(std::span<const Key* const> keys,
+                                            SequenceNumber snapshot = kMaxSequenceNumber) const;
+        // Same as Find, but the block is read through the loop. The reader and the key must outlive the task.
+        IO::Task<LookupResult> FindAsync(IO::EventLoop& loop, const Key& key,
+                                         SequenceNumber snapshot = kMaxSequenceNumber) const;
+        // The reader and the loop must outlive the iterator. A compaction scan also tells the kernel that a mapped
+        // table is read sequentially.
+        PrefetchingKVIterator Begin(IO::EventLoop& loop, size_t depth, const KeyRange& range,
+                                    bool for_compaction) const;
+        // Bytes of the data blocks.
+        size_t GetDataSize() const;
+        // First keys of the data blocks, or of the sampled segments of a legacy sstable.
+        std::span<const Key> GetIndexKeys() const;
+        // The iterator is not positioned until it is sought. It must not outlive the reader.
+        Iterator NewIterator(SequenceNumber snapshot = kMaxSequenceNumber) const;
 
     private:
-        SSTableReader(SSTableReadersManager& manager, const Path& path, int fd);
+        SSTableReader(SSTableReadersManager& manager, const Path& path, const Table& table);
 
-        Offset GetIthOffsetOffset(size_t i) const;
-        size_t GetFilterBatchOffsetWithIthBit(size_t i) const;
-        KeyAccessToken GetIthKeyToken(size_t i) const;
-        KeyWithValueToken GetFirstKey() const;
-        KeyWithValueToken GetKeyFromToken(KeyAccessToken token, Key buffer = {}) const;
-        KeyWithValueToken GetNextKey(KeyWithValueToken token) const;
-        Value GetValueFromToken(ValueAccessToken token, Value buffer = {}) const;
+        // Index of the segment that may contain the key, or nullopt if the key is less than every key of the table.
+        std::optional<size_t> FindSegment(KeyView key) const;
+        // Part of the data that may hold keys of the range, begin == end if there is none.
+        std::pair<Offset, Offset> GetRangeBounds(const KeyRange& range) const;
+        LookupResult FindInBlock(std::span<const uint8_t> block, const Key& key, SequenceNumber snapshot) const;
+        BlockCache::BlockPtr ReadCachedBlock(size_t segment) const;
+        void Read(uint8_t* data, size_t size, Offset offset) const;
+        IO::Task<void> ReadAsync(IO::EventLoop& loop, uint8_t* data, size_t size, Offset offset) const;
 
     private:
-        MetaBlock meta_;
+        const Table* table_;
         SSTableReadersManager* manager_;
         Path path_;
-        int fd_;
     };
 
 public:
-    SSTableReadersManager(size_t cache_size);
+    static constexpr size_t kDefaultMemoryBudget = 1 << 28;
+    static constexpr size_t kDefaultScanReadaheadSize = 1 << 18;
+    // Approximate amount of data between two neighbouring keys of the in-memory index of a legacy sstable.
+    static constexpr size_t kIndexSegmentSize = 1 << 12;
+
+    // Up to cache_size unused tables stay open, as long as all open tables fit into memory_budget bytes. The block
+    // cache is disabled if block_cache_size is 0.
+    explicit SSTableReadersManager(size_t cache_size, size_t memory_budget = kDefaultMemoryBudget,
+                                   size_t scan_readahead_size = kDefaultScanReadaheadSize, size_t block_cache_size = 0,
+                                   bool use_mmap = false);
+    SSTableReadersManager(const SSTableReadersManager&) = delete;
+    ~SSTableReadersManager() noexcept;
 
     SSTableReader CreateReader(const Path& path);
     size_t CacheSize() const;
+    size_t MemoryBudget() const;
+    size_t MemoryUsage() const;
+    size_t ScanReadaheadSize() const;
+    BlockCacheStatistics GetBlockCacheStatistics() const;
     void Unlink(const Path& path);
 
 private:
-    void DecreaseFdCounter(const Path& normal_path);
+    Table LoadTable(const Path& path);
+    static void LoadBlockIndex(Table& table, Offset index_end, const Path& path);
+    static void LoadLegacyIndex(Table& table, const Path& path);
+    void ReleaseTable(const Path& normal_path);
+    void EraseTable(std::map<Path, Table>::iterator it);
+    static void CloseTable(Table& table);
     void TryClearingCache();
 
 private:
-    std::queue<Path> cache_queue_;
-    std::map<Path, FdCounter> fd_mapping_;
+    mutable std::mutex mtx_;
+    std::map<Path, Table> tables_;
+    // Unused tables, from the least to the most recently used.
+    std::list<Path> lru_;
     size_t cache_size_;
+    size_t memory_budget_;
+    size_t memory_usage_ = 0;
+    size_t scan_readahead_size_;
+    std::unique_ptr<BlockCache> block_cache_;
+    bool use_mmap_;
+    std::atomic<uint64_t> next_table_id_ = 0;
 };
 
 }  // namespace MyLSMTree::SSTable
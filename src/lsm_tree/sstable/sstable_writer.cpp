@@ -0,0 +1,239 @@
+#include "sstable_writer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <unistd.h>
+
+#include "../memtable/bloom_filter/bloom_filter.h"
+
+namespace MyLSMTree::SSTable {
+
+namespace {
+
+constexpr size_t kMaxIovecs = IOV_MAX;
+
+void ThrowCantWriteSSTable() {
+    throw std::runtime_error(std::string("Can't write sstable: ") + std::strerror(errno));
+}
+
+IO::Task<void> WriteAsync(IO::EventLoop& loop, int fd, const uint8_t* data, size_t size, Offset offset) {
+    while (size) {
+        int64_t written = co_await loop.Write(fd, data, size, offset);
+        if (written <= 0) {
+            if (written == -EINTR) {
+                continue;
+            }
+            errno = written == 0 ? EIO : static_cast<int>(-written);
+            ThrowCantWriteSSTable();
+        }
+        data += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+}  // namespace
+
+SSTableWriter::SSTableWriter(int fd, size_t buffer_size, bool vectored, size_t block_size, IO::EventLoop* loop)
+    : buffer_(buffer_size),
+      block_size_(block_size),
+      fd_(fd),
+      file_offset_(lseek(fd, 0, SEEK_CUR)),
+      vectored_(vectored && !loop),
+      loop_(loop) {
+    if (file_offset_ < 0) {
+        ThrowCantWriteSSTable();
+    }
+}
+
+void SSTableWriter::AddKV(KeyView key, ValueView value, SequenceNumber sequence, bool continues_key) {
+    AddKVSizes({static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())}, sequence, continues_key);
+    Append(key.data(), key.size() * sizeof(key[0]));
+    Append(value.data(), value.size() * sizeof(value[0]));
+}
+
+void SSTableWriter::AddKVSizes(KVSizes sizes, SequenceNumber sequence, bool continues_key) {
+    // Versions of a key stay in one block, so a point lookup still reads a single block.
+    bool starts_block = !kv_count_ || (!continues_key && offset_ - block_offset_ >= block_size_);
+    if (starts_block) {
+        block_offset_ = offset_;
+        ++block_count_;
+        const auto* offset_bytes = reinterpret_cast<const uint8_t*>(&block_offset_);
+        const auto* key_size_bytes = reinterpret_cast<const uint8_t*>(&sizes.key_size);
+        index_.insert(index_.end(), offset_bytes, offset_bytes + sizeof(block_offset_));
+        index_.insert(index_.end(), key_size_bytes, key_size_bytes + sizeof(sizes.key_size));
+    }
+    ++kv_count_;
+    RecordHeader header{.sizes = sizes, .sequence = sequence};
+    Append(&header, sizeof(header));
+    if (starts_block) {
+        index_key_remaining_ = sizes.key_size;
+    }
+}
+
+void SSTableWriter::Append(const void* data, size_t size) {
+    CaptureIndexKey(data, size);
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    while (size) {
+        // Flushing resets the buffer, so it must happen before the bytes are copied in rather than when pushing them.
+        if (buffer_used_ == buffer_.size() || iovecs_.size() == kMaxIovecs) {
+            Flush();
+        }
+        size_t to_copy = std::min(size, buffer_.size() - buffer_used_);
+        std::memcpy(buffer_.data() + buffer_used_, bytes, to_copy);
+        PushIovec(buffer_.data() + buffer_used_, to_copy);
+        buffer_used_ += to_copy;
+        bytes += to_copy;
+        size -= to_copy;
+    }
+}
+
+void SSTableWriter::AppendStable(const void* data, size_t size) {
+    if (!vectored_ || size < kMinReferencedSize) {
+        Append(data, size);
+        return;
+    }
+    CaptureIndexKey(data, size);
+    PushIovec(data, size);
+    if (pending_size_ >= buffer_.size()) {
+        Flush();
+    }
+}
+
+void SSTableWriter::Finish(const Memtable::BloomFilter& filter) {
+    Offset filter_offset = offset_;
+    AppendStable(filter.Data(), filter.GetSizeInBytes());
+    Offset index_offset = offset_;
+    AppendStable(index_.data(), index_.size() * sizeof(index_[0]));
+    MetaBlock meta{.filter_offset = filter_offset,
+                   .filter_bits_count = filter.BitsCount(),
+                   .filter_hash_func_count = filter.HashFuncCount(),
+                   .index_offset = index_offset,
+                   .kv_count = kv_count_,
+                   .block_count = block_count_,
+                   .filter_type = filter.Type(),
+                   .format_version = kSSTableFormatLatest,
+                   .magic = kSSTableMagic};
+    Append(&meta, sizeof(meta));
+    Flush();
+}
+
+void SSTableWriter::Flush() {
+    if (loop_) {
+        StartWrite();
+        return;
+    }
+    size_t first = 0;
+    while (first < iovecs_.size()) {
+        int count = static_cast<int>(std::min(iovecs_.size() - first, kMaxIovecs));
+        ssize_t written = pwritev(fd_, iovecs_.data() + first, count, file_offset_);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ThrowCantWriteSSTable();
+        }
+        file_offset_ += written;
+        // A short write leaves the tail of some iovec unwritten, it is retried from where it stopped.
+        while (written > 0 && static_cast<size_t>(written) >= iovecs_[first].iov_len) {
+            written -= iovecs_[first].iov_len;
+            ++first;
+        }
+        if (written > 0) {
+            iovecs_[first].iov_base = static_cast<uint8_t*>(iovecs_[first].iov_base) + written;
+            iovecs_[first].iov_len -= written;
+        }
+    }
+    iovecs_.clear();
+    buffer_used_ = 0;
+    pending_size_ = 0;
+}
+
+size_t SSTableWriter::GetWritesInFlight() const {
+    return writes_.size();
+}
+
+IO::Task<void> SSTableWriter::WaitForWrites(size_t max_in_flight) {
+    std::exception_ptr error;
+    while (writes_.size() > max_in_flight) {
+        try {
+            co_await writes_.front().done;
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        spare_buffers_.emplace_back(std::move(writes_.front().buffer));
+        writes_.pop_front();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+IO::Task<void> SSTableWriter::SyncAsync() {
+    co_await WaitForWrites(0);
+    int64_t r = co_await loop_->Sync(fd_);
+    if (r < 0) {
+        errno = static_cast<int>(-r);
+        ThrowCantWriteSSTable();
+    }
+}
+
+size_t SSTableWriter::GetKVCount() const {
+    return kv_count_;
+}
+
+Offset SSTableWriter::GetOffset() const {
+    return offset_;
+}
+
+void SSTableWriter::PushIovec(const void* data, size_t size) {
+    if (!iovecs_.empty() && static_cast<const uint8_t*>(iovecs_.back().iov_base) + iovecs_.back().iov_len == data) {
+        iovecs_.back().iov_len += size;
+    } else {
+        if (iovecs_.size() == kMaxIovecs) {
+            Flush();
+        }
+        iovecs_.push_back({const_cast<void*>(data), size});
+    }
+    offset_ += size;
+    pending_size_ += size;
+}
+
+void SSTableWriter::CaptureIndexKey(const void* data, size_t size) {
+    if (!index_key_remaining_) {
+        return;
+    }
+    size_t captured = std::min(size, index_key_remaining_);
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    index_.insert(index_.end(), bytes, bytes + captured);
+    index_key_remaining_ -= captured;
+}
+
+void SSTableWriter::StartWrite() {
+    // In the asynchronous mode the iovecs only ever cover the buffer.
+    if (buffer_used_) {
+        std::vector<uint8_t> spare;
+        if (spare_buffers_.empty()) {
+            spare.resize(buffer_.size());
+        } else {
+            spare = std::move(spare_buffers_.back());
+            spare_buffers_.pop_back();
+        }
+        std::vector<uint8_t> buffer = std::exchange(buffer_, std::move(spare));
+        auto done = IO::Spawn(WriteAsync(*loop_, fd_, buffer.data(), buffer_used_, file_offset_));
+        writes_.push_back({.buffer = std::move(buffer), .done = std::move(done)});
+        file_offset_ += buffer_used_;
+        loop_->SubmitPending();
+    }
+    iovecs_.clear();
+    buffer_used_ = 0;
+    pending_size_ = 0;
+}
+
+}  // namespace MyLSMTree::SSTable
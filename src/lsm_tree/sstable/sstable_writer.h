@@ -0,0 +1,85 @@
+#pragma once
+
+#include <deque>
+#include <sys/uio.h>
+
+#include "../common.h"
+#include "../io/event_loop.h"
+
+namespace MyLSMTree::Memtable {
+class BloomFilter;
+}  // namespace MyLSMTree::Memtable
+
+namespace MyLSMTree::SSTable {
+
+// Streams an sstable (data blocks, filter block, index block and MetaBlock) into a file through a user-space buffer,
+// so the file is written with a few large syscalls instead of several small ones per record. A new data block starts
+// with the first record after block_size bytes of the previous one, unless the record continues the key before it.
+// With an event loop the writer is asynchronous: a full buffer is handed to the loop and the records go on into another
+// one while it is written. Its writes must be over before it is destroyed, WaitForWrites waits for them.
+class SSTableWriter {
+    struct Write {
+        std::vector<uint8_t> buffer;
+        IO::Future<void> done;
+    };
+
+public:
+    static constexpr size_t kDefaultBufferSize = 1 << 20;
+    // In vectored mode stable chunks at least this big are written from where they are instead of being copied.
+    static constexpr size_t kMinReferencedSize = 1024;
+    static constexpr size_t kDefaultBlockSize = 1 << 12;
+
+    // The vectored mode is off in the asynchronous one, where every byte is copied into the buffers.
+    explicit SSTableWriter(int fd, size_t buffer_size = kDefaultBufferSize, bool vectored = false,
+                           size_t block_size = kDefaultBlockSize, IO::EventLoop* loop = nullptr);
+    SSTableWriter(const SSTableWriter&) = delete;
+
+    // continues_key marks an older version of the key of the previous record.
+    void AddKV(KeyView key, ValueView value, SequenceNumber sequence, bool continues_key = false);
+    // Starts a record, its key and then its value have to be appended right after.
+    void AddKVSizes(KVSizes sizes, SequenceNumber sequence, bool continues_key = false);
+    void Append(const void* data, size_t size);
+    // Same as Append, but the caller guarantees that data stays valid and unchanged until the next Flush.
+    void AppendStable(const void* data, size_t size);
+    void Finish(const Memtable::BloomFilter& filter);
+    void Flush();
+    size_t GetWritesInFlight() const;
+    // Waits for the oldest writes until at most max_in_flight are left. The first error of the awaited writes is
+    // thrown once all of them are over.
+    IO::Task<void> WaitForWrites(size_t max_in_flight);
+    // Waits for all writes and flushes the file to the disk.
+    IO::Task<void> SyncAsync();
+
+    size_t GetKVCount() const;
+    Offset GetOffset() const;
+
+private:
+    void PushIovec(const void* data, size_t size);
+    // Copies the part of the appended bytes that belongs to the first key of the current block into the index.
+    void CaptureIndexKey(const void* data, size_t size);
+    // Hands the buffer to the loop and switches to a spare one.
+    void StartWrite();
+
+private:
+    std::vector<uint8_t> buffer_;
+    size_t buffer_used_ = 0;
+    std::vector<iovec> iovecs_;
+    size_t pending_size_ = 0;
+    // Offset, key size and first key of every data block.
+    std::vector<uint8_t> index_;
+    size_t index_key_remaining_ = 0;
+    size_t kv_count_ = 0;
+    size_t block_count_ = 0;
+    Offset block_offset_ = 0;
+    size_t block_size_;
+    int fd_;
+    off_t file_offset_;
+    Offset offset_ = 0;
+    bool vectored_;
+    IO::EventLoop* loop_;
+    // Writes in flight, the oldest first.
+    std::deque<Write> writes_;
+    std::vector<std::vector<uint8_t>> spare_buffers_;
+};
+
+}  // namespace MyLSMTree::SSTable
@@ -0,0 +1,222 @@
+#include "write_ahead_log.h"
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace MyLSMTree::WAL {
+
+namespace {
+
+struct RecordHeader {
+    // Hash of the sizes, the key and the value that follow the checksum.
+    uint64_t checksum;
+    KVSizes sizes;
+};
+
+std::runtime_error CantWriteLogError(const Path& path) {
+    return std::runtime_error(std::string("Can't write log with name ") + path.c_str() + ": " + std::strerror(errno));
+}
+
+void ThrowCantWriteLog(const Path& path) {
+    throw CantWriteLogError(path);
+}
+
+uint64_t CalculateChecksum(const uint8_t* data, size_t size) {
+    return CalculateHash(data, size).first;
+}
+
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(const Path& path, SyncMode sync_mode, std::chrono::milliseconds sync_interval)
+    : path_(path),
+      fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)),
+      sync_mode_(sync_mode),
+      sync_interval_(sync_interval) {
+    if (fd_ < 0) {
+        ThrowCantWriteLog(path_);
+    }
+    if (sync_mode_ == SyncMode::kPeriodic) {
+        sync_thread_ = std::thread(&WriteAheadLog::BackgroundSync, this);
+    }
+}
+
+WriteAheadLog::~WriteAheadLog() noexcept {
+    if (sync_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(sync_mtx_);
+            stopping_ = true;
+        }
+        sync_cv_.notify_one();
+        sync_thread_.join();
+        // Close() reports the failures of a rotated log, here only the tree's own teardown is left and nothing can be
+        // told anymore.
+        if (unsynced_) {
+            fdatasync(fd_);
+        }
+    }
+    close(fd_);
+}
+
+void WriteAheadLog::Close() {
+    std::unique_lock<std::mutex> lock(sync_mtx_);
+    if (!sync_thread_.joinable()) {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return;
+    }
+    stopping_ = true;
+    lock.unlock();
+    sync_cv_.notify_one();
+    sync_thread_.join();
+    lock.lock();
+    // The memtable may stay unflushed for a while after its log is rotated, so its tail is synced now.
+    if (unsynced_ && !error_ && fdatasync(fd_) != 0) {
+        error_ = std::make_exception_ptr(CantWriteLogError(path_));
+    }
+    unsynced_ = false;
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void WriteAheadLog::Append(const Key& key, const Value& value) {
+    size_t record_offset = batch_.size();
+    KVSizes sizes{static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+    batch_.resize(record_offset + sizeof(RecordHeader) + key.size() + value.size());
+    uint8_t* record = batch_.data() + record_offset;
+    std::memcpy(record + offsetof(RecordHeader, sizes), &sizes, sizeof(sizes));
+    // Empty keys and values may have no storage at all, and memcpy must not be given a null pointer.
+    if (!key.empty()) {
+        std::memcpy(record + sizeof(RecordHeader), key.data(), key.size());
+    }
+    if (!value.empty()) {
+        std::memcpy(record + sizeof(RecordHeader) + key.size(), value.data(), value.size());
+    }
+    uint64_t checksum = CalculateChecksum(record + offsetof(RecordHeader, sizes),
+                                          batch_.size() - record_offset - offsetof(RecordHeader, sizes));
+    std::memcpy(record + offsetof(RecordHeader, checksum), &checksum, sizeof(checksum));
+}
+
+void WriteAheadLog::Commit() {
+    if (std::exception_ptr error = GetError()) {
+        batch_.clear();
+        std::rethrow_exception(error);
+    }
+    const uint8_t* data = batch_.data();
+    size_t size = batch_.size();
+    while (size) {
+        ssize_t written = write(fd_, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            FailCommit(false);
+        }
+        data += written;
+        size -= written;
+    }
+
+    if (sync_mode_ == SyncMode::kEveryWrite) {
+        if (fdatasync(fd_) != 0) {
+            FailCommit(true);
+        }
+    } else if (sync_mode_ == SyncMode::kPeriodic) {
+        std::lock_guard<std::mutex> guard(sync_mtx_);
+        unsynced_ = true;
+    }
+    size_ += batch_.size();
+    batch_.clear();
+}
+
+void WriteAheadLog::FailCommit(bool sync_failed) {
+    // The writers of the batch get an error, so none of its records may be replayed. Replay also stops at a torn
+    // record, which would drop every later write. The log is cut back to the last commit, and if even that fails, no
+    // commit succeeds anymore. Neither does one after a failed sync: the kernel may have dropped pages of earlier
+    // commits and clears the error on report, so a later sync would succeed without bringing them back.
+    auto error = CantWriteLogError(path_);
+    batch_.clear();
+    if (sync_failed || ftruncate(fd_, size_) != 0 || (sync_mode_ == SyncMode::kEveryWrite && fdatasync(fd_) != 0)) {
+        std::lock_guard<std::mutex> guard(sync_mtx_);
+        error_ = std::make_exception_ptr(error);
+    }
+    throw error;
+}
+
+void WriteAheadLog::Sync() {
+    if (std::exception_ptr error = GetError()) {
+        std::rethrow_exception(error);
+    }
+    if (fdatasync(fd_) != 0) {
+        auto error = CantWriteLogError(path_);
+        std::lock_guard<std::mutex> guard(sync_mtx_);
+        error_ = std::make_exception_ptr(error);
+        throw error;
+    }
+}
+
+std::exception_ptr WriteAheadLog::GetError() {
+    std::lock_guard<std::mutex> guard(sync_mtx_);
+    return error_;
+}
+
+size_t WriteAheadLog::GetBatchSizeInBytes() const {
+    return batch_.size();
+}
+
+void WriteAheadLog::Replay(const Path& path, const std::function<void(const Key&, const Value&)>& callback) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    std::vector<uint8_t> log;
+    uint8_t chunk[1 << 16];
+    ssize_t r;
+    while ((r = read(fd, chunk, sizeof(chunk))) > 0) {
+        log.insert(log.end(), chunk, chunk + r);
+    }
+    close(fd);
+
+    Key key;
+    Value value;
+    size_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= log.size()) {
+        RecordHeader header;
+        std::memcpy(&header, log.data() + offset, sizeof(header));
+        size_t record_size = sizeof(header) + header.sizes.key_size + header.sizes.value_size;
+        if (log.size() - offset < record_size ||
+            CalculateChecksum(log.data() + offset + offsetof(RecordHeader, sizes),
+                              record_size - offsetof(RecordHeader, sizes)) != header.checksum) {
+            break;
+        }
+        const uint8_t* key_data = log.data() + offset + sizeof(header);
+        key.assign(key_data, key_data + header.sizes.key_size);
+        value.assign(key_data + header.sizes.key_size, key_data + header.sizes.key_size + header.sizes.value_size);
+        callback(key, value);
+        offset += record_size;
+    }
+}
+
+void WriteAheadLog::BackgroundSync() {
+    std::unique_lock<std::mutex> lock(sync_mtx_);
+    while (!stopping_) {
+        sync_cv_.wait_for(lock, sync_interval_, [this] { return stopping_; });
+        if (unsynced_ && !error_) {
+            unsynced_ = false;
+            lock.unlock();
+            if (fdatasync(fd_) != 0) {
+                auto error = CantWriteLogError(path_);
+                lock.lock();
+                // These commits are already acknowledged, the next one reports the loss.
+                error_ = std::make_exception_ptr(error);
+                continue;
+            }
+            lock.lock();
+        }
+    }
+}
+
+}  // namespace MyLSMTree::WAL
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "../common.h"
+
+namespace MyLSMTree::WAL {
+
+enum class SyncMode : uint8_t {
+    // fdatasync after every group commit.
+    kEveryWrite,
+    // fdatasync from a background thread every sync interval if something was written since the last sync.
+    kPeriodic,
+    // Leave it to the page cache.
+    kNone,
+};
+
+// Log of the writes that are only in a memtable. Records are appended to an in-memory batch and the whole batch goes
+// to the file with one write() in Commit(), so a group of concurrent writers costs a single syscall and sync.
+class WriteAheadLog {
+public:
+    WriteAheadLog(const Path& path, SyncMode sync_mode, std::chrono::milliseconds sync_interval);
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    ~WriteAheadLog() noexcept;
+
+    void Append(const Key& key, const Value& value);
+    void Commit();
+    // Makes everything committed durable whatever the sync mode.
+    void Sync();
+    // Stops the background sync of a rotated log and syncs what it left. Throws if any sync of the log has failed.
+    void Close();
+    size_t GetBatchSizeInBytes() const;
+
+    // Calls callback for every complete record of the log, stops at the first torn or corrupted one.
+    static void Replay(const Path& path, const std::function<void(const Key&, const Value&)>& callback);
+
+private:
+    [[noreturn]] void FailCommit(bool sync_failed);
+    std::exception_ptr GetError();
+    void BackgroundSync();
+
+private:
+    std::vector<uint8_t> batch_;
+    Path path_;
+    int fd_;
+    // Length of the log up to the end of the last successful commit.
+    size_t size_ = 0;
+    // Set when a failed commit couldn't be cut off the log or any sync failed, every later commit rethrows it. Guarded
+    // by sync_mtx_.
+    std::exception_ptr error_;
+    SyncMode sync_mode_;
+    std::chrono::milliseconds sync_interval_;
+    std::mutex sync_mtx_;
+    std::condition_variable sync_cv_;
+    bool unsynced_ = false;
+    bool stopping_ = false;
+    std::thread sync_thread_;
+};
+
+}  // namespace MyLSMTree::WAL
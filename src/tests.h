@@ -1,12 +1,24 @@
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <csignal>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <random>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "lsm_tree/io/event_loop.h"
 #include "lsm_tree/lsm_tree.h"
 #include "lsm_tree/memtable/memtable.h"
+#include "lsm_tree/memtable/bloom_filter/bloom_filter.h"
+#include "lsm_tree/sstable/sstable_reader.h"
+#include "lsm_tree/sstable/sstable_writer.h"
 #include "lsm_tree/common.h"
 
 namespace Test {
@@ -36,6 +48,55 @@ bool IsInRange(const KeyRange& range, const Key& key) {
            (!range.upper.has_value() || (range.including_upper ? key <= *range.upper : key < *range.upper));
 }
 
+// Live records of the range in the sstable, walked with its iterator like the range lookups of the tree do.
+RangeLookupResult ScanSSTable(const SSTable::SSTableReadersManager::SSTableReader& reader, const KeyRange& range) {
+    RangeLookupResult res;
+    auto it = reader.NewIterator();
+    if (range.lower.has_value()) {
+        it.Seek(*range.lower);
+    } else {
+        it.SeekToFirst();
+    }
+    for (; it.IsValid(); it.Next()) {
+        Key key(it.GetKey().begin(), it.GetKey().end());
+        if (!IsInRange(range, key)) {
+            if (range.lower.has_value() && key == *range.lower) {
+                continue;
+            }
+            break;
+        }
+        if (!it.GetValue().empty()) {
+            res.emplace(std::move(key), Value(it.GetValue().begin(), it.GetValue().end()));
+        }
+    }
+    return res;
+}
+
+std::map<Key, Value> GenerateRandomKVs(std::mt19937& gen, size_t kvs_cnt, size_t max_key_size, size_t max_value_size) {
+    std::map<Key, Value> kvs;
+    for (size_t j = 0; j < kvs_cnt; ++j) {
+        kvs[GenerateRandomKey(gen, max_key_size)] = GenerateRandomValue(gen, max_value_size, false);
+    }
+    return kvs;
+}
+
+void WriteSSTable(const Path& path, const std::map<Key, Value>& kvs,
+                  size_t buffer_size = SSTable::SSTableWriter::kDefaultBufferSize, bool vectored = false,
+                  size_t block_size = SSTable::SSTableWriter::kDefaultBlockSize) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    Memtable::BloomFilter filter(kvs.size() * 8 + 64, 4);
+    {
+        SSTable::SSTableWriter writer(fd, buffer_size, vectored, block_size);
+        for (const auto& [key, value] : kvs) {
+            writer.AddKV(key, value, 0);
+            filter.Insert(key);
+        }
+        writer.Finish(filter);
+    }
+    close(fd);
+}
+
 }  // namespace
 
 const std::vector<void (*)()> tests = {
@@ -57,13 +118,15 @@ const std::vector<void (*)()> tests = {
                 }
             }
 
-            BloomFilter filter(3000, 6);
-            for (size_t j = 0; j < data.size(); ++j) {
-                filter.Insert(data[j]);
-            }
+            for (auto type : {MyLSMTree::FilterType::kStandard, MyLSMTree::FilterType::kBlocked}) {
+                BloomFilter filter(3000, 6, type);
+                for (size_t j = 0; j < data.size(); ++j) {
+                    filter.Insert(data[j]);
+                }
 
-            for (size_t j = 0; j < data.size(); ++j) {
-                assert(filter.Find(data[j]));
+                for (size_t j = 0; j < data.size(); ++j) {
+                    assert(filter.Find(data[j]));
+                }
             }
             std::cout << "Test_BloomFilter_Correctness " << i << " OK" << std::endl;
         }
@@ -96,15 +159,12 @@ const std::vector<void (*)()> tests = {
                     }
                 } while (duplicate);
             }
-            size_t filter_bits_count = 10000;
-            size_t filter_hash_func_count = 10;
             size_t kv_count_limit = 100000;
             uint32_t kv_buffer_slice_size = 10000;
             std::mt19937::result_type list_rng_seed = 6;
-            Memtable::Memtable table(filter_bits_count, filter_hash_func_count, kv_count_limit, kv_buffer_slice_size,
-                                     list_rng_seed);
+            Memtable::Memtable table(kv_count_limit, kv_buffer_slice_size, list_rng_seed);
             for (size_t j = 0; j < kvs_cnt; ++j) {
-                table.Insert(keys[j], vals[j]);
+                table.Insert(keys[j], vals[j], j + 1);
             }
 
             for (size_t j = 0; j < kvs_cnt; ++j) {
@@ -127,7 +187,7 @@ const std::vector<void (*)()> tests = {
             }
 
             for (size_t j = 0; j < kvs_cnt; j += 2) {
-                table.Erase(keys[j]);
+                table.Erase(keys[j], kvs_cnt + j + 1);
             }
 
             for (size_t j = 0; j < kvs_cnt; ++j) {
@@ -174,15 +234,12 @@ const std::vector<void (*)()> tests = {
                     }
                 } while (duplicate);
             }
-            size_t filter_bits_count = 10000;
-            size_t filter_hash_func_count = 10;
             size_t kv_count_limit = 100000;
             uint32_t kv_buffer_slice_size = 10000;
             std::mt19937::result_type list_rng_seed = 6;
-            Memtable::Memtable table(filter_bits_count, filter_hash_func_count, kv_count_limit, kv_buffer_slice_size,
-                                     list_rng_seed);
+            Memtable::Memtable table(kv_count_limit, kv_buffer_slice_size, list_rng_seed);
             for (size_t j = 0; j < kvs_cnt; ++j) {
-                table.Insert(kvs[j].key, kvs[j].value);
+                table.Insert(kvs[j].key, kvs[j].value, j + 1);
             }
 
             std::sort(kvs.begin(), kvs.end(), [](const auto& a, const auto& b) { return a.key < b.key; });
@@ -605,6 +662,2000 @@ const std::vector<void (*)()> tests = {
 
             std::cout << "Test_LSMTree_Save_Load_Correctness " << i << " OK" << std::endl;
         }
+    },
+    [] /*Test_LSMTree_WAL_Recovery*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 3000;
+        size_t max_key_size = 3;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 100; ++i) {
+            Path tree_data = "tree_data.data";
+            LSMTreeOptions options{.fd_cache_size = 10,
+                                   .sstable_scaling_factor = 5,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1000,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 10,
+                                   .level0_stop_trigger = 15,
+                                   .wal_sync_mode = WAL::SyncMode::kEveryWrite};
+
+            auto apply_ops = [&](std::map<Key, Value>& map, LSMTree* tree) {
+                std::mt19937 gen(i + 200);
+                for (size_t j = 0; j < kvs_cnt; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        if (tree) {
+                            tree->Erase(key);
+                        }
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        if (tree) {
+                            tree->Insert(key, value);
+                        }
+                    }
+                }
+            };
+
+            // The child process dies without running any destructor, as if the machine crashed after the writes.
+            pid_t pid = fork();
+            if (pid == 0) {
+                std::map<Key, Value> map;
+                LSMTree tree(options, tree_data);
+                apply_ops(map, &tree);
+                _exit(0);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+            std::map<Key, Value> map;
+            apply_ops(map, nullptr);
+            LSMTree tree(tree_data);
+            for (const auto& [key, value] : map) {
+                auto tree_ans = tree.Find(key);
+                assert(tree_ans.has_value());
+                assert(*tree_ans == value);
+            }
+            KeyRange range{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false, .including_upper = false};
+            assert(tree.FindRange(range) == map);
+
+            std::cout << "Test_LSMTree_WAL_Recovery " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_SSTable_Formats*/ () {
+        using namespace MyLSMTree;
+        using Memtable::BloomFilter;
+        using SSTable::SSTableReadersManager;
+
+        size_t kvs_cnt = 2000;
+        size_t max_key_size = 4;
+        size_t max_value_size = 100;
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 300);
+            std::map<Key, Value> kvs;
+            while (kvs.size() < kvs_cnt) {
+                kvs[GenerateRandomKey(gen, max_key_size)] = GenerateRandomValue(gen, max_value_size, true);
+            }
+            BloomFilter filter(kvs_cnt * 8, 4);
+            BloomFilter blocked_filter(kvs_cnt * 8, 4, FilterType::kBlocked);
+            for (const auto& [key, value] : kvs) {
+                filter.Insert(key);
+                blocked_filter.Insert(key);
+            }
+
+            // The legacy format indexes every record and has no format version.
+            Path legacy_path = "legacy.sst";
+            int fd = open(legacy_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            std::vector<uint8_t> file;
+            std::vector<Offset> offsets;
+            for (const auto& [key, value] : kvs) {
+                offsets.emplace_back(file.size());
+                KVSizes sizes{static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+                file.insert(file.end(), reinterpret_cast<uint8_t*>(&sizes),
+                            reinterpret_cast<uint8_t*>(&sizes) + sizeof(sizes));
+                file.insert(file.end(), key.begin(), key.end());
+                file.insert(file.end(), value.begin(), value.end());
+            }
+            MetaBlock meta{.filter_offset = file.size(),
+                           .filter_bits_count = filter.BitsCount(),
+                           .filter_hash_func_count = filter.HashFuncCount(),
+                           .index_offset = file.size() + filter.GetSizeInBytes(),
+                           .kv_count = kvs.size(),
+                           .block_count = 0,
+                           .format_version = kSSTableFormatLegacy,
+                           .magic = 0};
+            const auto* filter_bytes = reinterpret_cast<const uint8_t*>(filter.Data());
+            file.insert(file.end(), filter_bytes, filter_bytes + filter.GetSizeInBytes());
+            file.insert(file.end(), reinterpret_cast<uint8_t*>(offsets.data()),
+                        reinterpret_cast<uint8_t*>(offsets.data() + offsets.size()));
+            file.insert(file.end(), reinterpret_cast<uint8_t*>(&meta),
+                        reinterpret_cast<uint8_t*>(&meta) + kLegacyMetaBlockSize);
+            assert(write(fd, file.data(), file.size()) == static_cast<ssize_t>(file.size()));
+            close(fd);
+
+            Path block_path = "blocks.sst";
+            fd = open(block_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            {
+                SSTable::SSTableWriter writer(fd, 1 << 12, false, 1 + gen() % 512);
+                for (const auto& [key, value] : kvs) {
+                    writer.AddKV(key, value, 0);
+                }
+                writer.Finish(i % 2 ? filter : blocked_filter);
+            }
+            close(fd);
+
+            size_t block_cache_size = i % 2 ? 1 << 20 : 0;
+            bool use_mmap = i % 4 == 3;
+            SSTableReadersManager manager(1, 1 << 10, SSTableReadersManager::kDefaultScanReadaheadSize,
+                                          block_cache_size, use_mmap);
+            for (const auto& path : {legacy_path, block_path}) {
+                auto reader = manager.CreateReader(path);
+                assert(reader.GetKVCount() == kvs.size());
+                for (const auto& [key, value] : kvs) {
+                    auto [hash_low, hash_high] = CalculateHash(key.data(), key.size());
+                    assert(reader.TestHashes(hash_low, hash_high));
+                    assert(reader.Find(key).first == value);
+                    assert(reader.Find(key).first == value);
+                }
+                for (size_t j = 0; j < 100; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size + 1);
+                    auto it = kvs.find(key);
+                    assert(reader.Find(key).first == (it == kvs.end() ? LookupResult() : LookupResult(it->second)));
+                }
+                for (size_t p = 0; p < 16; ++p) {
+                    KeyRange range{.lower = std::nullopt,
+                                   .upper = std::nullopt,
+                                   .including_lower = (p & 1) != 0,
+                                   .including_upper = (p & 2) != 0};
+                    if (p & 4) {
+                        range.lower = GenerateRandomKey(gen, max_key_size);
+                    }
+                    if (p & 8) {
+                        range.upper = GenerateRandomKey(gen, max_key_size);
+                    }
+                    RangeLookupResult correct_answer;
+                    for (const auto& [key, value] : kvs) {
+                        if (IsInRange(range, key) && !value.empty()) {
+                            correct_answer[key] = value;
+                        }
+                    }
+                    assert(ScanSSTable(reader, range) == correct_answer);
+                }
+            }
+            auto statistics = manager.GetBlockCacheStatistics();
+            assert(statistics.usage <= block_cache_size);
+            assert(block_cache_size && !use_mmap ? statistics.hits >= kvs.size() * 2 : statistics.hits == 0);
+            manager.Unlink(legacy_path);
+            manager.Unlink(block_path);
+
+            std::cout << "Test_SSTable_Formats " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_Memtable_Overwrite*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 5000;
+        size_t hot_key_count = 32;
+        size_t max_value_size = 50;
+
+        for (size_t i = 0; i < 20; ++i) {
+            std::mt19937 gen(i + 300);
+            // Small slices, so keys and values span slice boundaries.
+            Memtable::Memtable table(1000, 7);
+            for (size_t round = 0; round < 2; ++round) {
+                std::map<Key, Value> map;
+                size_t value_bytes_written = 0;
+                for (size_t j = 0; j < kvs_cnt; ++j) {
+                    Key key{static_cast<uint8_t>(gen() % hot_key_count)};
+                    Value value = GenerateRandomValue(gen, max_value_size, true);
+                    map[key] = value;
+                    table.Insert(key, value, j + 1);
+                    value_bytes_written += value.size();
+                }
+                size_t live_size = 0;
+                size_t live_value_size = 0;
+                for (const auto& [key, value] : map) {
+                    assert(table.Find(key) == value);
+                    live_size += key.size() + value.size();
+                    live_value_size += value.size();
+                }
+                assert(table.GetKVCount() == map.size());
+                size_t garbage_size = table.GetGarbageSizeInBytes();
+                // Every overwritten value is garbage, and the garbage is part of the memory of the memtable.
+                assert(garbage_size >= value_bytes_written - live_value_size);
+                assert(garbage_size + live_size <= table.GetMemoryUsage());
+                table.Clear();
+                assert(table.GetKVCount() == 0 && table.GetGarbageSizeInBytes() == 0);
+            }
+
+            std::cout << "Test_Memtable_Overwrite " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Memtable_Size_Limit*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 2000;
+        size_t max_key_size = 3;
+        size_t max_value_size = 3000;
+
+        for (size_t i = 0; i < 20; ++i) {
+            std::mt19937 gen(i + 400);
+            // Only the byte limit is ever reached, so every flush sizes the filter for a different number of keys.
+            LSMTreeOptions options{.fd_cache_size = 10,
+                                   .sstable_scaling_factor = 4,
+                                   .memtable_kv_count_limit = 1'000'000,
+                                   .memtable_size_limit = size_t{1} << (14 + i % 4),
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .filter_type = i % 2 ? FilterType::kBlocked : FilterType::kStandard};
+            std::map<Key, Value> map;
+            LSMTree tree(options, "tree_data.data");
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                Key key = GenerateRandomKey(gen, max_key_size);
+                // Mostly small values with a few large ones, so memtables hold very different numbers of keys.
+                Value value = GenerateRandomValue(gen, gen() % 8 ? 20 : max_value_size, true);
+                if (value.empty()) {
+                    map.erase(key);
+                    tree.Erase(key);
+                } else {
+                    map[key] = value;
+                    tree.Insert(key, value);
+                }
+            }
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                Key key = GenerateRandomKey(gen, max_key_size);
+                auto it = map.find(key);
+                LookupResult res = tree.Find(key);
+                assert(it == map.end() ? !res.has_value() : res == it->second);
+            }
+            for (const auto& [key, value] : map) {
+                assert(tree.Find(key) == value);
+            }
+            assert(tree.FindRange({}) == RangeLookupResult(map.begin(), map.end()));
+
+            std::cout << "Test_LSMTree_Memtable_Size_Limit " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_Memtable_Concurrent_Insert*/ () {
+        using namespace MyLSMTree;
+
+        size_t thread_count = 4;
+        size_t kvs_per_thread = 2000;
+        size_t max_key_size = 12;
+        size_t max_value_size = 30;
+
+        for (size_t i = 0; i < 20; ++i) {
+            // Every thread writes its own keys, the first byte of a key is the number of its thread.
+            std::vector<std::map<Key, Value>> maps(thread_count);
+            for (size_t t = 0; t < thread_count; ++t) {
+                std::mt19937 gen(i * thread_count + t + 500);
+                for (size_t j = 0; j < kvs_per_thread; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    key.insert(key.begin(), static_cast<uint8_t>(t));
+                    maps[t][key] = GenerateRandomValue(gen, max_value_size, true);
+                }
+            }
+            Memtable::Memtable table(thread_count * kvs_per_thread, 64, i);
+            std::atomic<size_t> finished_count = 0;
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < thread_count; ++t) {
+                threads.emplace_back([&, t] {
+                    // Every key is written twice, so overwrites race with the lookups too.
+                    for (size_t round = 0; round < 2; ++round) {
+                        for (const auto& [key, value] : maps[t]) {
+                            table.Insert(key, round ? value : Value{1}, round + 1);
+                        }
+                    }
+                    ++finished_count;
+                });
+            }
+            // Lookups run alongside the writers and see either nothing, the first or the final value of a key.
+            std::mt19937 gen(i + 600);
+            while (finished_count < thread_count) {
+                const auto& map = maps[gen() % thread_count];
+                auto it = std::next(map.begin(), gen() % map.size());
+                LookupResult res = table.Find(it->first);
+                assert(!res || *res == Value{1} || *res == it->second);
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+
+            size_t kv_count = 0;
+            RangeLookupResult correct_answer;
+            for (const auto& map : maps) {
+                for (const auto& [key, value] : map) {
+                    assert(table.Find(key) == value);
+                    if (!value.empty()) {
+                        correct_answer[key] = value;
+                    }
+                }
+                kv_count += map.size();
+            }
+            assert(table.GetKVCount() == kv_count);
+            assert(table.FindRange({}) == correct_answer);
+
+            std::cout << "Test_Memtable_Concurrent_Insert " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Concurrent_Reads*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 20000;
+        size_t reader_count = 3;
+
+        auto make_key = [](size_t j) {
+            Key key(sizeof(j));
+            std::memcpy(key.data(), &j, sizeof(j));
+            return key;
+        };
+        auto make_value = [](size_t j) { return Value(j % 50 + 1, static_cast<uint8_t>(j)); };
+
+        for (size_t i = 0; i < 5; ++i) {
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .sstable_scaling_factor = 4,
+                                   .memtable_kv_count_limit = 300,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .compaction_thread_count = 2,
+                                   .level0_slowdown_trigger = 8,
+                                   .level0_stop_trigger = 12};
+            LSMTree tree(options, "tree_data.data");
+            // Keys below written_count are in the tree, while flushes and compactions replace the sstables under the
+            // readers.
+            std::atomic<size_t> written_count = 0;
+            std::vector<std::thread> readers;
+            for (size_t r = 0; r < reader_count; ++r) {
+                readers.emplace_back([&, r] {
+                    std::mt19937 gen(i * reader_count + r + 700);
+                    while (written_count < kvs_cnt) {
+                        size_t count = written_count;
+                        if (!count) {
+                            continue;
+                        }
+                        size_t j = gen() % count;
+                        assert(tree.Find(make_key(j)) == make_value(j));
+                        if (gen() % 100 == 0) {
+                            KeyRange range{.lower = make_key(j), .upper = std::nullopt, .including_lower = true,
+                                           .including_upper = false};
+                            assert(tree.FindRange(range).at(make_key(j)) == make_value(j));
+                        }
+                    }
+                });
+            }
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                tree.Insert(make_key(j), make_value(j));
+                written_count = j + 1;
+            }
+            for (auto& reader : readers) {
+                reader.join();
+            }
+            assert(tree.FindRange({}).size() == kvs_cnt);
+
+            std::cout << "Test_LSMTree_Concurrent_Reads " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Snapshots*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 4000;
+        size_t key_count = 300;
+        size_t snapshot_interval = 250;
+        size_t max_value_size = 20;
+
+        auto make_key = [](size_t k) { return Key{static_cast<uint8_t>(k >> 8), static_cast<uint8_t>(k)}; };
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 800);
+            Path tree_data = "tree_data.data";
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .sstable_scaling_factor = 2,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 4,
+                                   .level0_stop_trigger = 6};
+            std::map<Key, Value> map;
+            auto apply_ops = [&](LSMTree& tree, size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = make_key(gen() % key_count);
+                    if (gen() % 5 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            auto check = [&](const LSMTree& tree, const std::map<Key, Value>& state, const Snapshot* snapshot) {
+                for (size_t k = 0; k < key_count; ++k) {
+                    Key key = make_key(k);
+                    auto it = state.find(key);
+                    LookupResult res = snapshot ? tree.Find(key, *snapshot) : tree.Find(key);
+                    assert(res == (it == state.end() ? LookupResult() : LookupResult(it->second)));
+                }
+                KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                             .including_upper = false};
+                assert((snapshot ? tree.FindRange(all, *snapshot) : tree.FindRange(all)) == state);
+            };
+
+            {
+                LSMTree tree(options, tree_data);
+                // Hot keys get many versions, which flushes and compactions may only drop once no snapshot sees them.
+                std::vector<std::pair<Snapshot, std::map<Key, Value>>> snapshots;
+                for (size_t j = 0; j < kvs_cnt; j += snapshot_interval) {
+                    apply_ops(tree, snapshot_interval);
+                    snapshots.emplace_back(tree.GetSnapshot(), map);
+                    if (j % (snapshot_interval * 4) == 0 && snapshots.size() > 2) {
+                        tree.ReleaseSnapshot(snapshots[snapshots.size() - 3].first);
+                        snapshots.erase(snapshots.end() - 3);
+                    }
+                }
+                for (const auto& [snapshot, state] : snapshots) {
+                    check(tree, state, &snapshot);
+                }
+                check(tree, map, nullptr);
+                for (const auto& [snapshot, state] : snapshots) {
+                    tree.ReleaseSnapshot(snapshot);
+                }
+                apply_ops(tree, kvs_cnt / 4);
+                check(tree, map, nullptr);
+            }
+
+            // Writes after a reopen must be newer than everything persisted, or compactions would revive old values.
+            LSMTree tree(tree_data);
+            Snapshot snapshot = tree.GetSnapshot();
+            std::map<Key, Value> reopened_state = map;
+            apply_ops(tree, kvs_cnt);
+            check(tree, map, nullptr);
+            check(tree, reopened_state, &snapshot);
+            tree.ReleaseSnapshot(snapshot);
+
+            std::cout << "Test_LSMTree_Snapshots " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Iterator*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 3000;
+        size_t max_key_size = 2;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 900);
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9};
+            LSMTree tree(options, "tree_data.data");
+            std::map<Key, Value> map;
+            auto apply_ops = [&](size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            apply_ops(kvs_cnt);
+
+            for (size_t p = 0; p < 32; ++p) {
+                KeyRange range{.lower = std::nullopt,
+                               .upper = std::nullopt,
+                               .including_lower = (p & 1) != 0,
+                               .including_upper = (p & 2) != 0};
+                if (p & 4) {
+                    range.lower = GenerateRandomKey(gen, max_key_size);
+                }
+                if (p & 8) {
+                    range.upper = GenerateRandomKey(gen, max_key_size);
+                }
+                std::vector<std::pair<Key, Value>> correct_answer;
+                for (const auto& [key, value] : map) {
+                    if (IsInRange(range, key)) {
+                        correct_answer.emplace_back(key, value);
+                    }
+                }
+                // A scan may stop at any point.
+                size_t limit = p & 16 ? std::min<size_t>(gen() % 20, correct_answer.size()) : correct_answer.size();
+                auto it = tree.NewIterator(range);
+                for (size_t j = 0; j < limit; ++j, it.Next()) {
+                    assert(it.IsValid());
+                    assert(Key(it.GetKey().begin(), it.GetKey().end()) == correct_answer[j].first);
+                    assert(Value(it.GetValue().begin(), it.GetValue().end()) == correct_answer[j].second);
+                }
+                assert(it.IsValid() == (limit < correct_answer.size()));
+
+                for (size_t j = 0; j < 20; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    it.Seek(key);
+                    auto correct = std::find_if(correct_answer.begin(), correct_answer.end(),
+                                                [&key](const auto& kv) { return kv.first >= key; });
+                    assert(it.IsValid() == (correct != correct_answer.end()));
+                    if (it.IsValid()) {
+                        assert(Key(it.GetKey().begin(), it.GetKey().end()) == correct->first);
+                    }
+                }
+            }
+
+            // Flushes and compactions that run while an iterator is open don't change what it sees.
+            std::map<Key, Value> old_map = map;
+            auto it = tree.NewIterator({});
+            apply_ops(kvs_cnt);
+            for (const auto& [key, value] : old_map) {
+                assert(it.IsValid());
+                assert(Key(it.GetKey().begin(), it.GetKey().end()) == key);
+                assert(Value(it.GetValue().begin(), it.GetValue().end()) == value);
+                it.Next();
+            }
+            assert(!it.IsValid());
+            assert(tree.FindRange({}) == map);
+
+            std::cout << "Test_LSMTree_Iterator " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Reverse_Iterator*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 3000;
+        size_t max_key_size = 2;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 1000);
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .mmap_sstable_reads = i % 2 == 1,
+                                   .sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9};
+            LSMTree tree(options, "tree_data.data");
+            std::map<Key, Value> map;
+            auto apply_ops = [&](size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            apply_ops(kvs_cnt);
+            // The sstables written from now on keep the versions that the snapshot sees.
+            std::map<Key, Value> old_map = map;
+            Snapshot snapshot = tree.GetSnapshot();
+            apply_ops(kvs_cnt);
+
+            for (size_t p = 0; p < 32; ++p) {
+                KeyRange range{.lower = std::nullopt,
+                               .upper = std::nullopt,
+                               .including_lower = (p & 1) != 0,
+                               .including_upper = (p & 2) != 0};
+                if (p & 4) {
+                    range.lower = GenerateRandomKey(gen, max_key_size);
+                }
+                if (p & 8) {
+                    range.upper = GenerateRandomKey(gen, max_key_size);
+                }
+                const auto& model = p & 16 ? old_map : map;
+                std::vector<std::pair<Key, Value>> correct_answer;
+                for (const auto& [key, value] : model) {
+                    if (IsInRange(range, key)) {
+                        correct_answer.emplace_back(key, value);
+                    }
+                }
+                auto it = p & 16 ? tree.NewIterator(range, snapshot) : tree.NewIterator(range);
+                it.SeekToLast();
+                for (size_t j = correct_answer.size() - 1; ~j; --j, it.Prev()) {
+                    assert(it.IsValid());
+                    assert(Key(it.GetKey().begin(), it.GetKey().end()) == correct_answer[j].first);
+                    assert(Value(it.GetValue().begin(), it.GetValue().end()) == correct_answer[j].second);
+                }
+                assert(!it.IsValid());
+
+                for (size_t j = 0; j < 20; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    it.SeekForPrev(key);
+                    auto correct = std::find_if(correct_answer.rbegin(), correct_answer.rend(),
+                                                [&key](const auto& kv) { return kv.first <= key; });
+                    assert(it.IsValid() == (correct != correct_answer.rend()));
+                    if (!it.IsValid()) {
+                        continue;
+                    }
+                    assert(Key(it.GetKey().begin(), it.GetKey().end()) == correct->first);
+
+                    // Turning around at any point.
+                    size_t index = correct_answer.rend() - correct - 1;
+                    for (size_t step = 0; step < 10 && it.IsValid(); ++step) {
+                        if (gen() % 2) {
+                            it.Next();
+                            ++index;
+                        } else {
+                            it.Prev();
+                            --index;
+                        }
+                        assert(it.IsValid() == (index < correct_answer.size()));
+                        if (it.IsValid()) {
+                            assert(Key(it.GetKey().begin(), it.GetKey().end()) == correct_answer[index].first);
+                            assert(Value(it.GetValue().begin(), it.GetValue().end()) == correct_answer[index].second);
+                        }
+                    }
+                }
+            }
+            tree.ReleaseSnapshot(snapshot);
+
+            std::cout << "Test_LSMTree_Reverse_Iterator " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_MultiGet*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 3000;
+        size_t max_key_size = 2;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 1100);
+            // Blocks come from the mapping, from the file with the block cache and from the file without it.
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .block_cache_size = i % 3 == 2 ? 0 : size_t(1) << 20,
+                                   .mmap_sstable_reads = i % 3 == 1,
+                                   .sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9};
+            LSMTree tree(options, "tree_data.data");
+            std::map<Key, Value> map;
+            auto apply_ops = [&](size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            auto check_batches = [&](const std::map<Key, Value>& model, const Snapshot* snapshot) {
+                for (size_t j = 0; j < 50; ++j) {
+                    // Batches may repeat keys.
+                    std::vector<Key> keys(gen() % 300);
+                    for (auto& key : keys) {
+                        key = GenerateRandomKey(gen, max_key_size);
+                    }
+                    auto res = snapshot ? tree.MultiGet(keys, *snapshot) : tree.MultiGet(keys);
+                    assert(res.size() == keys.size());
+                    for (size_t k = 0; k < keys.size(); ++k) {
+                        auto it = model.find(keys[k]);
+                        assert(res[k] == (it == model.end() ? LookupResult() : LookupResult(it->second)));
+                        assert(res[k] == (snapshot ? tree.Find(keys[k], *snapshot) : tree.Find(keys[k])));
+                    }
+                }
+            };
+
+            apply_ops(kvs_cnt);
+            std::map<Key, Value> old_map = map;
+            Snapshot snapshot = tree.GetSnapshot();
+            apply_ops(kvs_cnt);
+            check_batches(map, nullptr);
+            check_batches(old_map, &snapshot);
+            tree.ReleaseSnapshot(snapshot);
+
+            std::cout << "Test_LSMTree_MultiGet " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_Memtable_MultiFind*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 5000;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 1200);
+            // Small slices, so keys and values span slice boundaries.
+            Memtable::Memtable table(kvs_cnt, 7);
+            assert(table.MultiFind(std::vector<const Key*>{}).empty());
+            // Keys share a few prefixes of 8 bytes, so most of them are told apart by the bytes in the kv buffer.
+            std::vector<Key> prefixes(4);
+            for (auto& prefix : prefixes) {
+                prefix = GenerateRandomKey(gen, 1);
+                prefix.resize(8, prefix[0]);
+            }
+            auto generate_key = [&]() {
+                Key key = prefixes[gen() % prefixes.size()];
+                key.resize(gen() % 12 + 1 + (gen() % 4 == 0 ? 0 : 8));
+                for (size_t k = 8; k < key.size(); ++k) {
+                    key[k] = gen() % 4;
+                }
+                return key;
+            };
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                Key key = generate_key();
+                if (gen() % 4 == 0) {
+                    table.Erase(key, j + 1);
+                } else {
+                    table.Insert(key, GenerateRandomValue(gen, max_value_size, false), j + 1);
+                }
+            }
+
+            for (size_t j = 0; j < 50; ++j) {
+                std::vector<Key> keys(gen() % 100);
+                for (auto& key : keys) {
+                    key = generate_key();
+                }
+                std::vector<const Key*> key_pointers;
+                for (const auto& key : keys) {
+                    key_pointers.emplace_back(&key);
+                }
+                SequenceNumber snapshot = j % 2 ? gen() % kvs_cnt : kMaxSequenceNumber;
+                auto res = table.MultiFind(key_pointers, snapshot);
+                assert(res.size() == keys.size());
+                for (size_t k = 0; k < keys.size(); ++k) {
+                    assert(res[k] == table.Find(keys[k], snapshot));
+                }
+            }
+
+            std::cout << "Test_Memtable_MultiFind " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Async*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 3000;
+        size_t max_key_size = 2;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 1300);
+            // A short queue, so most of the reads wait for room in it.
+            IO::EventLoop loop(8, 3, i % 2 == 0);
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .block_cache_size = i % 3 == 2 ? 0 : size_t(1) << 20,
+                                   .mmap_sstable_reads = i % 3 == 1,
+                                   .sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9,
+                                   // Below the block size, so range lookups read most sstables in several chunks.
+                                   .scan_readahead_size = 1 << 10};
+            LSMTree tree(options, "tree_data.data");
+            std::map<Key, Value> map;
+            auto apply_ops = [&](size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            apply_ops(kvs_cnt);
+            std::map<Key, Value> old_map = map;
+            Snapshot snapshot = tree.GetSnapshot();
+            apply_ops(kvs_cnt);
+
+            for (size_t j = 0; j < 4; ++j) {
+                std::map<Key, Value> model = j % 2 ? old_map : map;
+                std::vector<Key> keys(300);
+                std::vector<IO::Task<LookupResult>> lookups;
+                for (auto& key : keys) {
+                    key = GenerateRandomKey(gen, max_key_size);
+                    lookups.emplace_back(j % 2 ? tree.FindAsync(loop, key, snapshot) : tree.FindAsync(loop, key));
+                }
+                // The tasks see the tree as it was when they were made.
+                apply_ops(j < 2 ? 0 : 100);
+                auto res = loop.Run(IO::WhenAll(std::move(lookups)));
+                for (size_t k = 0; k < keys.size(); ++k) {
+                    auto it = model.find(keys[k]);
+                    assert(res[k] == (it == model.end() ? LookupResult() : LookupResult(it->second)));
+                }
+                if (j == 2) {
+                    old_map = map;
+                    tree.ReleaseSnapshot(snapshot);
+                    snapshot = tree.GetSnapshot();
+                }
+
+                std::vector<KeyRange> ranges;
+                std::vector<IO::Task<RangeLookupResult>> range_lookups;
+                for (size_t p = 0; p < 32; ++p) {
+                    KeyRange range{.lower = std::nullopt,
+                                   .upper = std::nullopt,
+                                   .including_lower = (p & 1) != 0,
+                                   .including_upper = (p & 2) != 0};
+                    if (p & 4) {
+                        range.lower = GenerateRandomKey(gen, max_key_size);
+                    }
+                    if (p & 8) {
+                        range.upper = GenerateRandomKey(gen, max_key_size);
+                    }
+                    ranges.emplace_back(range);
+                    range_lookups.emplace_back(p & 16 ? tree.FindRangeAsync(loop, range, snapshot)
+                                                      : tree.FindRangeAsync(loop, range));
+                }
+                auto range_res = loop.Run(IO::WhenAll(std::move(range_lookups)));
+                for (size_t p = 0; p < ranges.size(); ++p) {
+                    assert(range_res[p] == (p & 16 ? tree.FindRange(ranges[p], snapshot) : tree.FindRange(ranges[p])));
+                    RangeLookupResult correct_answer;
+                    for (const auto& [key, value] : p & 16 ? old_map : map) {
+                        if (IsInRange(ranges[p], key)) {
+                            correct_answer.emplace(key, value);
+                        }
+                    }
+                    assert(range_res[p] == correct_answer);
+                }
+            }
+            tree.ReleaseSnapshot(snapshot);
+
+            std::cout << "Test_LSMTree_Async " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Compaction_IO*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 4000;
+        size_t max_key_size = 2;
+        size_t max_value_size = 300;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 1400);
+            Path tree_data = "tree_data.data";
+            // Chunks of a block or two and write buffers smaller than some records, so compactions wait for their
+            // reads and writes all the time. io_uring and the fallback threads take turns.
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .mmap_sstable_reads = i % 4 == 3,
+                                   .sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9,
+                                   .sstable_write_buffer_size = 256,
+                                   .sstable_block_size = 512,
+                                   .scan_readahead_size = 1024,
+                                   .compaction_readahead_depth = i % 3 + 1,
+                                   .compaction_io_uring = i % 2 == 0};
+            std::map<Key, Value> map;
+            auto apply_ops = [&](LSMTree& tree, size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            auto check = [&](const LSMTree& tree, const std::map<Key, Value>& state, const Snapshot* snapshot) {
+                for (const auto& [key, value] : state) {
+                    assert((snapshot ? tree.Find(key, *snapshot) : tree.Find(key)) == value);
+                }
+                KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                             .including_upper = false};
+                assert((snapshot ? tree.FindRange(all, *snapshot) : tree.FindRange(all)) == state);
+            };
+
+            {
+                LSMTree tree(options, tree_data);
+                apply_ops(tree, kvs_cnt);
+                Snapshot snapshot = tree.GetSnapshot();
+                std::map<Key, Value> old_map = map;
+                apply_ops(tree, kvs_cnt);
+                check(tree, map, nullptr);
+                check(tree, old_map, &snapshot);
+                tree.ReleaseSnapshot(snapshot);
+            }
+
+            // The compacted sstables are whole on the disk.
+            LSMTree tree(tree_data);
+            check(tree, map, nullptr);
+            apply_ops(tree, kvs_cnt);
+            check(tree, map, nullptr);
+
+            std::cout << "Test_LSMTree_Compaction_IO " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Subcompactions*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 4000;
+        size_t max_key_size = 2;
+        size_t max_value_size = 100;
+
+        for (size_t i = 0; i < 10; ++i) {
+            std::mt19937 gen(i + 1500);
+            Path tree_data = "tree_data.data";
+            // Every compaction is split, into ranges of a few small blocks each. Later compactions merge runs of
+            // several sstables, and a snapshot keeps old versions around the cuts.
+            LSMTreeOptions options{.fd_cache_size = 5,
+                                   .mmap_sstable_reads = i % 4 == 3,
+                                   .sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 100,
+                                   .kv_buffer_slice_size = 1 << 12,
+                                   .filter_false_positive_rate = 0.1,
+                                   .compaction_thread_count = 2,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9,
+                                   .sstable_block_size = 256,
+                                   // A block per chunk, so a chunk may end before the key range of the input starts.
+                                   .scan_readahead_size = 256,
+                                   .compaction_io_uring = i % 2 == 0,
+                                   .max_subcompactions = i % 4 + 2,
+                                   .subcompaction_min_size = i % 3 == 0 ? 1 : size_t(1) << 12,
+                                   .subcompaction_thread_count = i % 3};
+            std::map<Key, Value> map;
+            auto apply_ops = [&](LSMTree& tree, size_t count) {
+                for (size_t j = 0; j < count; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        tree.Insert(key, value);
+                    }
+                }
+            };
+            auto check = [&](const LSMTree& tree, const std::map<Key, Value>& state, const Snapshot* snapshot) {
+                for (size_t j = 0; j < 500; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    auto it = state.find(key);
+                    LookupResult res = snapshot ? tree.Find(key, *snapshot) : tree.Find(key);
+                    assert(res == (it == state.end() ? LookupResult() : LookupResult(it->second)));
+                }
+                std::vector<Key> keys;
+                for (const auto& [key, value] : state) {
+                    keys.emplace_back(key);
+                }
+                auto res = snapshot ? tree.MultiGet(keys, *snapshot) : tree.MultiGet(keys);
+                for (size_t j = 0; j < keys.size(); ++j) {
+                    assert(res[j] == state.at(keys[j]));
+                }
+                KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                             .including_upper = false};
+                assert((snapshot ? tree.FindRange(all, *snapshot) : tree.FindRange(all)) == state);
+                auto it = snapshot ? tree.NewIterator(all, *snapshot) : tree.NewIterator(all);
+                auto expected = state.rbegin();
+                for (it.SeekToLast(); it.IsValid(); it.Prev(), ++expected) {
+                    assert(expected != state.rend());
+                    assert(Key(it.GetKey().begin(), it.GetKey().end()) == expected->first);
+                }
+                assert(expected == state.rend());
+            };
+
+            {
+                LSMTree tree(options, tree_data);
+                apply_ops(tree, kvs_cnt);
+                Snapshot snapshot = tree.GetSnapshot();
+                std::map<Key, Value> old_map = map;
+                apply_ops(tree, kvs_cnt * 2);
+                check(tree, map, nullptr);
+                check(tree, old_map, &snapshot);
+                tree.ReleaseSnapshot(snapshot);
+            }
+
+            // The runs of several sstables are persisted as such.
+            LSMTree tree(tree_data);
+            check(tree, map, nullptr);
+            apply_ops(tree, kvs_cnt);
+            check(tree, map, nullptr);
+
+            std::cout << "Test_LSMTree_Subcompactions " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_WAL_Write_Failure*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 500;
+        size_t max_key_size = 3;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 100; ++i) {
+            Path tree_data = "wal_failure.data";
+            Path log_path = "wal_failure.data_0.wal";
+            WAL::SyncMode sync_modes[] = {WAL::SyncMode::kEveryWrite, WAL::SyncMode::kPeriodic, WAL::SyncMode::kNone};
+            LSMTreeOptions options{.memtable_kv_count_limit = 100000, .wal_sync_mode = sync_modes[i % 3]};
+            // Longer than any generated key, so the failed write can't be shadowed by a later one.
+            Key failed_key(max_key_size + 1, static_cast<uint8_t>(i));
+
+            auto apply_ops = [&](std::map<Key, Value>& map, LSMTree* tree, size_t seed) {
+                std::mt19937 gen(seed);
+                for (size_t j = 0; j < kvs_cnt; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        if (tree) {
+                            tree->Erase(key);
+                        }
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        if (tree) {
+                            tree->Insert(key, value);
+                        }
+                    }
+                }
+            };
+
+            // The file size limit makes the write of the commit short and then fail with EFBIG, leaving a torn record
+            // unless the log is cut back. The writes after the failure must survive the crash.
+            pid_t pid = fork();
+            if (pid == 0) {
+                std::map<Key, Value> map;
+                LSMTree tree(options, tree_data);
+                apply_ops(map, &tree, i + 1300);
+                struct stat st;
+                assert(stat(log_path.c_str(), &st) == 0);
+                signal(SIGXFSZ, SIG_IGN);
+                rlimit old_limit;
+                getrlimit(RLIMIT_FSIZE, &old_limit);
+                rlimit limit{.rlim_cur = static_cast<rlim_t>(st.st_size) + 1 + i % 30, .rlim_max = old_limit.rlim_max};
+                setrlimit(RLIMIT_FSIZE, &limit);
+                bool failed = false;
+                try {
+                    tree.Insert(failed_key, Value(100, 1));
+                } catch (const std::runtime_error&) {
+                    failed = true;
+                }
+                setrlimit(RLIMIT_FSIZE, &old_limit);
+                if (!failed) {
+                    _exit(1);
+                }
+                apply_ops(map, &tree, i + 1400);
+                _exit(0);
+            }
+            int status;
+            waitpid(pid, &status, 0);
+            assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+            std::map<Key, Value> map;
+            apply_ops(map, nullptr, i + 1300);
+            apply_ops(map, nullptr, i + 1400);
+            LSMTree tree(tree_data);
+            assert(!tree.Find(failed_key).has_value());
+            KeyRange range{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                           .including_upper = false};
+            assert(tree.FindRange(range) == map);
+
+            std::cout << "Test_LSMTree_WAL_Write_Failure " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Crash_After_Reopen*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 1000;
+        size_t max_key_size = 3;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 100; ++i) {
+            Path tree_data = "crash_after_reopen.data";
+            LSMTreeOptions options{.sstable_scaling_factor = 3,
+                                   .memtable_kv_count_limit = 300,
+                                   .level0_slowdown_trigger = 6,
+                                   .level0_stop_trigger = 9,
+                                   .wal_sync_mode = WAL::SyncMode::kNone};
+
+            std::map<Key, Value> map;
+            auto apply_ops = [&](LSMTree* tree, size_t seed) {
+                std::mt19937 gen(seed);
+                for (size_t j = 0; j < kvs_cnt; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        if (tree) {
+                            tree->Erase(key);
+                        }
+                    } else {
+                        Value value = GenerateRandomValue(gen, max_value_size, false);
+                        map[key] = value;
+                        if (tree) {
+                            tree->Insert(key, value);
+                        }
+                    }
+                }
+            };
+
+            // The memtable closed with the tree lives in tree_data only, each crashed process below must keep it.
+            {
+                LSMTree tree(options, tree_data);
+                apply_ops(&tree, i + 1500);
+            }
+            for (size_t crash = 0; crash < 3; ++crash) {
+                pid_t pid = fork();
+                if (pid == 0) {
+                    LSMTree tree(tree_data);
+                    if (crash == 1) {
+                        apply_ops(&tree, i + 1600);
+                    }
+                    _exit(0);
+                }
+                int status;
+                waitpid(pid, &status, 0);
+                assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+                if (crash == 1) {
+                    apply_ops(nullptr, i + 1600);
+                }
+            }
+
+            LSMTree tree(tree_data);
+            KeyRange range{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                           .including_upper = false};
+            assert(tree.FindRange(range) == map);
+
+            std::cout << "Test_LSMTree_Crash_After_Reopen " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Baseline_Migration*/ () {
+        using namespace MyLSMTree;
+        using Memtable::BloomFilter;
+
+        size_t kvs_cnt = 300;
+        size_t max_key_size = 2;
+        size_t max_value_size = 30;
+
+        // Layout of tree_data before it got a header.
+        struct BaselineTreeParams {
+            size_t sstable_scaling_factor;
+            size_t memtable_kv_count_limit;
+            size_t memtable_kv_count;
+            double filter_false_positive_rate;
+            size_t bits_count;
+            size_t hash_func_count;
+            size_t kv_buffer_slice_size;
+            size_t fd_cache_size;
+            size_t level_count;
+        };
+        auto append = [](std::vector<uint8_t>& file, const void* data, size_t size) {
+            file.insert(file.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+        };
+        auto append_kv = [&append](std::vector<uint8_t>& file, const Key& key, const Value& value) {
+            KVSizes sizes{static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())};
+            append(file, &sizes, sizeof(sizes));
+            append(file, key.data(), key.size());
+            append(file, value.data(), value.size());
+        };
+        auto write_file = [](const Path& path, const std::vector<uint8_t>& file) {
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            assert(write(fd, file.data(), file.size()) == static_cast<ssize_t>(file.size()));
+            close(fd);
+        };
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 1700);
+            Path tree_data = "baseline_tree.data";
+            size_t scaling_factor = 3;
+            std::vector<size_t> sstable_counts{1 + gen() % 2, gen() % 3, 1 + gen() % 2};
+
+            // Baseline sstables are named by level and number, the oldest of a level first. Older levels are applied
+            // to the reference map first, tombstones are empty values.
+            std::map<Key, Value> map;
+            auto generate_kvs = [&](bool with_tombstones) {
+                std::map<Key, Value> kvs;
+                for (size_t j = 0; j < kvs_cnt; ++j) {
+                    bool tombstone = with_tombstones && gen() % 4 == 0;
+                    kvs[GenerateRandomKey(gen, max_key_size)] =
+                        tombstone ? Value{} : GenerateRandomValue(gen, max_value_size, false);
+                }
+                for (const auto& [key, value] : kvs) {
+                    if (value.empty()) {
+                        map.erase(key);
+                    } else {
+                        map[key] = value;
+                    }
+                }
+                return kvs;
+            };
+            for (size_t level = sstable_counts.size() - 1; ~level; --level) {
+                for (size_t number = 0; number < sstable_counts[level]; ++number) {
+                    auto kvs = generate_kvs(level + 1 < sstable_counts.size());
+                    BloomFilter filter(kvs.size() * 8, 4);
+                    std::vector<uint8_t> file;
+                    std::vector<Offset> offsets;
+                    for (const auto& [key, value] : kvs) {
+                        offsets.emplace_back(file.size());
+                        append_kv(file, key, value);
+                        filter.Insert(key);
+                    }
+                    MetaBlock meta{.filter_offset = file.size(),
+                                   .filter_bits_count = filter.BitsCount(),
+                                   .filter_hash_func_count = filter.HashFuncCount(),
+                                   .index_offset = file.size() + filter.GetSizeInBytes(),
+                                   .kv_count = kvs.size()};
+                    append(file, filter.Data(), filter.GetSizeInBytes());
+                    append(file, offsets.data(), offsets.size() * sizeof(offsets[0]));
+                    append(file, &meta, kLegacyMetaBlockSize);
+                    write_file(std::to_string(level) + '_' + std::to_string(number) + ".sst", file);
+                }
+            }
+            auto memtable_kvs = generate_kvs(true);
+            auto make_baseline_state = [&](const std::vector<size_t>& counts) {
+                BaselineTreeParams params{.sstable_scaling_factor = scaling_factor,
+                                          .memtable_kv_count_limit = kvs_cnt * 2,
+                                          .memtable_kv_count = memtable_kvs.size(),
+                                          .filter_false_positive_rate = 0.1,
+                                          .bits_count = 0,
+                                          .hash_func_count = 0,
+                                          .kv_buffer_slice_size = 1000,
+                                          .fd_cache_size = 10,
+                                          .level_count = counts.size()};
+                std::vector<uint8_t> file;
+                append(file, &params, sizeof(params));
+                append(file, counts.data(), counts.size() * sizeof(counts[0]));
+                for (const auto& [key, value] : memtable_kvs) {
+                    append_kv(file, key, value);
+                }
+                return file;
+            };
+            write_file(tree_data, make_baseline_state(sstable_counts));
+
+            KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                         .including_upper = false};
+            {
+                LSMTree tree(tree_data);
+                assert(tree.FindRange(all) == map);
+                for (size_t j = 0; j < 300; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    auto it = map.find(key);
+                    assert(tree.Find(key) == (it == map.end() ? LookupResult() : LookupResult(it->second)));
+                }
+                // The migrated sstables take part in flushes and compactions like any other.
+                for (size_t j = 0; j < kvs_cnt * 10; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    if (gen() % 4 == 0) {
+                        map.erase(key);
+                        tree.Erase(key);
+                    } else {
+                        map[key] = GenerateRandomValue(gen, max_value_size, false);
+                        tree.Insert(key, map[key]);
+                    }
+                }
+                assert(tree.FindRange(all) == map);
+            }
+            for (size_t level = 0; level < sstable_counts.size(); ++level) {
+                for (size_t number = 0; number < sstable_counts[level]; ++number) {
+                    Path path = std::to_string(level) + '_' + std::to_string(number) + ".sst";
+                    assert(access(path.c_str(), F_OK) != 0);
+                }
+            }
+            {
+                LSMTree tree(tree_data);
+                assert(tree.FindRange(all) == map);
+            }
+
+            // Layouts that are neither the current one nor the baseline one are rejected.
+            std::vector<uint8_t> state;
+            int fd = open(tree_data.c_str(), O_RDONLY);
+            uint8_t chunk[1 << 12];
+            ssize_t r;
+            while ((r = read(fd, chunk, sizeof(chunk))) > 0) {
+                state.insert(state.end(), chunk, chunk + r);
+            }
+            close(fd);
+            auto rejects = [&](const std::vector<uint8_t>& file) {
+                write_file("broken_tree.data", file);
+                try {
+                    LSMTree tree("broken_tree.data");
+                } catch (const std::runtime_error&) {
+                    return true;
+                }
+                return false;
+            };
+            std::vector<uint8_t> broken = state;
+            ++broken[8];
+            assert(rejects(broken));
+            broken = state;
+            broken.resize(broken.size() - 1 - gen() % (broken.size() - 1));
+            assert(rejects(broken));
+            // A baseline state without sstables opens as long as it is well formed.
+            std::vector<uint8_t> baseline_state = make_baseline_state({0, 0});
+            assert(!rejects(baseline_state));
+            broken = baseline_state;
+            reinterpret_cast<BaselineTreeParams*>(broken.data())->sstable_scaling_factor = 0;
+            assert(rejects(broken));
+            broken = baseline_state;
+            broken.emplace_back(0);
+            assert(rejects(broken));
+            broken = baseline_state;
+            broken.resize(broken.size() - 1 - gen() % (broken.size() - 1));
+            assert(rejects(broken));
+
+            std::cout << "Test_LSMTree_Baseline_Migration " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Background_Work*/ () {
+        using namespace MyLSMTree;
+
+        size_t thread_cnt = 4;
+        size_t kvs_per_thread = 2000;
+        size_t max_value_size = 20;
+
+        for (size_t i = 0; i < 100; ++i) {
+            LSMTreeOptions options{.fd_cache_size = 10,
+                                   .sstable_scaling_factor = 2,
+                                   .memtable_kv_count_limit = 20 + i % 30,
+                                   .kv_buffer_slice_size = 1000,
+                                   .level0_slowdown_trigger = 2,
+                                   .level0_stop_trigger = 3,
+                                   .wal_sync_mode = WAL::SyncMode::kNone};
+            KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                         .including_upper = false};
+
+            // Every writer has keys of its own, so the final state doesn't depend on how the writes interleave. A
+            // writer stops at the first error, the writes that failed must not be applied.
+            std::vector<std::map<Key, Value>> maps(thread_cnt);
+            auto run_writers = [&](LSMTree& tree, size_t seed) {
+                std::atomic<size_t> failed_writers = 0;
+                std::vector<std::thread> threads;
+                for (size_t t = 0; t < thread_cnt; ++t) {
+                    threads.emplace_back([&, t] {
+                        std::mt19937 gen(seed + t);
+                        for (size_t j = 0; j < kvs_per_thread; ++j) {
+                            Key key{static_cast<uint8_t>(t), static_cast<uint8_t>(gen()), static_cast<uint8_t>(gen())};
+                            bool erase = gen() % 4 == 0;
+                            Value value = GenerateRandomValue(gen, max_value_size, false);
+                            try {
+                                if (erase) {
+                                    tree.Erase(key);
+                                } else {
+                                    tree.Insert(key, value);
+                                }
+                            } catch (const std::runtime_error&) {
+                                ++failed_writers;
+                                return;
+                            }
+                            if (erase) {
+                                maps[t].erase(key);
+                            } else {
+                                maps[t][key] = value;
+                            }
+                        }
+                    });
+                }
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+                return failed_writers.load();
+            };
+            auto merged_maps = [&] {
+                std::map<Key, Value> map;
+                for (const auto& thread_map : maps) {
+                    map.insert(thread_map.begin(), thread_map.end());
+                }
+                return map;
+            };
+
+            auto run_tree = [&](const LSMTreeOptions& options, size_t seed) {
+                maps.assign(thread_cnt, {});
+                LSMTree tree(options, "background_work.data");
+                assert(run_writers(tree, seed) == 0);
+                assert(tree.FindRange(all) == merged_maps());
+                BackgroundWorkStatistics statistics = tree.GetBackgroundWorkStatistics();
+                assert(statistics.max_level0_run_count <= options.level0_stop_trigger);
+                assert(statistics.max_concurrent_compactions <= options.compaction_thread_count);
+                return statistics;
+            };
+
+            // Writers are delayed once level 0 reaches the slowdown trigger.
+            assert(run_tree(options, i + 1800).write_slowdowns > 0);
+            // Without the delays, flushes outrun the single compaction thread while it is busy with a deeper level.
+            // Whether they do in a single run depends on the timing, so a few runs are given the chance.
+            LSMTreeOptions no_slowdown_options = options;
+            no_slowdown_options.level0_slowdown_trigger = kvs_per_thread;
+            for (size_t attempt = 0; run_tree(no_slowdown_options, i + 1850 + attempt).write_stops == 0; ++attempt) {
+                assert(attempt < 10);
+            }
+            // With more threads, level 0 is compacted while a deeper level is.
+            no_slowdown_options.compaction_thread_count = 3;
+            assert(run_tree(no_slowdown_options, i + 1870).max_concurrent_compactions >= 2);
+
+            // The first flush of a new tree fails, as its sstable path is taken by a directory. Every writer gets the
+            // error instead of waiting forever, and the writes made before it survive the tree.
+            maps.assign(thread_cnt, {});
+            Path tree_data = "background_error.data";
+            unlink("0.sst");
+            assert(mkdir("0.sst", 0755) == 0);
+            {
+                LSMTree tree(options, tree_data);
+                assert(run_writers(tree, i + 1900) == thread_cnt);
+            }
+            rmdir("0.sst");
+            LSMTree tree(tree_data);
+            assert(tree.FindRange(all) == merged_maps());
+
+            std::cout << "Test_LSMTree_Background_Work " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_LSMTree_Reads_During_Flush*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 5000;
+        size_t reader_cnt = 3;
+
+        for (size_t i = 0; i < 100; ++i) {
+            Path tree_data = "reads_during_flush.data";
+            LSMTreeOptions options{.fd_cache_size = 10,
+                                   .sstable_scaling_factor = 4,
+                                   .memtable_kv_count_limit = 50 + i % 100,
+                                   .kv_buffer_slice_size = 1000,
+                                   .level0_slowdown_trigger = 8,
+                                   .level0_stop_trigger = 12,
+                                   .wal_sync_mode = WAL::SyncMode::kNone};
+            auto make_key = [](size_t j) {
+                return Key{static_cast<uint8_t>(j >> 16), static_cast<uint8_t>(j >> 8), static_cast<uint8_t>(j)};
+            };
+            auto make_value = [i](size_t j) {
+                return Value(1 + (i + j) % 40, static_cast<uint8_t>(i * 31 + j));
+            };
+
+            // The writer inserts every key once and then erases every third one. Memtables are switched and flushed
+            // all the time, so readers often find a key in the immutable memtable. Readers only check keys whose
+            // insert or erase was done before the lookup started.
+            std::atomic<size_t> inserted = 0;
+            std::atomic<size_t> erased = 0;
+            std::atomic<bool> done = false;
+            {
+                LSMTree tree(options, tree_data);
+                std::vector<std::thread> readers;
+                for (size_t r = 0; r < reader_cnt; ++r) {
+                    readers.emplace_back([&, r] {
+                        std::mt19937 gen(i * reader_cnt + r + 2000);
+                        while (!done.load()) {
+                            size_t inserted_before = inserted.load();
+                            size_t erased_before = erased.load();
+                            if (inserted_before == 0) {
+                                continue;
+                            }
+                            size_t j = gen() % inserted_before;
+                            LookupResult res = tree.Find(make_key(j));
+                            if (j % 3 == 0 && j < erased_before) {
+                                assert(!res.has_value());
+                            } else if (j % 3 != 0) {
+                                assert(res == make_value(j));
+                            }
+                        }
+                    });
+                }
+                for (size_t j = 0; j < kvs_cnt; ++j) {
+                    tree.Insert(make_key(j), make_value(j));
+                    inserted = j + 1;
+                }
+                for (size_t j = 0; j < kvs_cnt; j += 3) {
+                    tree.Erase(make_key(j));
+                    erased = j + 1;
+                }
+                done = true;
+                for (auto& reader : readers) {
+                    reader.join();
+                }
+            }
+
+            LSMTree tree(tree_data);
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                assert(tree.Find(make_key(j)) == (j % 3 == 0 ? LookupResult() : LookupResult(make_value(j))));
+            }
+
+            std::cout << "Test_LSMTree_Reads_During_Flush " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_SSTable_Table_Cache*/ () {
+        using namespace MyLSMTree;
+        using SSTable::SSTableReadersManager;
+
+        size_t table_cnt = 10;
+        size_t kvs_cnt = 500;
+        size_t max_key_size = 4;
+        size_t max_value_size = 50;
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 2100);
+            std::vector<Path> paths;
+            std::vector<std::map<Key, Value>> tables;
+            for (size_t t = 0; t < table_cnt; ++t) {
+                paths.emplace_back("table_cache_" + std::to_string(t) + ".sst");
+                tables.emplace_back(GenerateRandomKVs(gen, kvs_cnt, max_key_size, max_value_size));
+                WriteSSTable(paths.back(), tables.back());
+            }
+            auto check_reader = [&](const SSTableReadersManager::SSTableReader& reader, size_t t) {
+                for (size_t j = 0; j < 50; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    auto it = tables[t].find(key);
+                    assert(reader.Find(key).first == (it == tables[t].end() ? LookupResult() : it->second));
+                }
+            };
+            auto use_table = [&](SSTableReadersManager& manager, size_t t) {
+                check_reader(manager.CreateReader(paths[t]), t);
+            };
+            // A table is open iff it can still be read after its file is gone behind the manager's back.
+            auto is_open = [&](SSTableReadersManager& manager, size_t t) {
+                try {
+                    check_reader(manager.CreateReader(paths[t]), t);
+                } catch (const std::runtime_error&) {
+                    return false;
+                }
+                return true;
+            };
+
+            // Charges of the tables are about the same, the budget holds three of them.
+            size_t charge;
+            {
+                SSTableReadersManager manager(table_cnt);
+                use_table(manager, 0);
+                charge = manager.MemoryUsage();
+                assert(charge > 0);
+            }
+            size_t budget = charge * 7 / 2;
+            bool use_mmap = i % 2;
+            SSTableReadersManager manager(table_cnt, budget, SSTableReadersManager::kDefaultScanReadaheadSize, 0,
+                                          use_mmap);
+            assert(manager.MemoryBudget() == budget);
+            for (size_t j = 0; j < table_cnt * 4; ++j) {
+                use_table(manager, gen() % table_cnt);
+                assert(manager.MemoryUsage() <= budget);
+            }
+
+            // Tables in use are never evicted, so the budget may be exceeded until they are released.
+            std::vector<SSTableReadersManager::SSTableReader> pinned;
+            for (size_t t = 0; t < table_cnt; ++t) {
+                pinned.emplace_back(manager.CreateReader(paths[t]));
+            }
+            assert(manager.MemoryUsage() > budget);
+            for (size_t t = 0; t < table_cnt; ++t) {
+                check_reader(pinned[t], t);
+            }
+            pinned.clear();
+            assert(manager.MemoryUsage() <= budget);
+
+            // The least recently used tables are evicted first.
+            for (size_t t = 0; t < table_cnt; ++t) {
+                use_table(manager, t);
+            }
+            use_table(manager, 6);
+            use_table(manager, 8);
+            for (const auto& path : paths) {
+                unlink(path.c_str());
+            }
+            assert(is_open(manager, 9));
+            assert(is_open(manager, 8));
+            assert(is_open(manager, 6));
+            assert(!is_open(manager, 7));
+            assert(!is_open(manager, 0));
+            for (size_t t = 0; t < table_cnt; ++t) {
+                WriteSSTable(paths[t], tables[t]);
+            }
+
+            // Without a memory limit, the unused tables are capped by the cache size.
+            SSTableReadersManager small_manager(2);
+            for (size_t t : {0, 1, 0, 2}) {
+                use_table(small_manager, t);
+            }
+            unlink(paths[0].c_str());
+            unlink(paths[1].c_str());
+            assert(is_open(small_manager, 0));
+            assert(!is_open(small_manager, 1));
+            WriteSSTable(paths[0], tables[0]);
+            WriteSSTable(paths[1], tables[1]);
+
+            // A table unlinked while in use stays readable, it is closed with its last reader.
+            {
+                auto reader = manager.CreateReader(paths[3]);
+                size_t usage = manager.MemoryUsage();
+                manager.Unlink(paths[3]);
+                assert(access(paths[3].c_str(), F_OK) != 0);
+                check_reader(reader, 3);
+                assert(manager.MemoryUsage() == usage);
+            }
+            assert(!is_open(manager, 3));
+            for (size_t t = 0; t < table_cnt; ++t) {
+                manager.Unlink(paths[t]);
+            }
+            assert(manager.MemoryUsage() == 0);
+
+            std::cout << "Test_SSTable_Table_Cache " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_BlockCache*/ () {
+        using namespace MyLSMTree;
+        using SSTable::BlockCache;
+
+        size_t block_size = 200;
+        // Every shard has room for about 16 blocks.
+        size_t capacity = BlockCache::kShardCount * 16 * (block_size + 128);
+
+        // The contents of a block tell its key, so a block returned for another key is noticed.
+        auto make_block = [&](uint64_t table_id, Offset offset) {
+            auto block = std::make_shared<BlockCache::Block>(block_size);
+            for (size_t k = 0; k < block->size(); ++k) {
+                (*block)[k] = static_cast<uint8_t>(table_id * 131 + offset * 7 + k);
+            }
+            return BlockCache::BlockPtr(std::move(block));
+        };
+        auto check_block = [&](const BlockCache::BlockPtr& block, uint64_t table_id, Offset offset) {
+            assert(block && *block == *make_block(table_id, offset));
+        };
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 2200);
+            uint64_t lookups = 0;
+            uint64_t hits = 0;
+            auto lookup = [&](BlockCache& cache, uint64_t table_id, Offset offset) {
+                auto block = cache.Lookup(table_id, offset);
+                ++lookups;
+                if (block) {
+                    ++hits;
+                    check_block(block, table_id, offset);
+                }
+                return block != nullptr;
+            };
+
+            // The first insert of a block wins, and a block bigger than a shard is handed back without being cached,
+            // even if it fits into the whole cache.
+            {
+                BlockCache cache(capacity);
+                assert(!lookup(cache, 1, 0));
+                auto first = cache.Insert(1, 0, make_block(1, 0));
+                assert(cache.Insert(1, 0, make_block(1, 0)) == first);
+                assert(lookup(cache, 1, 0));
+                auto huge = std::make_shared<const BlockCache::Block>(capacity / BlockCache::kShardCount + 1);
+                assert(cache.Insert(2, 0, huge) == huge);
+                assert(!lookup(cache, 2, 0));
+                auto statistics = cache.GetStatistics();
+                assert(statistics.hits == hits && statistics.misses == lookups - hits);
+                assert(statistics.capacity == capacity);
+            }
+
+            // A scan of blocks read once doesn't evict the hot blocks that are read all along, the reference bit
+            // saves them from the clock hand. Hot blocks that are not read again age out like any other.
+            for (bool keep_reading_hot : {true, false}) {
+                BlockCache cache(capacity);
+                uint64_t hot_table = 1000 + i;
+                for (Offset offset = 0; offset < 32; ++offset) {
+                    cache.Insert(hot_table, offset, make_block(hot_table, offset));
+                    assert(lookup(cache, hot_table, offset));
+                }
+                for (Offset offset = 0; offset < 2000; ++offset) {
+                    assert(!lookup(cache, hot_table + 1, offset));
+                    cache.Insert(hot_table + 1, offset, make_block(hot_table + 1, offset));
+                    if (keep_reading_hot && offset % 8 == 7) {
+                        for (Offset hot_offset = 0; hot_offset < 32; ++hot_offset) {
+                            assert(lookup(cache, hot_table, hot_offset));
+                        }
+                    }
+                    assert(cache.GetStatistics().usage <= capacity);
+                }
+                size_t hot_left = 0;
+                for (Offset offset = 0; offset < 32; ++offset) {
+                    hot_left += cache.Lookup(hot_table, offset) != nullptr;
+                }
+                assert(keep_reading_hot ? hot_left == 32 : hot_left == 0);
+                size_t cold_left = 0;
+                for (Offset offset = 0; offset < 2000; ++offset) {
+                    cold_left += cache.Lookup(hot_table + 1, offset) != nullptr;
+                }
+                assert(cold_left > 0 && cold_left * (block_size + 64) <= capacity);
+            }
+
+            // Threads share the cache, the shards keep its statistics and capacity right.
+            BlockCache cache(capacity);
+            std::atomic<uint64_t> thread_lookups = 0;
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < 4; ++t) {
+                threads.emplace_back([&, t] {
+                    std::mt19937 thread_gen(i * 4 + t + 2300);
+                    for (size_t j = 0; j < 5000; ++j) {
+                        uint64_t table_id = thread_gen() % 4;
+                        Offset offset = thread_gen() % 200;
+                        auto block = cache.Lookup(table_id, offset);
+                        ++thread_lookups;
+                        if (!block) {
+                            block = cache.Insert(table_id, offset, make_block(table_id, offset));
+                        }
+                        check_block(block, table_id, offset);
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            auto statistics = cache.GetStatistics();
+            assert(statistics.hits + statistics.misses == thread_lookups);
+            assert(statistics.hits > 0 && statistics.misses > 0);
+            assert(statistics.usage <= capacity);
+
+            std::cout << "Test_BlockCache " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_SSTable_Vectored_Writer*/ () {
+        using namespace MyLSMTree;
+        using Memtable::BloomFilter;
+        using SSTable::SSTableReadersManager;
+        using SSTable::SSTableWriter;
+
+        size_t kvs_cnt = 1500;
+        size_t max_key_size = 4;
+
+        auto read_file = [](const Path& path) {
+            std::vector<uint8_t> file;
+            int fd = open(path.c_str(), O_RDONLY);
+            uint8_t chunk[1 << 16];
+            ssize_t r;
+            while ((r = read(fd, chunk, sizeof(chunk))) > 0) {
+                file.insert(file.end(), chunk, chunk + r);
+            }
+            close(fd);
+            return file;
+        };
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 2400);
+            // Values around kMinReferencedSize are either copied or written from where they are. With a large
+            // buffer, the writer runs out of iovecs before it fills the buffer.
+            std::map<Key, Value> kvs;
+            while (kvs.size() < kvs_cnt) {
+                size_t value_size = SSTableWriter::kMinReferencedSize - 64 + gen() % 1024;
+                kvs[GenerateRandomKey(gen, max_key_size)] = Value(value_size, static_cast<uint8_t>(gen()));
+            }
+            BloomFilter filter(kvs.size() * 8, 4);
+            for (const auto& [key, value] : kvs) {
+                filter.Insert(key);
+            }
+            size_t buffer_sizes[] = {1 << 22, 1 << 12, 1 + gen() % 3000};
+            size_t buffer_size = buffer_sizes[i % 3];
+            size_t block_size = 1 + gen() % 8192;
+
+            // The values are stable until the writer is done, like the kv buffer of a memtable being flushed.
+            auto write = [&](const Path& path, bool vectored) {
+                int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                {
+                    SSTableWriter writer(fd, buffer_size, vectored, block_size);
+                    for (const auto& [key, value] : kvs) {
+                        writer.AddKVSizes({static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size())},
+                                          0);
+                        writer.Append(key.data(), key.size());
+                        writer.AppendStable(value.data(), value.size());
+                    }
+                    writer.Finish(filter);
+                }
+                close(fd);
+            };
+            write("copied.sst", false);
+            write("vectored.sst", true);
+            assert(read_file("copied.sst") == read_file("vectored.sst"));
+
+            SSTableReadersManager manager(1);
+            {
+                auto reader = manager.CreateReader("vectored.sst");
+                assert(reader.GetKVCount() == kvs.size());
+                for (const auto& [key, value] : kvs) {
+                    assert(reader.Find(key).first == value);
+                }
+                KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                             .including_upper = false};
+                assert(ScanSSTable(reader, all) == kvs);
+            }
+            manager.Unlink("vectored.sst");
+            unlink("copied.sst");
+
+            std::cout << "Test_SSTable_Vectored_Writer " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_SSTable_Scan_Readahead*/ () {
+        using namespace MyLSMTree;
+        using SSTable::SSTableReadersManager;
+
+        size_t kvs_cnt = 1000;
+        size_t max_key_size = 3;
+        size_t max_value_size = 3000;
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 2500);
+            // Tombstones are empty values, range lookups leave them out and iterators don't.
+            std::map<Key, Value> kvs;
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                kvs[GenerateRandomKey(gen, max_key_size)] = GenerateRandomValue(gen, max_value_size, true);
+            }
+            WriteSSTable("scan.sst", kvs, SSTable::SSTableWriter::kDefaultBufferSize, false, 1 << 12);
+
+            // Every refill is smaller than a block and most records are longer than a refill, so records keep
+            // crossing the end of the buffer.
+            size_t readahead_sizes[] = {1, 1 + gen() % 64, 1 + gen() % 4096};
+            size_t readahead_size = readahead_sizes[i % 3];
+            SSTableReadersManager manager(1, SSTableReadersManager::kDefaultMemoryBudget, readahead_size, 0,
+                                          i % 4 == 3);
+            {
+                auto reader = manager.CreateReader("scan.sst");
+                KeyRange all{.lower = std::nullopt, .upper = std::nullopt, .including_lower = false,
+                             .including_upper = false};
+                std::map<Key, Value> live;
+                for (const auto& [key, value] : kvs) {
+                    if (!value.empty()) {
+                        live[key] = value;
+                    }
+                }
+                assert(ScanSSTable(reader, all) == live);
+                for (size_t j = 0; j < 20; ++j) {
+                    KeyRange range{.lower = GenerateRandomKey(gen, max_key_size),
+                                   .upper = GenerateRandomKey(gen, max_key_size),
+                                   .including_lower = gen() % 2 == 0,
+                                   .including_upper = gen() % 2 == 0};
+                    RangeLookupResult correct_answer;
+                    for (const auto& [key, value] : live) {
+                        if (IsInRange(range, key)) {
+                            correct_answer[key] = value;
+                        }
+                    }
+                    assert(ScanSSTable(reader, range) == correct_answer);
+                }
+
+                auto it = reader.NewIterator();
+                auto expected = kvs.begin();
+                for (it.SeekToFirst(); it.IsValid(); it.Next(), ++expected) {
+                    assert(expected != kvs.end());
+                    assert(Key(it.GetKey().begin(), it.GetKey().end()) == expected->first);
+                    assert(Value(it.GetValue().begin(), it.GetValue().end()) == expected->second);
+                }
+                assert(expected == kvs.end());
+                for (size_t j = 0; j < 20; ++j) {
+                    Key key = GenerateRandomKey(gen, max_key_size);
+                    auto expected = kvs.lower_bound(key);
+                    it.Seek(key);
+                    for (size_t k = 0; k < 10 && expected != kvs.end(); ++k, it.Next(), ++expected) {
+                        assert(it.IsValid());
+                        assert(Key(it.GetKey().begin(), it.GetKey().end()) == expected->first);
+                        assert(Value(it.GetValue().begin(), it.GetValue().end()) == expected->second);
+                    }
+                    assert(it.IsValid() == (expected != kvs.end()));
+                }
+            }
+            manager.Unlink("scan.sst");
+
+            std::cout << "Test_SSTable_Scan_Readahead " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_BloomFilter_Insert_Hashes*/ () {
+        using namespace MyLSMTree;
+        using Memtable::BloomFilter;
+
+        size_t keys_cnt = 1000;
+        size_t max_key_size = 40;
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 2600);
+            std::vector<Key> keys(keys_cnt);
+            std::vector<BloomFilter::KeyHash> hashes(keys_cnt);
+            for (size_t j = 0; j < keys_cnt; ++j) {
+                keys[j] = GenerateRandomKey(gen, max_key_size);
+                hashes[j] = CalculateHash(keys[j].data(), keys[j].size());
+            }
+
+            size_t bits_count = 64 + gen() % (keys_cnt * 16);
+            size_t hash_func_count = 1 + gen() % 10;
+            for (auto type : {FilterType::kStandard, FilterType::kBlocked}) {
+                BloomFilter one_by_one(bits_count, hash_func_count, type);
+                for (const auto& key : keys) {
+                    one_by_one.Insert(key);
+                }
+                // Batches of random sizes, empty ones included, must set the very same bits.
+                BloomFilter batched(bits_count, hash_func_count, type);
+                for (size_t first = 0; first < keys_cnt;) {
+                    size_t batch_size = std::min<size_t>(gen() % 300, keys_cnt - first);
+                    batched.InsertHashes(std::span(hashes).subspan(first, batch_size));
+                    first += batch_size;
+                }
+                assert(batched.BitsCount() == one_by_one.BitsCount());
+                assert(batched.HashFuncCount() == one_by_one.HashFuncCount());
+                assert(batched.GetSizeInBytes() == one_by_one.GetSizeInBytes());
+                assert(std::memcmp(batched.Data(), one_by_one.Data(), batched.GetSizeInBytes()) == 0);
+                for (const auto& key : keys) {
+                    assert(batched.Find(key));
+                }
+            }
+
+            std::cout << "Test_BloomFilter_Insert_Hashes " << i << " OK" << std::endl;
+        }
+    },
+    [] /*Test_Memtable_Key_Prefixes*/ () {
+        using namespace MyLSMTree;
+
+        size_t kvs_cnt = 300;
+        size_t max_value_size = 100;
+
+        for (size_t i = 0; i < 100; ++i) {
+            std::mt19937 gen(i + 2700);
+            // Keys that tie on the inline prefix: shorter than it and differing only in trailing zeros, or sharing all
+            // of its bytes and differing in the rest.
+            Key long_stem = GenerateRandomKey(gen, 1);
+            long_stem.resize(8, 0xff);
+            Key other_long_stem = long_stem;
+            other_long_stem.back() = 0;
+            std::vector<Key> stems = {{}, {0}, {'a'}, {'a', 0, 0}, long_stem, other_long_stem};
+            auto generate_key = [&]() {
+                Key key = stems[gen() % stems.size()];
+                size_t tail_size = gen() % 7;
+                for (size_t k = 0; k < tail_size; ++k) {
+                    key.push_back(std::vector<uint8_t>{0, 1, 'a', 0xff}[gen() % 4]);
+                }
+                if (key.empty()) {
+                    key.push_back(0);
+                }
+                return key;
+            };
+
+            Memtable::Memtable table(100000, 10000, i);
+            std::map<Key, Value> kvs;
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                Key key = generate_key();
+                Value value = GenerateRandomValue(gen, max_value_size, true);
+                table.Insert(key, value, j + 1);
+                kvs[key] = value;
+            }
+
+            std::vector<Key> keys;
+            for (size_t j = 0; j < kvs_cnt; ++j) {
+                keys.push_back(generate_key());
+            }
+            std::vector<const Key*> key_ptrs;
+            for (const auto& key : keys) {
+                key_ptrs.push_back(&key);
+            }
+            std::vector<LookupResult> results = table.MultiFind(key_ptrs);
+            for (size_t j = 0; j < keys.size(); ++j) {
+                auto it = kvs.find(keys[j]);
+                LookupResult correct_answer = it == kvs.end() ? std::nullopt : LookupResult(it->second);
+                assert(table.Find(keys[j]) == correct_answer);
+                assert(results[j] == correct_answer);
+            }
+
+            for (size_t j = 0; j < 50; ++j) {
+                KeyRange range{.lower = generate_key(),
+                               .upper = generate_key(),
+                               .including_lower = gen() % 2 == 0,
+                               .including_upper = gen() % 2 == 0};
+                RangeLookupResult correct_answer;
+                for (const auto& [key, value] : kvs) {
+                    if (IsInRange(range, key) && !value.empty()) {
+                        correct_answer[key] = value;
+                    }
+                }
+                assert(table.FindRange(range) == correct_answer);
+            }
+
+            std::cout << "Test_Memtable_Key_Prefixes " << i << " OK" << std::endl;
+        }
     }};
 
 void Test_All() {